@@ -0,0 +1,777 @@
+/*
+ * xpldd: tar and cpio archives as a sysroot, without extracting them
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <map>
+
+#include "archivefs.h"
+
+using namespace std;
+
+extern "C" {
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#ifdef HAVE_ZLIB
+	#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+	#include <zstd.h>
+#endif
+}
+
+// enough to tell what a member is without keeping all of it
+#define HEAD_SIZE 4096
+// more than any name or extension header needs; these are read whole
+#define MAX_HEADER_DATA (1 << 20)
+
+// Where the archive's bytes come from, in order. Pointers from read() and
+// peek() are good until the next call, unless stable() says they live as
+// long as the source does.
+class ArchiveFs::Source {
+public:
+	virtual ~Source() {}
+	virtual const unsigned char *peek(size_t n) = 0;
+	virtual const unsigned char *read(size_t n) = 0;
+	virtual bool stable() const = 0;
+
+	bool skip(size_t n)
+	{
+		while (n > 0) {
+			size_t chunk = min(n, (size_t)65536);
+			if (read(chunk) == nullptr) {
+				return false;
+			}
+			n -= chunk;
+		}
+		return true;
+	}
+
+	bool read_into(unsigned char *dst, size_t n)
+	{
+		while (n > 0) {
+			size_t chunk = min(n, (size_t)65536);
+			const unsigned char *src = read(chunk);
+			if (src == nullptr) {
+				return false;
+			}
+			memcpy(dst, src, chunk);
+			dst += chunk;
+			n -= chunk;
+		}
+		return true;
+	}
+};
+
+class ArchiveFs::MappedSource : public ArchiveFs::Source {
+public:
+	MappedSource(const unsigned char *base, size_t size)
+		: _base(base), _size(size), _pos(0) {}
+
+	const unsigned char *peek(size_t n)
+	{
+		return n <= _size - _pos ? _base + _pos : nullptr;
+	}
+	const unsigned char *read(size_t n)
+	{
+		const unsigned char *p = peek(n);
+		if (p != nullptr) {
+			_pos += n;
+		}
+		return p;
+	}
+	bool stable() const { return true; }
+
+private:
+	const unsigned char *_base;
+	size_t _size, _pos;
+};
+
+enum StreamKind {
+	STREAM_RAW,
+	STREAM_GZIP,
+	STREAM_ZSTD,
+};
+
+class ArchiveFs::StreamSource : public ArchiveFs::Source {
+public:
+	StreamSource(int fd, StreamKind kind);
+	~StreamSource();
+	bool ok() const { return _ok; }
+
+	const unsigned char *peek(size_t n)
+	{
+		return ensure(n) ? &_buf[_pos] : nullptr;
+	}
+	const unsigned char *read(size_t n)
+	{
+		if (!ensure(n)) {
+			return nullptr;
+		}
+		const unsigned char *p = &_buf[_pos];
+		_pos += n;
+		return p;
+	}
+	bool stable() const { return false; }
+
+private:
+	bool ensure(size_t n);
+	ssize_t fill(unsigned char *dst, size_t n);
+
+	int _fd;
+	StreamKind _kind;
+	bool _ok;
+	vector<unsigned char> _buf;
+	size_t _pos, _len;
+#ifdef HAVE_ZLIB
+	gzFile _gz;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DCtx *_zstd;
+	vector<unsigned char> _in;
+	ZSTD_inBuffer _in_buf;
+#endif
+};
+
+ArchiveFs::StreamSource::StreamSource(int fd, StreamKind kind)
+	: _fd(fd), _kind(kind), _ok(false), _pos(0), _len(0)
+{
+	switch (kind) {
+	case STREAM_RAW:
+		_ok = true;
+		break;
+	case STREAM_GZIP:
+#ifdef HAVE_ZLIB
+		// gzclose closes the fd it was given, and we own _fd
+		_gz = gzdopen(dup(fd), "rb");
+		_ok = _gz != nullptr;
+#endif
+		break;
+	case STREAM_ZSTD:
+#ifdef HAVE_ZSTD
+		_zstd = ZSTD_createDCtx();
+		_in.resize(ZSTD_DStreamInSize());
+		_in_buf.src = _in.data();
+		_in_buf.size = _in_buf.pos = 0;
+		_ok = _zstd != nullptr;
+#endif
+		break;
+	}
+}
+
+ArchiveFs::StreamSource::~StreamSource()
+{
+#ifdef HAVE_ZLIB
+	if (_kind == STREAM_GZIP && _ok) {
+		gzclose(_gz);
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (_kind == STREAM_ZSTD && _ok) {
+		ZSTD_freeDCtx(_zstd);
+	}
+#endif
+}
+
+ssize_t ArchiveFs::StreamSource::fill(unsigned char *dst, size_t n)
+{
+	switch (_kind) {
+	case STREAM_RAW:
+		return ::read(_fd, dst, n);
+	case STREAM_GZIP:
+#ifdef HAVE_ZLIB
+		return gzread(_gz, dst, min(n, (size_t)1 << 30));
+#else
+		return -1;
+#endif
+	case STREAM_ZSTD:
+#ifdef HAVE_ZSTD
+		for (;;) {
+			// zstd can hold on to output it hasn't had room for, so
+			// drain it before reading more, even with no input left
+			ZSTD_outBuffer out = { dst, n, 0 };
+			size_t ret = ZSTD_decompressStream(_zstd, &out, &_in_buf);
+			if (ZSTD_isError(ret)) {
+				return -1;
+			}
+			if (out.pos > 0) {
+				return out.pos;
+			}
+			if (_in_buf.pos < _in_buf.size) {
+				continue;
+			}
+			ssize_t got = ::read(_fd, _in.data(), _in.size());
+			if (got <= 0) {
+				// it's only the end if the last frame was finished
+				return got == 0 && ret == 0 ? 0 : -1;
+			}
+			_in_buf.size = got;
+			_in_buf.pos = 0;
+		}
+#else
+		return -1;
+#endif
+	}
+	return -1;
+}
+
+bool ArchiveFs::StreamSource::ensure(size_t n)
+{
+	if (_len - _pos >= n) {
+		return true;
+	}
+	// slide what's left to the front, and top it up
+	memmove(_buf.data(), _buf.data() + _pos, _len - _pos);
+	_len -= _pos;
+	_pos = 0;
+	if (_buf.size() < max(n, (size_t)65536)) {
+		_buf.resize(max(n, (size_t)65536));
+	}
+	while (_len < n) {
+		ssize_t got = fill(_buf.data() + _len, _buf.size() - _len);
+		if (got <= 0) {
+			return false;
+		}
+		_len += got;
+	}
+	return true;
+}
+
+ArchiveFs::ArchiveFs() : _map(MAP_FAILED), _map_size(0)
+{
+}
+
+ArchiveFs::~ArchiveFs()
+{
+	if (_map != MAP_FAILED) {
+		munmap(_map, _map_size);
+	}
+}
+
+static string normalize(const string& name)
+{
+	size_t start = 0, end = name.size();
+	while (start < end && (name[start] == '/'
+			|| (name[start] == '.' && start + 1 < end && name[start + 1] == '/'))) {
+		start += name[start] == '/' ? 1 : 2;
+	}
+	while (end > start && name[end - 1] == '/') {
+		end--;
+	}
+	if (start == end || (end - start == 1 && name[start] == '.')) {
+		return "/";
+	}
+	return "/" + name.substr(start, end - start);
+}
+
+void ArchiveFs::add(const string& name, ArchiveEntry entry)
+{
+	string path = normalize(name);
+	if (path == "/") {
+		return;
+	}
+	if (entry._type == ENTRY_HARDLINK) {
+		entry._link = normalize(entry._link);
+	}
+	// like extracting it, a later member replaces an earlier one
+	_entries[path] = entry;
+	// archives don't have to list the directories leading up to a file
+	for (size_t slash = path.rfind('/'); slash != 0 && slash != string::npos;
+			slash = path.rfind('/', slash - 1)) {
+		string parent = path.substr(0, slash);
+		if (_entries.count(parent)) {
+			break;
+		}
+		ArchiveEntry dir = { ENTRY_DIR, "", nullptr, 0, 0 };
+		_entries[parent] = dir;
+	}
+}
+
+static bool worth_keeping(const unsigned char *head, size_t len)
+{
+	return (len >= 4 && memcmp(head, "\x7f" "ELF", 4) == 0)
+		|| (len >= 8 && memcmp(head, "!<arch>\n", 8) == 0);
+}
+
+bool ArchiveFs::take_data(Source& src, ArchiveEntry& entry)
+{
+	if (src.stable()) {
+		entry._data = src.read(entry._size);
+		entry._avail = entry._size;
+		return entry._data != nullptr;
+	}
+	size_t head = min(entry._size, (size_t)HEAD_SIZE);
+	const unsigned char *peeked = src.peek(head);
+	if (peeked == nullptr) {
+		return false;
+	}
+	entry._avail = worth_keeping(peeked, head) ? entry._size : head;
+	unsigned char *data = new unsigned char[entry._avail];
+	_owned.emplace_back(data);
+	entry._data = data;
+	return src.read_into(data, entry._avail) && src.skip(entry._size - entry._avail);
+}
+
+static string field(const unsigned char *p, size_t len)
+{
+	return string((const char*)p, strnlen((const char*)p, len));
+}
+
+static uint64_t tar_number(const unsigned char *p, size_t len)
+{
+	uint64_t value = 0;
+	if (p[0] & 0x80) {
+		// GNU base-256 for things too big for octal
+		for (size_t i = 1; i < len; i++) {
+			value = (value << 8) | p[i];
+		}
+		return value;
+	}
+	for (size_t i = 0; i < len && p[i] != '\0'; i++) {
+		if (p[i] >= '0' && p[i] <= '7') {
+			value = (value << 3) | (p[i] - '0');
+		}
+	}
+	return value;
+}
+
+static void parse_pax(const unsigned char *p, size_t len, map<string, string>& pax)
+{
+	// records look like "%d %s=%s\n", the number being the record length
+	size_t pos = 0;
+	while (pos < len) {
+		size_t reclen = 0, i = pos;
+		while (i < len && p[i] >= '0' && p[i] <= '9') {
+			reclen = reclen * 10 + (p[i++] - '0');
+		}
+		if (reclen == 0 || pos + reclen > len || i >= len || p[i] != ' ') {
+			return;
+		}
+		string record((const char*)p + i + 1, pos + reclen - i - 2);
+		size_t eq = record.find('=');
+		if (eq != string::npos) {
+			pax[record.substr(0, eq)] = record.substr(eq + 1);
+		}
+		pos += reclen;
+	}
+}
+
+#define TAR_BLOCK 512
+#define TAR_PAD(n) (((n) + TAR_BLOCK - 1) & ~(uint64_t)(TAR_BLOCK - 1))
+
+static bool tar_checksum_ok(const unsigned char *hdr)
+{
+	// the checksum field itself counts as spaces
+	uint64_t sum = 0;
+	for (size_t i = 0; i < TAR_BLOCK; i++) {
+		sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+	}
+	return sum == tar_number(hdr + 148, 8);
+}
+
+bool ArchiveFs::load_tar(Source& src, string& error)
+{
+	string long_name, long_link;
+	map<string, string> pax;
+	for (;;) {
+		const unsigned char *hdr = src.read(TAR_BLOCK);
+		if (hdr == nullptr) {
+			// plenty of tools forget the two empty blocks at the end
+			return true;
+		}
+		bool empty = true;
+		for (size_t i = 0; i < TAR_BLOCK && empty; i++) {
+			empty = hdr[i] == '\0';
+		}
+		if (empty) {
+			return true;
+		}
+		if (!tar_checksum_ok(hdr)) {
+			error = "bad tar header checksum";
+			return false;
+		}
+
+		string name = field(hdr, 100);
+		string link = field(hdr + 157, 100);
+		uint64_t size = tar_number(hdr + 124, 12);
+		char type = hdr[156];
+		if (memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345] != '\0') {
+			name = field(hdr + 345, 155) + "/" + name;
+		}
+
+		// the extension headers describe the member after them
+		if (type == 'L' || type == 'K' || type == 'x') {
+			if (size > MAX_HEADER_DATA) {
+				error = "tar extension header too big";
+				return false;
+			}
+			const unsigned char *data = src.read(size);
+			if (data == nullptr) {
+				error = "truncated tar extension header";
+				return false;
+			}
+			if (type == 'L') {
+				long_name = field(data, size);
+			} else if (type == 'K') {
+				long_link = field(data, size);
+			} else {
+				parse_pax(data, size, pax);
+			}
+			if (!src.skip(TAR_PAD(size) - size)) {
+				error = "truncated tar archive";
+				return false;
+			}
+			continue;
+		}
+		if (!long_name.empty()) {
+			name = long_name;
+		}
+		if (!long_link.empty()) {
+			link = long_link;
+		}
+		if (pax.count("path")) {
+			name = pax["path"];
+		}
+		if (pax.count("linkpath")) {
+			link = pax["linkpath"];
+		}
+		if (pax.count("size")) {
+			size = strtoull(pax["size"].c_str(), nullptr, 10);
+		}
+		long_name.clear();
+		long_link.clear();
+		pax.clear();
+
+		ArchiveEntry entry = { ENTRY_OTHER, link, nullptr, 0, 0 };
+		switch (type) {
+		case '0':
+		case '\0':
+		case '7':
+			entry._type = ENTRY_FILE;
+			entry._size = size;
+			break;
+		case '1':
+			entry._type = ENTRY_HARDLINK;
+			break;
+		case '2':
+			entry._type = ENTRY_SYMLINK;
+			break;
+		case '5':
+			entry._type = ENTRY_DIR;
+			break;
+		}
+		if (entry._type == ENTRY_FILE) {
+			if (!take_data(src, entry) || !src.skip(TAR_PAD(size) - size)) {
+				error = "truncated tar member " + name;
+				return false;
+			}
+		} else if (!src.skip(TAR_PAD(size))) {
+			error = "truncated tar archive";
+			return false;
+		}
+		add(name, entry);
+	}
+}
+
+static uint32_t cpio_hex(const unsigned char *p)
+{
+	uint32_t value = 0;
+	for (int i = 0; i < 8; i++) {
+		char c = p[i];
+		value <<= 4;
+		if (c >= '0' && c <= '9') {
+			value |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			value |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			value |= c - 'A' + 10;
+		}
+	}
+	return value;
+}
+
+#define CPIO_HEADER 110
+#define CPIO_PAD(n) ((4 - ((n) & 3)) & 3)
+
+bool ArchiveFs::load_cpio(Source& src, string& error)
+{
+	// newc only has the contents on the last of a set of hardlinks
+	map<pair<uint64_t, uint32_t>, vector<string>> links;
+	for (;;) {
+		const unsigned char *hdr = src.read(CPIO_HEADER);
+		if (hdr == nullptr) {
+			error = "truncated cpio archive";
+			return false;
+		}
+		if (memcmp(hdr, "070701", 6) != 0 && memcmp(hdr, "070702", 6) != 0) {
+			error = "unsupported cpio format (only newc is)";
+			return false;
+		}
+		uint32_t ino = cpio_hex(hdr + 6);
+		uint32_t mode = cpio_hex(hdr + 14);
+		uint32_t nlink = cpio_hex(hdr + 38);
+		uint32_t size = cpio_hex(hdr + 54);
+		uint64_t dev = ((uint64_t)cpio_hex(hdr + 62) << 32) | cpio_hex(hdr + 70);
+		uint32_t namesize = cpio_hex(hdr + 94);
+		if (namesize > MAX_HEADER_DATA) {
+			error = "cpio name too long";
+			return false;
+		}
+
+		const unsigned char *namep = src.read(namesize);
+		if (namep == nullptr || !src.skip(CPIO_PAD(CPIO_HEADER + namesize))) {
+			error = "truncated cpio archive";
+			return false;
+		}
+		string name = field(namep, namesize);
+		if (name == "TRAILER!!!") {
+			return true;
+		}
+
+		ArchiveEntry entry = { ENTRY_OTHER, "", nullptr, 0, 0 };
+		bool ok = true;
+		switch (mode & S_IFMT) {
+		case S_IFREG:
+			entry._type = ENTRY_FILE;
+			entry._size = size;
+			ok = take_data(src, entry);
+			break;
+		case S_IFLNK: {
+			entry._type = ENTRY_SYMLINK;
+			if (size > MAX_HEADER_DATA) {
+				error = "cpio symlink target too long";
+				return false;
+			}
+			const unsigned char *target = src.read(size);
+			ok = target != nullptr;
+			if (ok) {
+				entry._link = field(target, size);
+			}
+			break;
+		}
+		case S_IFDIR:
+			entry._type = ENTRY_DIR;
+			ok = src.skip(size);
+			break;
+		default:
+			ok = src.skip(size);
+			break;
+		}
+		if (!ok || !src.skip(CPIO_PAD(size))) {
+			error = "truncated cpio member " + name;
+			return false;
+		}
+		add(name, entry);
+
+		if (entry._type == ENTRY_FILE && nlink > 1) {
+			auto& others = links[make_pair(dev, ino)];
+			if (size == 0) {
+				others.push_back(name);
+				continue;
+			}
+			for (auto& other : others) {
+				ArchiveEntry alias = { ENTRY_HARDLINK, name, nullptr, 0, 0 };
+				add(other, alias);
+			}
+			others.clear();
+		}
+	}
+}
+
+bool ArchiveFs::load(const string& path, string& error)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		error = strerror(errno);
+		return false;
+	}
+	unsigned char magic[4];
+	struct stat st;
+	if (fstat(fd, &st) == -1 || pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+		error = "couldn't read archive";
+		close(fd);
+		return false;
+	}
+
+	Source *src = nullptr;
+	StreamKind kind = STREAM_RAW;
+	if (magic[0] == 0x1f && magic[1] == 0x8b) {
+		kind = STREAM_GZIP;
+	} else if (memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+		kind = STREAM_ZSTD;
+	} else if (S_ISREG(st.st_mode)) {
+		_map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (_map != MAP_FAILED) {
+			_map_size = st.st_size;
+			src = new MappedSource((const unsigned char*)_map, _map_size);
+		}
+	}
+	if (src == nullptr) {
+		StreamSource *stream = new StreamSource(fd, kind);
+		if (!stream->ok()) {
+			error = kind == STREAM_GZIP ? "gzip support not built in"
+				: "zstd support not built in";
+			delete stream;
+			close(fd);
+			return false;
+		}
+		src = stream;
+	}
+
+	bool ok;
+	const unsigned char *head = src->peek(TAR_BLOCK);
+	if (head != nullptr && memcmp(head, "0707", 4) == 0) {
+		ok = load_cpio(*src, error);
+	} else if (head != nullptr && tar_checksum_ok(head)) {
+		// tar doesn't have much of a magic number before ustar, but
+		// the header checksum is hard to hit by accident
+		ok = load_tar(*src, error);
+	} else if ((head = src->peek(CPIO_HEADER)) != nullptr && memcmp(head, "0707", 4) == 0) {
+		// a tiny cpio archive can be shorter than a tar header
+		ok = load_cpio(*src, error);
+	} else {
+		error = "not a tar or cpio archive";
+		ok = false;
+	}
+	delete src;
+	close(fd);
+	return ok;
+}
+
+const ArchiveEntry *ArchiveFs::find(const string& path) const
+{
+	string real;
+	return resolve(path, real);
+}
+
+const ArchiveEntry *ArchiveFs::resolve(const string& path, string& real) const
+{
+	static const ArchiveEntry root = { ENTRY_DIR, "", nullptr, 0, 0 };
+	auto step = [this](const string& next, string& link) {
+		auto iter = _entries.find(next);
+		if (iter == _entries.end()) {
+			return -1;
+		} else if (iter->second._type == ENTRY_SYMLINK) {
+			link = iter->second._link;
+			return 1;
+		}
+		return 0;
+	};
+	if (vfs_walk(path, step, real) != 0) {
+		return nullptr;
+	} else if (real.empty()) {
+		return &root;
+	}
+	const ArchiveEntry *entry = &_entries.find(real)->second;
+	if (entry->_type == ENTRY_HARDLINK) {
+		auto target = _entries.find(entry->_link);
+		if (target == _entries.end() || target->second._type == ENTRY_HARDLINK) {
+			return nullptr;
+		}
+		entry = &target->second;
+	}
+	return entry;
+}
+
+class ArchiveFile : public VfsFile {
+public:
+	ArchiveFile(const ArchiveEntry *entry) : _entry(entry) {}
+
+	uint64_t size() { return _entry->_size; }
+	ssize_t read(uint64_t offset, void *buf, size_t length)
+	{
+		// what wasn't kept reads as the end of the file
+		if (offset >= _entry->_avail) {
+			return 0;
+		}
+		length = min(length, (size_t)(_entry->_avail - offset));
+		memcpy(buf, _entry->_data + offset, length);
+		return length;
+	}
+	const unsigned char *map(uint64_t offset, size_t length)
+	{
+		if (offset > _entry->_avail || length > _entry->_avail - offset) {
+			return nullptr;
+		}
+		return _entry->_data + offset;
+	}
+
+	const ArchiveEntry *_entry;
+};
+
+int ArchiveFs::stat(const string& path, struct stat& st)
+{
+	const ArchiveEntry *entry = find(path);
+	if (entry == nullptr) {
+		return -ENOENT;
+	}
+	memset(&st, 0, sizeof(st));
+	switch (entry->_type) {
+	case ENTRY_FILE:
+		st.st_mode = S_IFREG | 0644;
+		break;
+	case ENTRY_DIR:
+		st.st_mode = S_IFDIR | 0755;
+		break;
+	default:
+		break;
+	}
+	st.st_size = entry->_size;
+	st.st_nlink = 1;
+	// hardlinks land on the same entry, so it's as good as an inode
+	st.st_ino = (ino_t)(uintptr_t)entry;
+	return 0;
+}
+
+VfsFile *ArchiveFs::open(const string& path)
+{
+	const ArchiveEntry *entry = find(path);
+	if (entry == nullptr || entry->_type != ENTRY_FILE) {
+		errno = entry == nullptr ? ENOENT : EISDIR;
+		return nullptr;
+	}
+	return new ArchiveFile(entry);
+}
+
+int ArchiveFs::readlink(const string& path, string& target)
+{
+	string dir, name, real;
+	if (!vfs_split(path, dir, name) || resolve(dir, real) == nullptr) {
+		return -ENOENT;
+	}
+	auto iter = _entries.find(real + "/" + name);
+	if (iter == _entries.end()) {
+		return -ENOENT;
+	} else if (iter->second._type != ENTRY_SYMLINK) {
+		return -EINVAL;
+	}
+	target = iter->second._link;
+	return 0;
+}
+
+int ArchiveFs::list(const string& dir, vector<string>& names)
+{
+	string real;
+	const ArchiveEntry *entry = resolve(dir, real);
+	if (entry == nullptr) {
+		return -ENOENT;
+	} else if (entry->_type != ENTRY_DIR) {
+		return -ENOTDIR;
+	}
+	names.clear();
+	real += "/";
+	for (auto& iter : _entries) {
+		const string& path = iter.first;
+		if (path.compare(0, real.size(), real) == 0
+				&& path.find('/', real.size()) == string::npos) {
+			names.push_back(path.substr(real.size()));
+		}
+	}
+	sort(names.begin(), names.end());
+	return 0;
+}
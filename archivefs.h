@@ -0,0 +1,75 @@
+/*
+ * xpldd: tar and cpio archives as a sysroot, without extracting them
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_ARCHIVEFS_H
+#define XPLDD_ARCHIVEFS_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vfs.h"
+
+enum ArchiveEntryType {
+	ENTRY_FILE,
+	ENTRY_DIR,
+	ENTRY_SYMLINK,
+	ENTRY_HARDLINK,
+	ENTRY_OTHER,
+};
+
+// A member of the archive. Only what's worth parsing is kept in memory: ELF
+// files and static archives in full, and the head of anything else (enough to
+// tell a linker script apart). _avail says how much of _size is in _data.
+class ArchiveEntry {
+public:
+	ArchiveEntryType _type;
+	std::string _link; // symlink or hardlink target
+	const unsigned char *_data;
+	size_t _size, _avail;
+};
+
+class ArchiveFs : public Vfs {
+public:
+	ArchiveFs();
+	~ArchiveFs();
+
+	// streams the archive once (through gzip or zstd if it's compressed),
+	// indexing every member; returns false and sets error if it can't
+	bool load(const std::string& path, std::string& error);
+
+	// looks up an absolute path in the archive, following symlinks along
+	// the way like the kernel would inside a chroot of it; nullptr if the
+	// path isn't there
+	const ArchiveEntry *find(const std::string& path) const;
+
+	int stat(const std::string& path, struct stat& st);
+	VfsFile *open(const std::string& path);
+	int list(const std::string& dir, std::vector<std::string>& names);
+	int readlink(const std::string& path, std::string& target);
+
+private:
+	class Source;
+	class MappedSource;
+	class StreamSource;
+
+	bool load_tar(Source& src, std::string& error);
+	bool load_cpio(Source& src, std::string& error);
+	void add(const std::string& name, ArchiveEntry entry);
+	bool take_data(Source& src, ArchiveEntry& entry);
+	// find, also giving the path it ended up at once symlinks are gone
+	const ArchiveEntry *resolve(const std::string& path, std::string& real) const;
+
+	std::unordered_map<std::string, ArchiveEntry> _entries;
+	// buffers for members read out of a compressed stream
+	std::vector<std::unique_ptr<unsigned char[]>> _owned;
+	// an uncompressed archive is mapped, and members point into it
+	void *_map;
+	size_t _map_size;
+};
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * xpldd: copying a resolved closure out into a directory
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <system_error>
+
+#include "bundle.h"
+
+using namespace std;
+
+extern "C" {
+	#include <fcntl.h>
+	#include <sys/ioctl.h>
+	#include <unistd.h>
+#ifdef HAVE_LINUX_FS_H
+	#include <linux/fs.h>
+#endif
+}
+
+// for when the data has to come through us
+#define BUNDLE_BUFFER (1024 * 1024)
+
+static bool kernel_copy_unsupported(int err)
+{
+	// another filesystem (before 5.3), or one that can't do it at all
+	return err == EXDEV || err == ENOSYS || err == EINVAL
+		|| err == EOPNOTSUPP || err == EBADF;
+}
+
+// Copies all of src to dst; returns 0 or -errno.
+static int copy_data(VfsFile *src, int dst)
+{
+	int fd = src->fd();
+	uint64_t size = src->size(), done = 0;
+#ifdef FICLONE
+	if (fd != -1 && ioctl(dst, FICLONE, fd) == 0) {
+		return 0;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	if (fd != -1) {
+		off_t in = 0, out = 0;
+		while (done < size) {
+			ssize_t ret = copy_file_range(fd, &in, dst, &out, size - done, 0);
+			if (ret == -1 && !kernel_copy_unsupported(errno)) {
+				return -errno;
+			} else if (ret <= 0) {
+				// finish it the slow way from where it got to
+				break;
+			}
+			done += ret;
+		}
+	}
+#endif
+	vector<unsigned char> buf(min(size - done, (uint64_t)BUNDLE_BUFFER));
+	while (done < size) {
+		ssize_t got = src->read(done, buf.data(), min(size - done, (uint64_t)buf.size()));
+		if (got < 0) {
+			return got;
+		} else if (got == 0) {
+			// the file shrank, or an archive didn't keep all of it
+			return -EIO;
+		}
+		for (ssize_t written = 0; written < got; ) {
+			ssize_t ret = pwrite(dst, buf.data() + written, got - written, done + written);
+			if (ret == -1) {
+				return -errno;
+			}
+			written += ret;
+		}
+		done += got;
+	}
+	return 0;
+}
+
+static int write_file(BundleEntry& entry, VfsFile *src)
+{
+	struct stat st;
+	// outside the host, there's no mode to go on, but anything worth
+	// bundling is a program or a library
+	mode_t mode = src->fd() != -1 && fstat(src->fd(), &st) == 0 ? st.st_mode & 07777 : 0755;
+	if (unlink(entry._dest.c_str()) == -1 && errno != ENOENT) {
+		return -errno;
+	}
+	int dst = open(entry._dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	if (dst == -1) {
+		return -errno;
+	}
+	int ret = copy_data(src, dst);
+	if (close(dst) == -1 && ret == 0) {
+		ret = -errno;
+	}
+	return ret;
+}
+
+static int write_link(BundleEntry& entry)
+{
+	if (unlink(entry._dest.c_str()) == -1 && errno != ENOENT) {
+		return -errno;
+	}
+	return symlink(entry._link.c_str(), entry._dest.c_str()) == -1 ? -errno : 0;
+}
+
+bool write_bundle(vector<BundleEntry>& entries, Vfs& vfs)
+{
+	vector<string> sources;
+	vector<size_t> owners;
+	for (size_t i = 0; i < entries.size(); i++) {
+		BundleEntry& entry = entries[i];
+		error_code ec;
+		filesystem::create_directories(filesystem::path(entry._dest).parent_path(), ec);
+		if (ec) {
+			entry._result = -ec.value();
+			continue;
+		}
+		if (entry._link.empty()) {
+			sources.push_back(entry._source);
+			owners.push_back(i);
+		} else {
+			entry._result = write_link(entry);
+		}
+	}
+
+	// the VFS isn't for sharing between threads, so it does the opening,
+	// and the pool only gets the file descriptors and mappings
+	vector<VfsFile*> files;
+	vfs.open_many(sources, files);
+	ThreadPool pool(ThreadPool::default_threads());
+	pool.parallel_for(files.size(), [&](size_t i) {
+		BundleEntry& entry = entries[owners[i]];
+		entry._result = files[i] == nullptr ? -ENOENT : write_file(entry, files[i]);
+	});
+	vfs.close_many(files);
+
+	return all_of(entries.begin(), entries.end(), [](BundleEntry& entry) {
+		return entry._result == 0;
+	});
+}
@@ -0,0 +1,36 @@
+/*
+ * xpldd: copying a resolved closure out into a directory
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_BUNDLE_H
+#define XPLDD_BUNDLE_H
+
+#include <string>
+#include <vector>
+
+#include "vfs.h"
+
+// Something to put in a bundle: a copy of a file from the VFS, or a symlink
+// if _link is set.
+class BundleEntry {
+public:
+	BundleEntry(const std::string& dest, const std::string& source, const std::string& link)
+		: _dest(dest), _source(source), _link(link), _result(0) {}
+
+	std::string _dest; // where it goes on the host
+	std::string _source; // path in the VFS
+	std::string _link; // symlink target
+	// results; 0 or -errno
+	int _result;
+};
+
+// Writes every entry, replacing whatever's already at _dest and making the
+// directories on the way. The files are opened as one batch and copied in
+// parallel, each as a reflink if the filesystem can share the extents, then
+// with copy_file_range so the data stays in the kernel, and only read and
+// written (i.e. out of an archive) as a last resort. Returns false if any
+// entry failed.
+bool write_bundle(std::vector<BundleEntry>& entries, Vfs& vfs);
+
+#endif
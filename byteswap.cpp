@@ -0,0 +1,134 @@
+/*
+ * xpldd: byte swapping whole tables from foreign endian files
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cstring>
+
+#include "byteswap.h"
+
+extern "C" {
+	#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+#elif defined(__aarch64__)
+	#include <arm_neon.h>
+#endif
+}
+
+// Each kernel swaps as much of length bytes as it can in whole vectors,
+// and returns how much that was; the loop finishes off the rest.
+typedef size_t (*SwapKernel)(unsigned char *p, size_t length, size_t size);
+
+static void swap_scalar(unsigned char *p, size_t length, size_t size)
+{
+	for (size_t off = 0; off + size <= length; off += size) {
+		if (size == 8) {
+			uint64_t v;
+			memcpy(&v, p + off, 8);
+			v = __builtin_bswap64(v);
+			memcpy(p + off, &v, 8);
+		} else if (size == 4) {
+			uint32_t v;
+			memcpy(&v, p + off, 4);
+			v = __builtin_bswap32(v);
+			memcpy(p + off, &v, 4);
+		} else if (size == 2) {
+			uint16_t v;
+			memcpy(&v, p + off, 2);
+			v = __builtin_bswap16(v);
+			memcpy(p + off, &v, 2);
+		}
+	}
+}
+
+static size_t swap_none(unsigned char*, size_t, size_t)
+{
+	return 0;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the shuffle that reverses each size byte word of a 16 byte lane
+static void lane_mask(unsigned char mask[16], size_t size)
+{
+	for (size_t i = 0; i < 16; i++) {
+		mask[i] = (i / size) * size + (size - 1 - i % size);
+	}
+}
+
+__attribute__((target("ssse3")))
+static size_t swap_ssse3(unsigned char *p, size_t length, size_t size)
+{
+	unsigned char bytes[16];
+	lane_mask(bytes, size);
+	__m128i mask = _mm_loadu_si128((const __m128i*)bytes);
+	size_t off = 0;
+	for (; off + 16 <= length; off += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(p + off));
+		_mm_storeu_si128((__m128i*)(p + off), _mm_shuffle_epi8(v, mask));
+	}
+	return off;
+}
+
+// vpshufb shuffles within each 128-bit half, so it's the same mask twice
+__attribute__((target("avx2")))
+static size_t swap_avx2(unsigned char *p, size_t length, size_t size)
+{
+	unsigned char bytes[16];
+	lane_mask(bytes, size);
+	__m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)bytes));
+	size_t off = 0;
+	for (; off + 32 <= length; off += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*)(p + off));
+		_mm256_storeu_si256((__m256i*)(p + off), _mm256_shuffle_epi8(v, mask));
+	}
+	return off + swap_ssse3(p + off, length - off, size);
+}
+#elif defined(__aarch64__)
+// NEON is always there on AArch64, and has an instruction for each size
+static size_t swap_neon(unsigned char *p, size_t length, size_t size)
+{
+	size_t off = 0;
+	for (; off + 16 <= length; off += 16) {
+		uint8x16_t v = vld1q_u8(p + off);
+		if (size == 8) {
+			v = vrev64q_u8(v);
+		} else if (size == 4) {
+			v = vrev32q_u8(v);
+		} else {
+			v = vrev16q_u8(v);
+		}
+		vst1q_u8(p + off, v);
+	}
+	return off;
+}
+#endif
+
+static SwapKernel pick_kernel()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return swap_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return swap_ssse3;
+	}
+#elif defined(__aarch64__)
+	return swap_neon;
+#endif
+	return swap_none;
+}
+
+void bswap_words(void *data, size_t count, size_t size)
+{
+	static SwapKernel kernel = pick_kernel();
+	if (size != 2 && size != 4 && size != 8) {
+		return;
+	}
+	unsigned char *p = (unsigned char*)data;
+	size_t length = count * size;
+	// vectors are a multiple of every size, so they stop on a word
+	size_t done = kernel(p, length, size);
+	swap_scalar(p + done, length - done, size);
+}
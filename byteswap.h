@@ -0,0 +1,17 @@
+/*
+ * xpldd: byte swapping whole tables from foreign endian files
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_BYTESWAP_H
+#define XPLDD_BYTESWAP_H
+
+#include <cstddef>
+
+// Swaps the byte order of count words of size bytes (2, 4, or 8) at data,
+// in place; data needn't be aligned. A table whose fields are all the same
+// size (like a dynamic segment) is turned into our byte order in one go,
+// with SSSE3 or AVX2 (whichever the CPU has) or NEON, and a loop otherwise.
+void bswap_words(void *data, size_t count, size_t size);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * xpldd: a small ELF and ar parser, for building without libelf
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cstring>
+
+#include "elfparse.h"
+#include "elfread.h"
+
+using namespace std;
+
+extern "C" {
+	#include <ar.h>
+}
+
+// A table of fixed size entries somewhere in the image; everything read
+// from the file goes through one, so nothing can be read past the end.
+class ImageTable {
+public:
+	const unsigned char *_base;
+	uint64_t _count;
+};
+
+static bool image_table(const unsigned char *data, size_t size,
+		uint64_t offset, uint64_t length, uint64_t entsize, ImageTable& table)
+{
+	if (offset > size || length > size - offset || entsize == 0) {
+		return false;
+	}
+	table._base = data + offset;
+	table._count = length / entsize;
+	return true;
+}
+
+// the NUL terminated string at offset of a string table, if it's all in it
+static const char *table_string(const ImageTable& strtab, uint64_t offset)
+{
+	if (offset >= strtab._count) {
+		return nullptr;
+	}
+	const void *nul = memchr(strtab._base + offset, '\0', strtab._count - offset);
+	return nul == nullptr ? nullptr : (const char*)strtab._base + offset;
+}
+
+template <typename R>
+static bool scan_image(const unsigned char *data, size_t size, Binary *binary,
+		StringTable& strings, vector<string> *undefined, string& error)
+{
+	typedef typename R::Ehdr Ehdr;
+	typedef typename R::Shdr Shdr;
+	typedef typename R::Dyn Dyn;
+	typedef typename R::Sym Sym;
+
+	if (size < sizeof(Ehdr)) {
+		error = "truncated ELF header";
+		return false;
+	}
+	Ehdr ehdr = R::template load<Ehdr>(data);
+	uint64_t shoff = R::get(ehdr.e_shoff);
+	uint64_t shnum = R::get(ehdr.e_shnum);
+	if (shoff == 0) {
+		// no sections, so nothing to say
+		return true;
+	}
+	if (R::get(ehdr.e_shentsize) != sizeof(Shdr)) {
+		error = "bad section header size";
+		return false;
+	}
+	ImageTable shdrs;
+	if (!image_table(data, size, shoff, sizeof(Shdr), sizeof(Shdr), shdrs)) {
+		error = "section headers out of bounds";
+		return false;
+	}
+	// past SHN_LORESERVE, the count is kept in the first one's sh_size
+	if (shnum == 0) {
+		shnum = R::get(R::template load<Shdr>(shdrs._base).sh_size);
+	}
+	if (shnum > (size - shoff) / sizeof(Shdr)) {
+		error = "section headers out of bounds";
+		return false;
+	}
+	shdrs._count = shnum;
+
+	// a section's contents, and the string table it links to
+	auto contents = [&](const Shdr& shdr, uint64_t entsize, ImageTable& table) {
+		return R::get(shdr.sh_type) != SHT_NOBITS
+			&& image_table(data, size, R::get(shdr.sh_offset),
+				R::get(shdr.sh_size), entsize, table);
+	};
+	auto linked = [&](const Shdr& shdr, ImageTable& strtab) {
+		uint64_t link = R::get(shdr.sh_link);
+		if (link == 0 || link >= shdrs._count) {
+			return false;
+		}
+		Shdr str = R::template load<Shdr>(shdrs._base + link * sizeof(Shdr));
+		return contents(str, 1, strtab);
+	};
+
+	for (uint64_t i = 1; i < shdrs._count; i++) {
+		Shdr shdr = R::template load<Shdr>(shdrs._base + i * sizeof(Shdr));
+		uint32_t type = R::get(shdr.sh_type);
+		ImageTable table, strtab;
+		if (type == SHT_DYNAMIC) {
+			if (!contents(shdr, sizeof(Dyn), table) || !linked(shdr, strtab)) {
+				error = "dynamic section out of bounds";
+				return false;
+			}
+			vector<string_view> runpath;
+			for (uint64_t j = 0; j < table._count; j++) {
+				Dyn dyn = R::template load<Dyn>(table._base + j * sizeof(Dyn));
+				int64_t tag = R::get(dyn.d_tag);
+				const char *str;
+				if (tag != DT_NEEDED && tag != DT_RPATH && tag != DT_RUNPATH) {
+					continue;
+				}
+				// an empty name can't be looked for anywhere
+				str = table_string(strtab, R::get(dyn.d_un.d_val));
+				if (str == nullptr || str[0] == '\0') {
+					if (str != nullptr && tag == DT_NEEDED) {
+						error = "empty DT_NEEDED entry, skipping it";
+					}
+					continue;
+				}
+				auto& list = tag == DT_NEEDED ? binary->_depends
+					: tag == DT_RPATH ? binary->_rpath : runpath;
+				list.push_back(strings.view(str));
+			}
+			// like ld.so, DT_RPATH doesn't count when there's a DT_RUNPATH
+			if (!runpath.empty()) {
+				binary->_rpath.swap(runpath);
+			}
+		} else if (type == SHT_SYMTAB && undefined != nullptr) {
+			if (!contents(shdr, sizeof(Sym), table) || !linked(shdr, strtab)) {
+				error = "symbol table out of bounds";
+				return false;
+			}
+			// the first symbol is always the null one
+			for (uint64_t j = 1; j < table._count; j++) {
+				Sym sym = R::template load<Sym>(table._base + j * sizeof(Sym));
+				uint32_t name = R::get(sym.st_name);
+				const char *str;
+				if (R::get(sym.st_shndx) != SHN_UNDEF || name == 0) {
+					continue;
+				}
+				if ((str = table_string(strtab, name)) != nullptr) {
+					undefined->push_back(str);
+				}
+			}
+		}
+	}
+	return true;
+}
+
+bool elf_image_is_elf(const unsigned char *data, size_t size)
+{
+	return size >= EI_NIDENT && memcmp(data, ELFMAG, SELFMAG) == 0
+		&& (data[EI_CLASS] == ELFCLASS32 || data[EI_CLASS] == ELFCLASS64)
+		&& (data[EI_DATA] == ELFDATA2LSB || data[EI_DATA] == ELFDATA2MSB);
+}
+
+bool elf_image_scan(const unsigned char *data, size_t size, Binary *binary,
+		StringTable& strings, vector<string> *undefined, string& error)
+{
+	if (!elf_image_is_elf(data, size)) {
+		error = "not an ELF file";
+		return false;
+	}
+	return with_elf_reader(data[EI_CLASS], data[EI_DATA], [&](auto reader) {
+		return scan_image<decltype(reader)>(data, size, binary, strings,
+			undefined, error);
+	});
+}
+
+// ar header fields are space padded decimal
+static bool ar_number(const char *field, size_t length, uint64_t& value)
+{
+	size_t i = 0;
+	value = 0;
+	for (; i < length && field[i] >= '0' && field[i] <= '9'; i++) {
+		if (value > (UINT64_MAX - 9) / 10) {
+			return false;
+		}
+		value = value * 10 + (field[i] - '0');
+	}
+	if (i == 0) {
+		return false;
+	}
+	for (; i < length; i++) {
+		if (field[i] != ' ') {
+			return false;
+		}
+	}
+	return true;
+}
+
+#define AR_HEADER 60
+
+bool ar_image_walk(const unsigned char *data, size_t size,
+		const function<void(string_view, const unsigned char*, size_t)>& fn,
+		string& error)
+{
+	if (size < SARMAG || memcmp(data, ARMAG, SARMAG) != 0) {
+		error = "not an ar archive";
+		return false;
+	}
+	string_view longnames;
+	uint64_t off = SARMAG;
+	while (off < size) {
+		if (AR_HEADER > size - off) {
+			error = "truncated member header";
+			return false;
+		}
+		const char *hdr = (const char*)data + off;
+		uint64_t length;
+		if (memcmp(hdr + 58, ARFMAG, 2) != 0 || !ar_number(hdr + 48, 10, length)
+				|| length > size - off - AR_HEADER) {
+			error = "bad member header";
+			return false;
+		}
+		const unsigned char *body = data + off + AR_HEADER;
+		// members are padded to an even offset
+		off += AR_HEADER + length + (length & 1);
+
+		string_view field(hdr, 16), name;
+		uint64_t index;
+		if (field.substr(0, 2) == "//") {
+			// GNU long name table; names in it end in "/\n"
+			longnames = string_view((const char*)body, length);
+			continue;
+		} else if (field[0] == '/' && ar_number(hdr + 1, 15, index)) {
+			if (index >= longnames.size()) {
+				error = "bad long member name";
+				return false;
+			}
+			name = longnames.substr(index);
+			name = name.substr(0, name.find('/'));
+		} else if (field[0] == '/') {
+			// the symbol index, 32 or 64-bit
+			continue;
+		} else if (field.substr(0, 3) == "#1/" && ar_number(hdr + 3, 13, index)) {
+			// BSD long name, at the front of the contents
+			if (index > length) {
+				error = "bad long member name";
+				return false;
+			}
+			name = string_view((const char*)body, index);
+			name = name.substr(0, name.find('\0'));
+			body += index;
+			length -= index;
+		} else {
+			name = field.substr(0, field.find('/'));
+			name = name.substr(0, name.find_last_not_of(' ') + 1);
+		}
+		fn(name, body, length);
+	}
+	return true;
+}
@@ -0,0 +1,38 @@
+/*
+ * xpldd: a small ELF and ar parser, for building without libelf
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_ELFPARSE_H
+#define XPLDD_ELFPARSE_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "resolver.h"
+
+// Reads what libelf would be used for straight out of a file in memory:
+// the section headers, SHT_DYNAMIC and SHT_SYMTAB, and the string tables
+// they link to. Every offset, count, and string is checked against the
+// size of the image, so a truncated or hostile file is an error rather
+// than a crash. Either byte order and class is fine.
+
+// if data is an ELF file (or ar member) of a class and byte order we know
+bool elf_image_is_elf(const unsigned char *data, size_t size);
+// adds the DT_NEEDED and DT_RPATH (or DT_RUNPATH) entries of data to
+// binary, and if undefined is given, the names of the undefined symbols in
+// its symbol table; false with error set if the section headers can't be
+// trusted, or true with error set if an empty name was passed over
+bool elf_image_scan(const unsigned char *data, size_t size, Binary *binary,
+	StringTable& strings, std::vector<std::string> *undefined, std::string& error);
+// calls fn with the name and contents of each member of an ar archive,
+// other than the symbol index and long name table; false with error set
+// if the archive is malformed (after fn has seen the members before that)
+bool ar_image_walk(const unsigned char *data, size_t size,
+	const std::function<void(std::string_view, const unsigned char*, size_t)>& fn,
+	std::string& error);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * xpldd: reading ELF structures in whatever class and byte order a file has
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_ELFREAD_H
+#define XPLDD_ELFREAD_H
+
+#include <cstring>
+
+extern "C" {
+	#include <elf.h>
+	#include <stdint.h>
+}
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ELFDATA_HOST ELFDATA2MSB
+#else
+#define ELFDATA_HOST ELFDATA2LSB
+#endif
+
+// The structure layouts for each class.
+template <unsigned char Class> class ElfTypes;
+
+template <> class ElfTypes<ELFCLASS32> {
+public:
+	typedef Elf32_Ehdr Ehdr;
+	typedef Elf32_Phdr Phdr;
+	typedef Elf32_Shdr Shdr;
+	typedef Elf32_Dyn Dyn;
+	typedef Elf32_Sym Sym;
+};
+
+template <> class ElfTypes<ELFCLASS64> {
+public:
+	typedef Elf64_Ehdr Ehdr;
+	typedef Elf64_Phdr Phdr;
+	typedef Elf64_Shdr Shdr;
+	typedef Elf64_Dyn Dyn;
+	typedef Elf64_Sym Sym;
+};
+
+template <typename T>
+static inline T elf_swap(T val)
+{
+	if constexpr (sizeof(T) == 8) {
+		return (T)__builtin_bswap64(val);
+	} else if constexpr (sizeof(T) == 4) {
+		return (T)__builtin_bswap32(val);
+	} else if constexpr (sizeof(T) == 2) {
+		return (T)__builtin_bswap16(val);
+	} else {
+		return val;
+	}
+}
+
+// One file's class and byte order, as template arguments. Code written
+// against it is compiled once for each of the four combinations, so a
+// table is walked as an array of the right structure, and fields are only
+// byte swapped where the file needs it, with no checks per entry.
+template <unsigned char Class, unsigned char Data>
+class ElfReader {
+public:
+	typedef typename ElfTypes<Class>::Ehdr Ehdr;
+	typedef typename ElfTypes<Class>::Phdr Phdr;
+	typedef typename ElfTypes<Class>::Shdr Shdr;
+	typedef typename ElfTypes<Class>::Dyn Dyn;
+	typedef typename ElfTypes<Class>::Sym Sym;
+
+	// a copy of the structure at p, which needn't be aligned
+	template <typename S>
+	static S load(const void *p)
+	{
+		S s;
+		memcpy(&s, p, sizeof(s));
+		return s;
+	}
+	// a field of a structure from the file, in our byte order
+	template <typename T>
+	static T get(T field)
+	{
+		return Data == ELFDATA_HOST ? field : elf_swap(field);
+	}
+};
+
+// Calls fn with the ElfReader for a class and byte order, which is the one
+// place they're looked at at runtime; anything but ELFCLASS64 is taken as
+// 32-bit, and anything but ELFDATA2MSB as little endian.
+template <typename F>
+static inline auto with_elf_reader(unsigned char cls, unsigned char data, F fn)
+{
+	if (cls == ELFCLASS64) {
+		return data == ELFDATA2MSB ? fn(ElfReader<ELFCLASS64, ELFDATA2MSB>())
+			: fn(ElfReader<ELFCLASS64, ELFDATA2LSB>());
+	}
+	return data == ELFDATA2MSB ? fn(ElfReader<ELFCLASS32, ELFDATA2MSB>())
+		: fn(ElfReader<ELFCLASS32, ELFDATA2LSB>());
+}
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ * xpldd: resolved dependency graphs, saved to disk and compared
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unordered_set>
+
+#include "graph.h"
+
+using namespace std;
+
+extern "C" {
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+}
+
+// The saved format is little endian throughout, with every section 8 byte
+// aligned, after a header of:
+//   magic[8] strings nodes edges roots index_size reserved (u32 each)
+//   blob_size reserved (u64 each)
+// then the sections:
+//   strings: { u32 offset, u32 length } into the blob
+//   blob: the bytes of every string
+//   nodes: { u32 path, u32 first_edge, u32 edge_count, u32 pad, u64 deep }
+//   edges: { u32 name, u32 target }
+//   roots: u32 node
+//   index: u32 node + 1 (0 for empty), open addressed on the path's hash
+#define GRAPH_MAGIC "XPLDDG1\n"
+#define GRAPH_HEADER 48
+#define GRAPH_NODE 24
+#define GRAPH_EDGE 8
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// FNV-1a; the saved index depends on it, so it can't be std::hash
+static uint64_t hash_str(string_view s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (unsigned char c : s) {
+		h = (h ^ c) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t mix(uint64_t h, uint64_t v)
+{
+	return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+static void put32(vector<unsigned char>& out, uint32_t v)
+{
+	for (int i = 0; i < 4; i++) {
+		out.push_back(v >> (i * 8));
+	}
+}
+
+static void put64(vector<unsigned char>& out, uint64_t v)
+{
+	put32(out, v);
+	put32(out, v >> 32);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const unsigned char *p)
+{
+	return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+static void pad8(vector<unsigned char>& out)
+{
+	out.resize(ALIGN8(out.size()), 0);
+}
+
+void LiveGraph::add_root(string_view path)
+{
+	_roots.push_back(_strings.intern(path));
+}
+
+void LiveGraph::add_node(string_view path, const vector<string_view>& names,
+		const vector<string_view>& targets)
+{
+	uint32_t id = _strings.intern(path);
+	Node& node = _nodes[id];
+	node._edges.clear();
+	for (size_t i = 0; i < names.size() && i < targets.size(); i++) {
+		GraphEdge edge = { _strings.intern(names[i]), _strings.intern(targets[i]) };
+		node._edges.push_back(edge);
+	}
+	node._deep = 0;
+	node._state = 0;
+	_order.push_back(id);
+}
+
+// Hashes a node's edges along with everything under it. Something already
+// on the way down (a cycle) only counts by its path, which is still enough
+// to cover the whole closure from the node the walk started at.
+uint64_t LiveGraph::deep_hash(uint32_t path)
+{
+	auto iter = _nodes.find(path);
+	if (iter == _nodes.end() || iter->second._state == 1) {
+		return hash_str(_strings.str(path));
+	} else if (iter->second._state == 2) {
+		return iter->second._deep;
+	}
+	Node& node = iter->second;
+	node._state = 1;
+	uint64_t h = hash_str(_strings.str(path));
+	for (auto& edge : node._edges) {
+		h = mix(h, hash_str(_strings.str(edge._name)));
+		h = mix(h, hash_str(_strings.str(edge._target)));
+		if (_nodes.count(edge._target)) {
+			h = mix(h, deep_hash(edge._target));
+		}
+	}
+	node._deep = h;
+	node._state = 2;
+	return h;
+}
+
+void LiveGraph::finish()
+{
+	// from the roots first, so both sides of a diff walk the same way
+	for (auto root : _roots) {
+		deep_hash(root);
+	}
+	for (auto id : _order) {
+		deep_hash(id);
+	}
+}
+
+void LiveGraph::roots(vector<uint32_t>& out)
+{
+	out.clear();
+	for (auto root : _roots) {
+		if (_nodes.count(root)) {
+			out.push_back(root);
+		}
+	}
+}
+
+bool LiveGraph::node(uint32_t path, vector<GraphEdge>& edges, uint64_t& deep)
+{
+	auto iter = _nodes.find(path);
+	if (iter == _nodes.end()) {
+		return false;
+	}
+	edges = iter->second._edges;
+	deep = iter->second._deep;
+	return true;
+}
+
+bool LiveGraph::save(const string& file, string& error)
+{
+	// renumber the strings and nodes the graph uses from zero
+	unordered_map<uint32_t, uint32_t> string_ids, node_ids;
+	vector<uint32_t> strings;
+	auto local = [&](uint32_t id) {
+		auto iter = string_ids.find(id);
+		if (iter != string_ids.end()) {
+			return iter->second;
+		}
+		strings.push_back(id);
+		return string_ids[id] = strings.size() - 1;
+	};
+	vector<unsigned char> nodes, edges, roots;
+	uint32_t edge_count = 0;
+	for (auto id : _order) {
+		if (node_ids.count(id)) {
+			continue;
+		}
+		node_ids[id] = node_ids.size();
+		Node& node = _nodes[id];
+		put32(nodes, local(id));
+		put32(nodes, edge_count);
+		put32(nodes, node._edges.size());
+		put32(nodes, 0);
+		put64(nodes, node._deep);
+		for (auto& edge : node._edges) {
+			put32(edges, local(edge._name));
+			put32(edges, local(edge._target));
+			edge_count++;
+		}
+	}
+	vector<uint32_t> present;
+	this->roots(present);
+	for (auto root : present) {
+		put32(roots, node_ids[root]);
+	}
+	pad8(roots);
+
+	uint32_t index_size = 1;
+	while (index_size < node_ids.size() * 2) {
+		index_size <<= 1;
+	}
+	vector<uint32_t> index(index_size, 0);
+	for (auto& iter : node_ids) {
+		uint64_t slot = hash_str(_strings.str(iter.first)) & (index_size - 1);
+		while (index[slot] != 0) {
+			slot = (slot + 1) & (index_size - 1);
+		}
+		index[slot] = iter.second + 1;
+	}
+
+	vector<unsigned char> table, blob;
+	for (auto id : strings) {
+		const string& s = _strings.str(id);
+		put32(table, blob.size());
+		put32(table, s.size());
+		blob.insert(blob.end(), s.begin(), s.end());
+	}
+	uint64_t blob_size = blob.size();
+	pad8(blob);
+
+	vector<unsigned char> out(GRAPH_MAGIC, GRAPH_MAGIC + 8);
+	put32(out, strings.size());
+	put32(out, node_ids.size());
+	put32(out, edge_count);
+	put32(out, present.size());
+	put32(out, index_size);
+	put32(out, 0);
+	put64(out, blob_size);
+	put64(out, 0);
+	out.insert(out.end(), table.begin(), table.end());
+	out.insert(out.end(), blob.begin(), blob.end());
+	out.insert(out.end(), nodes.begin(), nodes.end());
+	out.insert(out.end(), edges.begin(), edges.end());
+	out.insert(out.end(), roots.begin(), roots.end());
+	for (auto slot : index) {
+		put32(out, slot);
+	}
+
+	int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		error = strerror(errno);
+		return false;
+	}
+	size_t done = 0;
+	while (done < out.size()) {
+		ssize_t ret = write(fd, out.data() + done, out.size() - done);
+		if (ret <= 0) {
+			error = strerror(errno);
+			close(fd);
+			return false;
+		}
+		done += ret;
+	}
+	if (close(fd) == -1) {
+		error = strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+SnapshotGraph::SnapshotGraph(StringTable& strings)
+	: _strings(strings), _map(MAP_FAILED), _size(0), _string_count(0),
+	_node_count(0), _edge_count(0), _root_count(0), _index_size(0)
+{
+}
+
+SnapshotGraph::~SnapshotGraph()
+{
+	if (_map != MAP_FAILED) {
+		munmap(_map, _size);
+	}
+}
+
+bool SnapshotGraph::is_snapshot(const unsigned char *head, size_t len)
+{
+	return len >= 8 && memcmp(head, GRAPH_MAGIC, 8) == 0;
+}
+
+bool SnapshotGraph::load(const string& file, string& error)
+{
+	int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		error = strerror(errno);
+		if (fd != -1) {
+			close(fd);
+		}
+		return false;
+	}
+	_size = st.st_size;
+	_map = _size < GRAPH_HEADER ? MAP_FAILED
+		: mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	const unsigned char *base = (const unsigned char*)_map;
+	if (_map == MAP_FAILED || !is_snapshot(base, _size)) {
+		error = "not a saved graph";
+		return false;
+	}
+	_string_count = get32(base + 8);
+	_node_count = get32(base + 12);
+	_edge_count = get32(base + 16);
+	_root_count = get32(base + 20);
+	_index_size = get32(base + 24);
+	_blob_size = get64(base + 32);
+
+	uint64_t off = GRAPH_HEADER;
+	_string_table = base + off;
+	off = ALIGN8(off + (uint64_t)_string_count * 8);
+	_blob = base + off;
+	off = ALIGN8(off + _blob_size);
+	_nodes = base + off;
+	off += (uint64_t)_node_count * GRAPH_NODE;
+	_edges = base + off;
+	off = ALIGN8(off + (uint64_t)_edge_count * GRAPH_EDGE);
+	_roots = base + off;
+	off = ALIGN8(off + (uint64_t)_root_count * 4);
+	_index = base + off;
+	off += (uint64_t)_index_size * 4;
+	if (_blob_size > _size || off > _size || _index_size == 0
+			|| (_index_size & (_index_size - 1)) != 0) {
+		error = "truncated or corrupt saved graph";
+		return false;
+	}
+	return true;
+}
+
+bool SnapshotGraph::string_at(uint32_t id, string_view& out) const
+{
+	if (id >= _string_count) {
+		return false;
+	}
+	uint32_t offset = get32(_string_table + (uint64_t)id * 8);
+	uint32_t length = get32(_string_table + (uint64_t)id * 8 + 4);
+	if ((uint64_t)offset + length > _blob_size) {
+		return false;
+	}
+	out = string_view((const char*)_blob + offset, length);
+	return true;
+}
+
+void SnapshotGraph::roots(vector<uint32_t>& out)
+{
+	out.clear();
+	for (uint32_t i = 0; i < _root_count; i++) {
+		uint32_t node = get32(_roots + (uint64_t)i * 4);
+		string_view path;
+		if (node < _node_count && string_at(get32(_nodes + (uint64_t)node * GRAPH_NODE), path)) {
+			out.push_back(_strings.intern(path));
+		}
+	}
+}
+
+bool SnapshotGraph::node(uint32_t path, vector<GraphEdge>& edges, uint64_t& deep)
+{
+	const string& want = _strings.str(path);
+	uint32_t mask = _index_size - 1;
+	uint32_t slot = hash_str(want) & mask;
+	for (uint32_t probe = 0; probe < _index_size; probe++, slot = (slot + 1) & mask) {
+		uint32_t entry = get32(_index + (uint64_t)slot * 4);
+		if (entry == 0 || entry > _node_count) {
+			return false;
+		}
+		const unsigned char *rec = _nodes + (uint64_t)(entry - 1) * GRAPH_NODE;
+		string_view have;
+		if (!string_at(get32(rec), have) || have != want) {
+			continue;
+		}
+		uint32_t first = get32(rec + 4), count = get32(rec + 8);
+		if ((uint64_t)first + count > _edge_count) {
+			return false;
+		}
+		edges.clear();
+		for (uint32_t i = 0; i < count; i++) {
+			const unsigned char *e = _edges + (uint64_t)(first + i) * GRAPH_EDGE;
+			string_view name, target;
+			if (!string_at(get32(e), name) || !string_at(get32(e + 4), target)) {
+				return false;
+			}
+			GraphEdge edge = { _strings.intern(name), _strings.intern(target) };
+			edges.push_back(edge);
+		}
+		deep = get64(rec + 16);
+		return true;
+	}
+	return false;
+}
+
+class DiffLine {
+public:
+	char _kind;
+	uint32_t _parent, _name, _old, _new;
+};
+
+void diff_graphs(DepGraph& old_graph, DepGraph& new_graph, StringTable& strings,
+		ostream& out)
+{
+	vector<uint32_t> work, roots;
+	unordered_set<uint32_t> seen;
+	for (auto graph : { &old_graph, &new_graph }) {
+		graph->roots(roots);
+		for (auto root : roots) {
+			if (seen.insert(root).second) {
+				work.push_back(root);
+			}
+		}
+	}
+
+	vector<DiffLine> lines;
+	vector<GraphEdge> old_edges, new_edges;
+	while (!work.empty()) {
+		uint32_t path = work.back();
+		work.pop_back();
+		uint64_t old_deep = 0, new_deep = 0;
+		bool in_old = old_graph.node(path, old_edges, old_deep);
+		bool in_new = new_graph.node(path, new_edges, new_deep);
+		if (!in_old) {
+			old_edges.clear();
+		}
+		if (!in_new) {
+			new_edges.clear();
+		}
+		if (in_old && in_new && old_deep == new_deep) {
+			// nothing under here changed
+			continue;
+		}
+		unordered_map<uint32_t, uint32_t> old_targets, new_targets;
+		for (auto& edge : old_edges) {
+			old_targets.emplace(edge._name, edge._target);
+		}
+		for (auto& edge : new_edges) {
+			new_targets.emplace(edge._name, edge._target);
+			auto iter = old_targets.find(edge._name);
+			if (iter == old_targets.end()) {
+				lines.push_back({ '+', path, edge._name, 0, edge._target });
+			} else if (iter->second != edge._target) {
+				lines.push_back({ '~', path, edge._name, iter->second, edge._target });
+			}
+		}
+		for (auto& edge : old_edges) {
+			if (!new_targets.count(edge._name)) {
+				lines.push_back({ '-', path, edge._name, edge._target, 0 });
+			}
+		}
+		for (auto edges : { &old_edges, &new_edges }) {
+			for (auto& edge : *edges) {
+				if (seen.insert(edge._target).second) {
+					work.push_back(edge._target);
+				}
+			}
+		}
+	}
+
+	sort(lines.begin(), lines.end(), [&strings](const DiffLine& a, const DiffLine& b) {
+		int c = strings.str(a._parent).compare(strings.str(b._parent));
+		if (c == 0) {
+			c = strings.str(a._name).compare(strings.str(b._name));
+		}
+		return c != 0 ? c < 0 : a._kind < b._kind;
+	});
+	for (auto& line : lines) {
+		out << line._kind << "\t" << strings.str(line._parent)
+			<< "\t" << strings.str(line._name);
+		if (line._kind != '+') {
+			out << "\t" << strings.str(line._old);
+		}
+		if (line._kind != '-') {
+			out << "\t" << strings.str(line._new);
+		}
+		out << "\n";
+	}
+}
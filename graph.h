@@ -0,0 +1,103 @@
+/*
+ * xpldd: resolved dependency graphs, saved to disk and compared
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_GRAPH_H
+#define XPLDD_GRAPH_H
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "stringtable.h"
+
+extern "C" {
+	#include <stdint.h>
+}
+
+// A DT_NEEDED entry, and what it resolved to (itself if it didn't).
+class GraphEdge {
+public:
+	uint32_t _name, _target;
+};
+
+// A resolved dependency graph. Paths are relative to the root of whatever
+// it was resolved in, so graphs from different sysroots line up.
+class DepGraph {
+public:
+	virtual ~DepGraph() {}
+	// the roots that resolved, in the order they were given
+	virtual void roots(std::vector<uint32_t>& out) = 0;
+	// the edges out of path, and a hash covering everything reachable
+	// from it; false if path isn't in the graph
+	virtual bool node(uint32_t path, std::vector<GraphEdge>& edges, uint64_t& deep) = 0;
+};
+
+// A graph built from a resolution in this process.
+class LiveGraph : public DepGraph {
+public:
+	LiveGraph(StringTable& strings) : _strings(strings) {}
+
+	void add_root(std::string_view path);
+	void add_node(std::string_view path, const std::vector<std::string_view>& names,
+		const std::vector<std::string_view>& targets);
+	// works out the deep hashes; call once everything is added
+	void finish();
+	// writes the graph out for SnapshotGraph to read back
+	bool save(const std::string& file, std::string& error);
+
+	void roots(std::vector<uint32_t>& out);
+	bool node(uint32_t path, std::vector<GraphEdge>& edges, uint64_t& deep);
+
+private:
+	class Node {
+	public:
+		std::vector<GraphEdge> _edges;
+		uint64_t _deep;
+		// 0 not seen, 1 in progress, 2 done
+		int _state;
+	};
+	uint64_t deep_hash(uint32_t path);
+
+	StringTable& _strings;
+	std::vector<uint32_t> _roots;
+	std::unordered_map<uint32_t, Node> _nodes;
+	// in the order they were added, for saving
+	std::vector<uint32_t> _order;
+};
+
+// A graph saved by LiveGraph::save, mapped rather than read in, so only the
+// nodes a diff actually looks at are touched.
+class SnapshotGraph : public DepGraph {
+public:
+	SnapshotGraph(StringTable& strings);
+	~SnapshotGraph();
+
+	// true if the start of a file looks like a saved graph
+	static bool is_snapshot(const unsigned char *head, size_t len);
+	bool load(const std::string& file, std::string& error);
+
+	void roots(std::vector<uint32_t>& out);
+	bool node(uint32_t path, std::vector<GraphEdge>& edges, uint64_t& deep);
+
+private:
+	bool string_at(uint32_t id, std::string_view& out) const;
+
+	StringTable& _strings;
+	void *_map;
+	size_t _size;
+	uint32_t _string_count, _node_count, _edge_count, _root_count, _index_size;
+	const unsigned char *_string_table, *_blob, *_nodes, *_edges, *_roots, *_index;
+	uint64_t _blob_size;
+};
+
+// Prints what changed between two graphs, looking only under nodes whose
+// deep hashes differ: lines of "+" (added), "-" (removed), and "~"
+// (retargeted) with the needing file, the DT_NEEDED name, and the targets.
+void diff_graphs(DepGraph& old_graph, DepGraph& new_graph, StringTable& strings,
+	std::ostream& out);
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * xpldd: content hashing, for fingerprints and the parse cache
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_HASH_H
+#define XPLDD_HASH_H
+
+#include <cstddef>
+
+extern "C" {
+	#include <stdint.h>
+}
+
+// XXH64, the same on every machine, so fingerprints can be compared across
+// them. Its four independent lanes keep a core busy enough to hash from the
+// page cache about as fast as it's read.
+uint64_t xxh64(const void *data, size_t length, uint64_t seed);
+
+#endif
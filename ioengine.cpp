@@ -0,0 +1,630 @@
+/*
+ * xpldd: batched file I/O, so a frontier of libraries can be in flight at once
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+
+#include "ioengine.h"
+
+using namespace std;
+
+extern "C" {
+	#include <fcntl.h>
+	#include <unistd.h>
+#ifdef HAVE_LINUX_OPENAT2_H
+	#include <sys/syscall.h>
+#endif
+// the ring needs the 5.6 opcodes (statx, openat2, ...) to be worth it
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_LINUX_OPENAT2_H)
+	#define HAVE_URING_ENGINE 1
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <sys/sysmacros.h>
+#endif
+}
+
+int openat2_resolve(int dirfd, const char *path, int flags, uint64_t resolve)
+{
+#ifdef HAVE_LINUX_OPENAT2_H
+	struct open_how how;
+	memset(&how, 0, sizeof(how));
+	how.flags = flags;
+	how.resolve = resolve;
+	return syscall(__NR_openat2, dirfd, path, &how, sizeof(how));
+#else
+	(void)dirfd; (void)path; (void)flags; (void)resolve;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int open_request(IoRequest& req, int flags)
+{
+	if (req._resolve != 0) {
+		return openat2_resolve(req._dirfd, req._path.c_str(), flags, req._resolve);
+	}
+	return openat(req._dirfd, req._path.c_str(), flags, 0);
+}
+
+void run_request(IoRequest& req)
+{
+	ssize_t ret;
+	switch (req._op) {
+	case IO_STAT:
+		if (req._resolve != 0) {
+			int fd = open_request(req, O_PATH | O_CLOEXEC);
+			if (fd == -1) {
+				req._result = -errno;
+				break;
+			}
+			ret = fstat(fd, &req._st);
+			req._result = ret == 0 ? 0 : -errno;
+			close(fd);
+			break;
+		}
+		ret = fstatat(req._dirfd, req._path.c_str(), &req._st, 0);
+		req._result = ret == 0 ? 0 : -errno;
+		break;
+	case IO_OPEN:
+		ret = open_request(req, O_RDONLY | O_CLOEXEC);
+		req._result = ret >= 0 ? ret : -errno;
+		break;
+	case IO_OPEN_DIR:
+		ret = open_request(req, O_PATH | O_DIRECTORY | O_CLOEXEC);
+		req._result = ret >= 0 ? ret : -errno;
+		break;
+	case IO_READ:
+		req._buf.resize(req._length);
+		ret = pread(req._fd, req._buf.data(), req._length, req._offset);
+		req._result = ret >= 0 ? ret : -errno;
+		req._buf.resize(ret >= 0 ? ret : 0);
+		break;
+	case IO_CLOSE:
+		ret = close(req._fd);
+		req._result = ret == 0 ? 0 : -errno;
+		break;
+	case IO_ADVISE:
+		// returns the error rather than setting errno
+		req._result = -posix_fadvise(req._fd, req._offset, req._length,
+			POSIX_FADV_WILLNEED);
+		break;
+	}
+}
+
+ThreadPool::ThreadPool(unsigned threads)
+	: _fn(nullptr), _next(0), _count(0), _finished(0), _stop(false)
+{
+	for (unsigned i = 0; i < threads; i++) {
+		_threads.emplace_back(&ThreadPool::worker, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard(_lock);
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (auto& thread : _threads) {
+		thread.join();
+	}
+}
+
+unsigned ThreadPool::default_threads()
+{
+	unsigned threads = thread::hardware_concurrency();
+	return threads == 0 ? 4 : threads;
+}
+
+void ThreadPool::worker()
+{
+	unique_lock<mutex> guard(_lock);
+	for (;;) {
+		_wake.wait(guard, [this] { return _stop || _next < _count; });
+		if (_stop) {
+			return;
+		}
+		size_t i = _next++;
+		guard.unlock();
+		(*_fn)(i);
+		guard.lock();
+		if (++_finished == _count) {
+			_done.notify_all();
+		}
+	}
+}
+
+void ThreadPool::parallel_for(size_t count, const function<void(size_t)>& fn)
+{
+	if (count == 0) {
+		return;
+	}
+	unique_lock<mutex> guard(_lock);
+	_fn = &fn;
+	_count = count;
+	_next = _finished = 0;
+	_wake.notify_all();
+	// pitch in rather than sit idle
+	while (_next < _count) {
+		size_t i = _next++;
+		guard.unlock();
+		fn(i);
+		guard.lock();
+		++_finished;
+	}
+	_done.wait(guard, [this] { return _finished == _count; });
+	_fn = nullptr;
+	_count = _next = _finished = 0;
+}
+
+class SyncEngine : public IoEngine {
+public:
+	const char *name() const { return "sync"; }
+	void submit(vector<IoRequest>& batch)
+	{
+		for (auto& req : batch) {
+			run_request(req);
+		}
+	}
+};
+
+class ThreadEngine : public IoEngine {
+public:
+	ThreadEngine() : _pool(ThreadPool::default_threads()) {}
+	const char *name() const { return "threads"; }
+	void submit(vector<IoRequest>& batch)
+	{
+		_pool.parallel_for(batch.size(), [&batch](size_t i) {
+			run_request(batch[i]);
+		});
+	}
+private:
+	ThreadPool _pool;
+};
+
+#ifdef HAVE_URING_ENGINE
+// Talks to the kernel directly instead of through liburing, since all we need
+// is to fill the submission ring once per chunk of a batch and drain it.
+class UringEngine : public IoEngine {
+public:
+	UringEngine();
+	~UringEngine();
+	const char *name() const { return "uring"; }
+	bool ok() const { return _fd != -1; }
+	void submit(vector<IoRequest>& batch);
+
+private:
+	void teardown();
+	int enter(unsigned to_submit, unsigned min_complete);
+	void fill(struct io_uring_sqe *sqe, IoRequest& req, struct statx *stx,
+		struct open_how *how);
+
+	int _fd;
+	unsigned _entries;
+	void *_sq_ring, *_cq_ring;
+	size_t _sq_ring_len, _cq_ring_len, _sqes_len;
+	struct io_uring_sqe *_sqes;
+	struct io_uring_cqe *_cqes;
+	unsigned *_sq_head, *_sq_tail, *_sq_mask, *_sq_array;
+	unsigned *_cq_head, *_cq_tail, *_cq_mask;
+};
+
+#define URING_ENTRIES 64
+
+UringEngine::UringEngine()
+	: _fd(-1), _sq_ring(MAP_FAILED), _cq_ring(MAP_FAILED), _sqes(nullptr)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (_fd == -1) {
+		return;
+	}
+	_entries = params.sq_entries;
+
+	_sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		_sq_ring_len = _cq_ring_len = max(_sq_ring_len, _cq_ring_len);
+	}
+	_sq_ring = mmap(nullptr, _sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+	if (_sq_ring == MAP_FAILED) {
+		goto fail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		_cq_ring = _sq_ring;
+	} else {
+		_cq_ring = mmap(nullptr, _cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+		if (_cq_ring == MAP_FAILED) {
+			goto fail;
+		}
+	}
+	_sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	_sqes = (struct io_uring_sqe*)mmap(nullptr, _sqes_len,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+	if (_sqes == MAP_FAILED) {
+		_sqes = nullptr;
+		goto fail;
+	}
+
+	_sq_head = (unsigned*)((char*)_sq_ring + params.sq_off.head);
+	_sq_tail = (unsigned*)((char*)_sq_ring + params.sq_off.tail);
+	_sq_mask = (unsigned*)((char*)_sq_ring + params.sq_off.ring_mask);
+	_sq_array = (unsigned*)((char*)_sq_ring + params.sq_off.array);
+	_cq_head = (unsigned*)((char*)_cq_ring + params.cq_off.head);
+	_cq_tail = (unsigned*)((char*)_cq_ring + params.cq_off.tail);
+	_cq_mask = (unsigned*)((char*)_cq_ring + params.cq_off.ring_mask);
+	_cqes = (struct io_uring_cqe*)((char*)_cq_ring + params.cq_off.cqes);
+	return;
+
+fail:
+	teardown();
+}
+
+UringEngine::~UringEngine()
+{
+	teardown();
+}
+
+void UringEngine::teardown()
+{
+	if (_sqes != nullptr) {
+		munmap(_sqes, _sqes_len);
+		_sqes = nullptr;
+	}
+	if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring) {
+		munmap(_cq_ring, _cq_ring_len);
+	}
+	_cq_ring = MAP_FAILED;
+	if (_sq_ring != MAP_FAILED) {
+		munmap(_sq_ring, _sq_ring_len);
+		_sq_ring = MAP_FAILED;
+	}
+	if (_fd != -1) {
+		close(_fd);
+		_fd = -1;
+	}
+}
+
+int UringEngine::enter(unsigned to_submit, unsigned min_complete)
+{
+	int ret;
+	do {
+		ret = syscall(__NR_io_uring_enter, _fd, to_submit, min_complete,
+			IORING_ENTER_GETEVENTS, nullptr, 0);
+	} while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+void UringEngine::fill(struct io_uring_sqe *sqe, IoRequest& req, struct statx *stx,
+		struct open_how *how)
+{
+	int flags;
+	memset(sqe, 0, sizeof(*sqe));
+	// the kernel is picky about unused fields being zero
+	if (req._op == IO_STAT || req._op == IO_OPEN || req._op == IO_OPEN_DIR) {
+		sqe->fd = req._dirfd;
+		sqe->addr = (uintptr_t)req._path.c_str();
+	}
+	switch (req._op) {
+	case IO_STAT:
+		if (req._resolve == 0) {
+			sqe->opcode = IORING_OP_STATX;
+			sqe->len = STATX_BASIC_STATS;
+			sqe->off = (uintptr_t)stx;
+			break;
+		}
+		// statx can't be told how to resolve, so open an O_PATH fd
+		// with openat2 instead, and fstat it once it comes back
+		memset(how, 0, sizeof(*how));
+		how->flags = O_PATH | O_CLOEXEC;
+		how->resolve = req._resolve;
+		sqe->opcode = IORING_OP_OPENAT2;
+		sqe->len = sizeof(*how);
+		sqe->off = (uintptr_t)how;
+		break;
+	case IO_OPEN:
+	case IO_OPEN_DIR:
+		flags = req._op == IO_OPEN ? O_RDONLY | O_CLOEXEC
+			: O_PATH | O_DIRECTORY | O_CLOEXEC;
+		if (req._resolve == 0) {
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->open_flags = flags;
+			break;
+		}
+		memset(how, 0, sizeof(*how));
+		how->flags = flags;
+		how->resolve = req._resolve;
+		sqe->opcode = IORING_OP_OPENAT2;
+		sqe->len = sizeof(*how);
+		sqe->off = (uintptr_t)how;
+		break;
+	case IO_READ:
+		req._buf.resize(req._length);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = req._fd;
+		sqe->addr = (uintptr_t)req._buf.data();
+		sqe->len = req._length;
+		sqe->off = req._offset;
+		break;
+	case IO_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = req._fd;
+		break;
+	case IO_ADVISE:
+		sqe->opcode = IORING_OP_FADVISE;
+		sqe->fd = req._fd;
+		sqe->off = req._offset;
+		sqe->len = req._length;
+		sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+		break;
+	}
+}
+
+void UringEngine::submit(vector<IoRequest>& batch)
+{
+	vector<struct statx> stx(batch.size());
+	vector<struct open_how> hows(batch.size());
+	size_t pos = 0;
+	while (pos < batch.size() && _fd != -1) {
+		unsigned chunk = min((size_t)_entries, batch.size() - pos);
+		unsigned tail = *_sq_tail;
+		for (unsigned i = 0; i < chunk; i++) {
+			unsigned idx = (tail + i) & *_sq_mask;
+			fill(&_sqes[idx], batch[pos + i], &stx[pos + i], &hows[pos + i]);
+			batch[pos + i]._result = -ECANCELED;
+			_sqes[idx].user_data = pos + i;
+			_sq_array[idx] = idx;
+		}
+		__atomic_store_n(_sq_tail, tail + chunk, __ATOMIC_RELEASE);
+		if (enter(chunk, chunk) == -1) {
+			// the ring is in an unknown state; stop using it, and let
+			// the synchronous path finish this batch and the rest
+			cerr << "io_uring_enter: " << strerror(errno) << "\n";
+			teardown();
+			break;
+		}
+
+		unsigned completed = 0;
+		while (completed < chunk) {
+			unsigned head = *_cq_head;
+			unsigned cq_tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+			if (head == cq_tail) {
+				if (enter(0, chunk - completed) == -1) {
+					// same as above, but this chunk is still out; the
+					// next one can't go into a ring with it
+					cerr << "io_uring_enter: " << strerror(errno) << "\n";
+					teardown();
+					break;
+				}
+				continue;
+			}
+			for (; head != cq_tail; head++, completed++) {
+				struct io_uring_cqe *cqe = &_cqes[head & *_cq_mask];
+				batch[cqe->user_data]._result = cqe->res;
+			}
+			__atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+		}
+		pos += chunk;
+	}
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		IoRequest& req = batch[i];
+		if (i >= pos || req._result == -EINVAL || req._result == -EOPNOTSUPP
+				|| req._result == -ECANCELED) {
+			// older kernels reject opcodes they don't know with EINVAL
+			run_request(req);
+			continue;
+		}
+		if (req._op == IO_READ) {
+			req._buf.resize(req._result >= 0 ? req._result : 0);
+		} else if (req._op == IO_STAT && req._resolve != 0 && req._result >= 0) {
+			int fd = req._result;
+			req._result = fstat(fd, &req._st) == 0 ? 0 : -errno;
+			close(fd);
+		} else if (req._op == IO_STAT && req._result == 0) {
+			memset(&req._st, 0, sizeof(req._st));
+			req._st.st_dev = makedev(stx[i].stx_dev_major, stx[i].stx_dev_minor);
+			req._st.st_ino = stx[i].stx_ino;
+			req._st.st_mode = stx[i].stx_mode;
+			req._st.st_nlink = stx[i].stx_nlink;
+			req._st.st_size = stx[i].stx_size;
+			req._st.st_mtim.tv_sec = stx[i].stx_mtime.tv_sec;
+			req._st.st_mtim.tv_nsec = stx[i].stx_mtime.tv_nsec;
+			req._st.st_ctim.tv_sec = stx[i].stx_ctime.tv_sec;
+			req._st.st_ctim.tv_nsec = stx[i].stx_ctime.tv_nsec;
+		}
+	}
+}
+#endif
+
+// How much of a DeadlineEngine batch is still being waited on.
+class DeadlineBatch {
+public:
+	size_t _pending;
+};
+
+// A request being run for a DeadlineEngine batch. It's shared with the
+// worker running it, which can outlive the batch if the request hangs.
+class DeadlineTask {
+public:
+	DeadlineTask(IoRequest& req, shared_ptr<DeadlineBatch>& batch)
+		: _req(move(req)), _batch(batch), _state(TASK_QUEUED), _abandoned(false) {}
+
+	enum { TASK_QUEUED, TASK_RUNNING, TASK_DONE };
+
+	IoRequest _req;
+	shared_ptr<DeadlineBatch> _batch;
+	int _state;
+	std::chrono::steady_clock::time_point _started;
+	// the batch stopped waiting for it; a worker skips it if it hasn't
+	// started, and throws away the result if it has
+	bool _abandoned;
+};
+
+class DeadlineCrew {
+public:
+	DeadlineCrew() : _workers(0), _stuck(0), _stop(false) {}
+
+	mutex _lock;
+	condition_variable _wake, _progress;
+	deque<shared_ptr<DeadlineTask>> _queue;
+	// workers alive, and how many are still in an abandoned request
+	unsigned _workers, _stuck;
+	bool _stop;
+};
+
+static void deadline_worker(shared_ptr<DeadlineCrew> crew)
+{
+	unique_lock<mutex> guard(crew->_lock);
+	for (;;) {
+		crew->_wake.wait(guard, [&crew] { return crew->_stop || !crew->_queue.empty(); });
+		if (crew->_queue.empty()) {
+			crew->_workers--;
+			return;
+		}
+		shared_ptr<DeadlineTask> task = crew->_queue.front();
+		crew->_queue.pop_front();
+		if (task->_abandoned) {
+			continue;
+		}
+		task->_state = DeadlineTask::TASK_RUNNING;
+		task->_started = chrono::steady_clock::now();
+		guard.unlock();
+		run_request(task->_req);
+		guard.lock();
+		task->_state = DeadlineTask::TASK_DONE;
+		if (!task->_abandoned) {
+			if (--task->_batch->_pending == 0) {
+				crew->_progress.notify_all();
+			}
+			continue;
+		}
+		// nobody's coming for it
+		crew->_stuck--;
+		if ((task->_req._op == IO_OPEN || task->_req._op == IO_OPEN_DIR)
+				&& task->_req._result >= 0) {
+			close(task->_req._result);
+		}
+	}
+}
+
+// past this many workers stuck in hung requests, stop hiring more
+#define DEADLINE_MAX_STUCK 64
+
+DeadlineEngine::DeadlineEngine(unsigned timeout_ms)
+	: _timeout(timeout_ms), _threads(ThreadPool::default_threads()),
+	_crew(make_shared<DeadlineCrew>())
+{
+	lock_guard<mutex> guard(_crew->_lock);
+	hire();
+}
+
+DeadlineEngine::~DeadlineEngine()
+{
+	{
+		lock_guard<mutex> guard(_crew->_lock);
+		_crew->_stop = true;
+	}
+	// the idle ones exit, and stuck ones once they come back
+	_crew->_wake.notify_all();
+}
+
+// Keeps enough workers that aren't stuck around; call with the lock held.
+void DeadlineEngine::hire()
+{
+	while (_crew->_workers - _crew->_stuck < _threads
+			&& _crew->_stuck < DEADLINE_MAX_STUCK) {
+		_crew->_workers++;
+		thread(deadline_worker, _crew).detach();
+	}
+}
+
+void DeadlineEngine::submit(vector<IoRequest>& batch)
+{
+	auto state = make_shared<DeadlineBatch>();
+	state->_pending = batch.size();
+	vector<shared_ptr<DeadlineTask>> tasks;
+	unique_lock<mutex> guard(_crew->_lock);
+	for (auto& req : batch) {
+		tasks.push_back(make_shared<DeadlineTask>(req, state));
+		_crew->_queue.push_back(tasks.back());
+	}
+	_crew->_wake.notify_all();
+
+	// the workers only say something when the batch is done, so look for
+	// overdue requests whenever the earliest of them could be; anything
+	// that starts after a look has its deadline after the next one
+	auto check = chrono::steady_clock::now() + _timeout;
+	while (state->_pending > 0) {
+		if (_crew->_progress.wait_until(guard, check) != cv_status::timeout
+				|| state->_pending == 0) {
+			continue;
+		}
+		auto now = chrono::steady_clock::now();
+		check = now + _timeout;
+		for (auto& task : tasks) {
+			if (task->_state != DeadlineTask::TASK_RUNNING || task->_abandoned) {
+				continue;
+			} else if (now - task->_started >= _timeout) {
+				task->_abandoned = true;
+				_crew->_stuck++;
+				state->_pending--;
+			} else {
+				check = min(check, task->_started + _timeout);
+			}
+		}
+		hire();
+		if (_crew->_workers == _crew->_stuck) {
+			// nobody left to run the rest
+			for (auto& task : tasks) {
+				if (task->_state == DeadlineTask::TASK_QUEUED && !task->_abandoned) {
+					task->_abandoned = true;
+					state->_pending--;
+				}
+			}
+		}
+	}
+
+	for (size_t i = 0; i < batch.size(); i++) {
+		if (tasks[i]->_abandoned) {
+			batch[i]._result = -ETIMEDOUT;
+		} else {
+			batch[i] = move(tasks[i]->_req);
+		}
+	}
+}
+
+IoEngine *make_io_engine(const string& name, unsigned timeout_ms)
+{
+	if (timeout_ms != 0) {
+		// the others can't walk away from a request that's in the kernel
+		return name == "auto" || name == "threads" ? new DeadlineEngine(timeout_ms) : nullptr;
+	}
+	if (name == "sync") {
+		return new SyncEngine();
+	} else if (name == "threads") {
+		return new ThreadEngine();
+	} else if (name != "auto" && name != "uring") {
+		return nullptr;
+	}
+#ifdef HAVE_URING_ENGINE
+	UringEngine *uring = new UringEngine();
+	if (uring->ok()) {
+		return uring;
+	}
+	delete uring;
+#endif
+	if (name == "uring") {
+		cerr << "io_uring unavailable, falling back to threads\n";
+	}
+	return new ThreadEngine();
+}
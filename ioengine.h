@@ -0,0 +1,144 @@
+/*
+ * xpldd: batched file I/O, so a frontier of libraries can be in flight at once
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_IOENGINE_H
+#define XPLDD_IOENGINE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+	#include <fcntl.h>
+	#include <stdint.h>
+	#include <sys/stat.h>
+	#include <sys/types.h>
+#ifdef HAVE_LINUX_OPENAT2_H
+	#include <linux/openat2.h>
+#endif
+}
+
+#ifndef HAVE_LINUX_OPENAT2_H
+// these only mean anything to openat2, which we won't call without it
+#define RESOLVE_NO_MAGICLINKS 0x02
+#define RESOLVE_BENEATH 0x08
+#define RESOLVE_IN_ROOT 0x10
+#endif
+#ifndef O_PATH
+#define O_PATH 0
+#endif
+
+enum IoOp {
+	IO_STAT,
+	IO_OPEN,
+	IO_OPEN_DIR,
+	IO_READ,
+	IO_CLOSE,
+	IO_ADVISE,
+};
+
+// A single operation in a batch. The caller fills in the operation and its
+// arguments, and the engine fills in _result like a raw syscall would: the
+// fd for IO_OPEN, bytes read for IO_READ, 0 otherwise, or -errno on failure.
+// IO_OPEN_DIR is IO_OPEN for an O_PATH descriptor to a directory, for
+// looking things up relative to it.
+// IO_ADVISE tells the kernel we'll want a range soon (POSIX_FADV_WILLNEED),
+// so it can start reading it in while we get on with something else.
+//
+// Paths are relative to _dirfd. If _resolve has openat2 RESOLVE_* flags in
+// it, the lookup goes through openat2 with them (i.e. RESOLVE_IN_ROOT to keep
+// symlinks inside a sysroot).
+class IoRequest {
+public:
+	IoRequest(IoOp op) : _op(op), _dirfd(AT_FDCWD), _resolve(0), _fd(-1),
+		_offset(0), _length(0), _result(0) {}
+
+	IoOp _op;
+	std::string _path; // IO_STAT, IO_OPEN, IO_OPEN_DIR
+	int _dirfd; // IO_STAT, IO_OPEN, IO_OPEN_DIR
+	uint64_t _resolve; // IO_STAT, IO_OPEN, IO_OPEN_DIR
+	int _fd; // IO_READ, IO_CLOSE, IO_ADVISE
+	off_t _offset; // IO_READ, IO_ADVISE
+	size_t _length; // IO_READ, IO_ADVISE
+	// results
+	int _result;
+	std::vector<unsigned char> _buf; // IO_READ, trimmed to what was read
+	struct stat _st; // IO_STAT, follows symlinks
+};
+
+// Runs a request synchronously; the fallback for every engine.
+void run_request(IoRequest& req);
+
+// openat2(2), or -1 with ENOSYS where it isn't available.
+int openat2_resolve(int dirfd, const char *path, int flags, uint64_t resolve);
+
+// Fixed set of workers that run a function over a range of indices.
+class ThreadPool {
+public:
+	// 0 threads means the caller does all of the work itself
+	ThreadPool(unsigned threads);
+	~ThreadPool();
+
+	// calls fn(0) .. fn(count - 1) across the pool (and the calling
+	// thread), returning once all of them finished
+	void parallel_for(size_t count, const std::function<void(size_t)>& fn);
+
+	static unsigned default_threads();
+
+private:
+	void worker();
+
+	std::vector<std::thread> _threads;
+	std::mutex _lock;
+	std::condition_variable _wake, _done;
+	const std::function<void(size_t)> *_fn;
+	size_t _next, _count, _finished;
+	bool _stop;
+};
+
+class IoEngine {
+public:
+	virtual ~IoEngine() {}
+	virtual const char *name() const = 0;
+	// runs every request in the batch, returning once all are complete
+	virtual void submit(std::vector<IoRequest>& batch) = 0;
+};
+
+class DeadlineCrew;
+
+// Like the thread engine, but gives up on a request that's been running for
+// longer than the timeout, which comes back as -ETIMEDOUT; that way, one
+// hung NFS or FUSE mount costs a timeout instead of the whole run. There's
+// no interrupting a blocked syscall, so the worker stuck in it is left to
+// it (and cleans up after it, if it ever returns) while another is hired
+// to take its place. If every worker ends up stuck, whatever's left in the
+// batch times out without being run.
+class DeadlineEngine : public IoEngine {
+public:
+	DeadlineEngine(unsigned timeout_ms);
+	~DeadlineEngine();
+	const char *name() const { return "threads"; }
+	void submit(std::vector<IoRequest>& batch);
+
+private:
+	void hire();
+
+	std::chrono::milliseconds _timeout;
+	unsigned _threads;
+	// shared with the workers, since stuck ones can outlive us
+	std::shared_ptr<DeadlineCrew> _crew;
+};
+
+// "auto" (io_uring if the kernel lets us, else threads), "uring",
+// "threads", or "sync"; returns nullptr for an unknown name. With a timeout
+// (in milliseconds), only "auto" and "threads" work, as a DeadlineEngine.
+IoEngine *make_io_engine(const std::string& name, unsigned timeout_ms = 0);
+
+#endif
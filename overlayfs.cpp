@@ -0,0 +1,290 @@
+/*
+ * xpldd: several sysroots stacked like overlayfs, i.e. container image layers
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cerrno>
+#include <cstring>
+
+#include "overlayfs.h"
+
+using namespace std;
+
+extern "C" {
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <limits.h>
+	#include <sys/sysmacros.h>
+	#include <sys/xattr.h>
+	#include <unistd.h>
+}
+
+// OCI image layers mark deletions with these; overlayfs itself uses 0:0
+// character devices and an xattr, which are handled too
+#define WHITEOUT_PREFIX ".wh."
+#define WHITEOUT_OPAQUE ".wh..wh..opq"
+
+OverlayVfs::OverlayVfs(const vector<string>& layers, IoEngine *io)
+	: _layers(layers), _host("", io)
+{
+}
+
+bool OverlayVfs::load(string& error)
+{
+	OverlayNode root = { 0, S_IFDIR, 0, "", {} };
+	_index[""] = root;
+	for (size_t i = 0; i < _layers.size(); i++) {
+		int fd = ::open(_layers[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		struct stat st;
+		if (fd == -1 || fstat(fd, &st) == -1) {
+			error = _layers[i] + ": " + strerror(errno);
+			if (fd != -1) {
+				close(fd);
+			}
+			return false;
+		}
+		_devs.push_back(st.st_dev);
+		if (!walk_layer(i, fd, "", error)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void OverlayVfs::erase(const string& path)
+{
+	auto iter = _index.find(path);
+	if (iter == _index.end()) {
+		return;
+	}
+	// each child takes itself out of our set as it goes
+	auto children = move(iter->second._children);
+	for (auto& child : children) {
+		erase(path + "/" + child);
+	}
+	_index.erase(path);
+	size_t slash = path.rfind('/');
+	auto parent = _index.find(path.substr(0, slash));
+	if (parent != _index.end()) {
+		parent->second._children.erase(path.substr(slash + 1));
+	}
+}
+
+class LayerEntry {
+public:
+	string _name;
+	unsigned char _type;
+	ino_t _ino;
+};
+
+static bool xattr_opaque(int fd)
+{
+	char value = 0;
+	return (fgetxattr(fd, "trusted.overlay.opaque", &value, 1) == 1 && value == 'y')
+		|| (fgetxattr(fd, "user.overlay.opaque", &value, 1) == 1 && value == 'y');
+}
+
+// Merges one directory of a layer into the index at path; takes ownership
+// of fd.
+bool OverlayVfs::walk_layer(size_t layer, int fd, const string& path, string& error)
+{
+	DIR *d = fdopendir(fd);
+	if (d == nullptr) {
+		error = _layers[layer] + path + ": " + strerror(errno);
+		close(fd);
+		return false;
+	}
+	vector<LayerEntry> ents;
+	bool opaque = false;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != nullptr) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		} else if (strcmp(ent->d_name, WHITEOUT_OPAQUE) == 0) {
+			opaque = true;
+			continue;
+		}
+		LayerEntry e = { ent->d_name, ent->d_type, ent->d_ino };
+		ents.push_back(e);
+	}
+
+	OverlayNode& dir = _index[path];
+	// an opaque directory hides everything below it, but only lower
+	// layers can have put anything there yet
+	if (layer > 0 && !dir._children.empty() && (opaque || xattr_opaque(fd))) {
+		auto children = dir._children;
+		for (auto& child : children) {
+			erase(path + "/" + child);
+		}
+	}
+
+	bool ok = true;
+	for (auto& e : ents) {
+		const string& name = e._name;
+		if (name.compare(0, strlen(WHITEOUT_PREFIX), WHITEOUT_PREFIX) == 0) {
+			erase(path + "/" + name.substr(strlen(WHITEOUT_PREFIX)));
+			continue;
+		}
+		// the type from readdir saves a stat for almost everything
+		struct stat st;
+		st.st_ino = e._ino;
+		st.st_mode = DTTOIF(e._type);
+		if ((e._type == DT_UNKNOWN || e._type == DT_CHR)
+				&& fstatat(fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+			continue;
+		}
+		if (S_ISCHR(st.st_mode) && major(st.st_rdev) == 0 && minor(st.st_rdev) == 0) {
+			erase(path + "/" + name);
+			continue;
+		}
+
+		string child = path + "/" + name;
+		auto existing = _index.find(child);
+		bool merge = S_ISDIR(st.st_mode) && existing != _index.end()
+			&& S_ISDIR(existing->second._mode);
+		if (!merge) {
+			// anything else replaces what was there, whole subtree
+			// and all
+			erase(child);
+		}
+		OverlayNode& node = _index[child];
+		node._layer = layer;
+		node._mode = st.st_mode & S_IFMT;
+		node._ino = st.st_ino;
+		dir._children.insert(name);
+		if (S_ISLNK(st.st_mode)) {
+			char target[PATH_MAX];
+			ssize_t len = readlinkat(fd, name.c_str(), target, sizeof(target));
+			node._link.assign(target, len > 0 ? len : 0);
+		} else if (S_ISDIR(st.st_mode)) {
+			int child_fd = openat(fd, name.c_str(),
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (child_fd == -1 || !walk_layer(layer, child_fd, child, error)) {
+				if (child_fd == -1) {
+					error = _layers[layer] + child + ": " + strerror(errno);
+				}
+				ok = false;
+				break;
+			}
+		}
+	}
+	closedir(d);
+	return ok;
+}
+
+const OverlayNode *OverlayVfs::resolve(const string& path, string& real) const
+{
+	auto step = [this](const string& next, string& link) {
+		auto iter = _index.find(next);
+		if (iter == _index.end()) {
+			return -1;
+		} else if (S_ISLNK(iter->second._mode)) {
+			link = iter->second._link;
+			return 1;
+		}
+		return 0;
+	};
+	if (vfs_walk(path, step, real) != 0) {
+		return nullptr;
+	}
+	return &_index.find(real)->second;
+}
+
+string OverlayVfs::host_path(const string& path) const
+{
+	string real;
+	const OverlayNode *node = resolve(path, real);
+	if (node == nullptr || !S_ISREG(node->_mode)) {
+		return "";
+	}
+	return _layers[node->_layer] + real;
+}
+
+int OverlayVfs::stat(const string& path, struct stat& st)
+{
+	string real;
+	const OverlayNode *node = resolve(path, real);
+	if (node == nullptr) {
+		return -ENOENT;
+	}
+	// enough to go on without touching the layer again
+	memset(&st, 0, sizeof(st));
+	st.st_mode = node->_mode | (S_ISDIR(node->_mode) ? 0755 : 0644);
+	st.st_nlink = 1;
+	st.st_dev = _devs.empty() ? 0 : _devs[node->_layer];
+	st.st_ino = node->_ino;
+	return 0;
+}
+
+VfsFile *OverlayVfs::open(const string& path)
+{
+	string host = host_path(path);
+	if (host.empty()) {
+		errno = ENOENT;
+		return nullptr;
+	}
+	return _host.open(host);
+}
+
+int OverlayVfs::readlink(const string& path, string& target)
+{
+	string dir, name, real;
+	if (!vfs_split(path, dir, name) || resolve(dir, real) == nullptr) {
+		return -ENOENT;
+	}
+	auto iter = _index.find(real + "/" + name);
+	if (iter == _index.end()) {
+		return -ENOENT;
+	} else if (!S_ISLNK(iter->second._mode)) {
+		return -EINVAL;
+	}
+	target = iter->second._link;
+	return 0;
+}
+
+int OverlayVfs::list(const string& dir, vector<string>& names)
+{
+	string real;
+	const OverlayNode *node = resolve(dir, real);
+	if (node == nullptr) {
+		return -ENOENT;
+	} else if (!S_ISDIR(node->_mode)) {
+		return -ENOTDIR;
+	}
+	names.assign(node->_children.begin(), node->_children.end());
+	return 0;
+}
+
+void OverlayVfs::open_many(const vector<string>& paths, vector<VfsFile*>& files)
+{
+	vector<string> hosts;
+	vector<size_t> owners;
+	for (size_t i = 0; i < paths.size(); i++) {
+		string host = host_path(paths[i]);
+		if (!host.empty()) {
+			hosts.push_back(host);
+			owners.push_back(i);
+		}
+	}
+	vector<VfsFile*> opened;
+	_host.open_many(hosts, opened);
+	files.assign(paths.size(), nullptr);
+	for (size_t i = 0; i < opened.size(); i++) {
+		files[owners[i]] = opened[i];
+	}
+}
+
+void OverlayVfs::advise_many(vector<VfsRange>& ranges)
+{
+	_host.advise_many(ranges);
+}
+
+void OverlayVfs::read_many(vector<VfsRange>& ranges)
+{
+	_host.read_many(ranges);
+}
+
+void OverlayVfs::close_many(vector<VfsFile*>& files)
+{
+	_host.close_many(files);
+}
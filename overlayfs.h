@@ -0,0 +1,61 @@
+/*
+ * xpldd: several sysroots stacked like overlayfs, i.e. container image layers
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_OVERLAYFS_H
+#define XPLDD_OVERLAYFS_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vfs.h"
+
+// What's at a path in the merged view, and which layer it came from.
+class OverlayNode {
+public:
+	size_t _layer;
+	mode_t _mode; // just the S_IFMT bits
+	ino_t _ino;
+	std::string _link; // symlink target
+	std::set<std::string> _children; // names, for directories
+};
+
+class OverlayVfs : public Vfs {
+public:
+	// layers go from the bottom up, so later ones shadow earlier ones;
+	// io is used for reading the files, and the caller still owns it
+	OverlayVfs(const std::vector<std::string>& layers, IoEngine *io);
+
+	// walks every layer once, building the merged index; returns false
+	// and sets error if a layer can't be read
+	bool load(std::string& error);
+
+	int stat(const std::string& path, struct stat& st);
+	VfsFile *open(const std::string& path);
+	int list(const std::string& dir, std::vector<std::string>& names);
+	int readlink(const std::string& path, std::string& target);
+
+	void open_many(const std::vector<std::string>& paths, std::vector<VfsFile*>& files);
+	void advise_many(std::vector<VfsRange>& ranges);
+	void read_many(std::vector<VfsRange>& ranges);
+	void close_many(std::vector<VfsFile*>& files);
+
+private:
+	bool walk_layer(size_t layer, int fd, const std::string& path, std::string& error);
+	void erase(const std::string& path);
+	const OverlayNode *resolve(const std::string& path, std::string& real) const;
+	// where a merged path really is on the host, or "" if it isn't a file
+	std::string host_path(const std::string& path) const;
+
+	std::vector<std::string> _layers;
+	std::vector<dev_t> _devs;
+	// every path in the merged view, so a lookup is one probe no matter
+	// how many layers there are
+	std::unordered_map<std::string, OverlayNode> _index;
+	HostVfs _host;
+};
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * xpldd: parse results shared between processes on the same machine
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include "hash.h"
+#include "parsecache.h"
+
+using namespace std;
+
+extern "C" {
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+}
+
+// Only ever read by the machine that wrote it, so everything is in its
+// byte order. The header is the magic and how much of the entry area is
+// allocated, the slots hold an entry's offset plus one (zero is empty),
+// and the entries take up the rest.
+#define CACHE_MAGIC "XPLDDC1\n"
+#define CACHE_SIZE (16 * 1024 * 1024)
+#define CACHE_HEADER 64
+#define CACHE_SLOTS 65536
+#define CACHE_DATA (CACHE_HEADER + CACHE_SLOTS * 8)
+#define CACHE_DATA_SIZE (CACHE_SIZE - CACHE_DATA)
+// past this many collisions, it's full enough to not bother
+#define CACHE_PROBES 256
+
+// An entry: its length and flags, the key, the ElfIdent, the counts of
+// segments, DT_NEEDED, and DT_RPATH entries, then the segments, then the
+// strings, each NUL terminated.
+#define ENTRY_FULL 1
+#define ENTRY_FIXED 104
+#define ENTRY_SEGMENT 24
+
+#define ALIGN8(x) (((x) + 7) & ~(uint64_t)7)
+
+template <typename T>
+static void put(vector<unsigned char>& out, size_t off, T val)
+{
+	memcpy(out.data() + off, &val, sizeof(val));
+}
+
+template <typename T>
+static T get(const unsigned char *p)
+{
+	T val;
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+ParseCache::ParseCache() : _map(nullptr), _slots(nullptr), _data(nullptr)
+{
+}
+
+ParseCache::~ParseCache()
+{
+	if (_map != nullptr) {
+		munmap(_map, CACHE_SIZE);
+	}
+}
+
+bool ParseCache::open(const string& file, string& error)
+{
+	int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		error = strerror(errno);
+		if (fd != -1) {
+			close(fd);
+		}
+		return false;
+	}
+	// a new one is sized in one go, so anything else isn't ours
+	if (st.st_size != 0 && st.st_size != CACHE_SIZE) {
+		close(fd);
+		error = "not a parse cache";
+		return false;
+	}
+	if (st.st_size == 0 && ftruncate(fd, CACHE_SIZE) == -1) {
+		error = strerror(errno);
+		close(fd);
+		return false;
+	}
+	void *map = mmap(nullptr, CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		error = strerror(errno);
+		return false;
+	}
+	_map = (unsigned char*)map;
+
+	// whoever gets here first on a new one stamps it; it's all zeroes
+	// otherwise, which is already an empty table
+	uint64_t magic, expected = 0;
+	memcpy(&magic, CACHE_MAGIC, sizeof(magic));
+	if (!__atomic_compare_exchange_n((uint64_t*)_map, &expected, magic, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && expected != magic) {
+		error = "not a parse cache";
+		return false;
+	}
+	_slots = (uint64_t*)(_map + CACHE_HEADER);
+	_data = _map + CACHE_DATA;
+	return true;
+}
+
+ParseCache::Key ParseCache::key_of(const struct stat& st)
+{
+	Key key;
+	key._dev = st.st_dev;
+	key._ino = st.st_ino;
+	key._size = st.st_size;
+	key._mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	key._ctime = (uint64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+	return key;
+}
+
+// The entry a slot points at, if it's all inside the entry area; the file
+// is writable by anyone who can use it, so nothing in it is trusted.
+const unsigned char *ParseCache::entry_at(uint64_t slot_value, uint64_t& length)
+{
+	uint64_t off = slot_value - 1;
+	if (off > CACHE_DATA_SIZE - ENTRY_FIXED) {
+		return nullptr;
+	}
+	const unsigned char *entry = _data + off;
+	length = get<uint32_t>(entry);
+	if (length < ENTRY_FIXED || length > CACHE_DATA_SIZE - off) {
+		return nullptr;
+	}
+	return entry;
+}
+
+bool ParseCache::entry_is(const unsigned char *entry, const Key& key)
+{
+	return memcmp(entry + 8, &key, sizeof(key)) == 0;
+}
+
+bool ParseCache::entry_full(const unsigned char *entry)
+{
+	return get<uint32_t>(entry + 4) & ENTRY_FULL;
+}
+
+bool ParseCache::find(const struct stat& st, ElfIdent& ident, Binary *binary,
+		StringTable& strings)
+{
+	Key key = key_of(st);
+	uint64_t hash = xxh64(&key, sizeof(key), 0);
+	for (int i = 0; i < CACHE_PROBES; i++) {
+		uint64_t slot = __atomic_load_n(&_slots[(hash + i) & (CACHE_SLOTS - 1)],
+			__ATOMIC_ACQUIRE);
+		if (slot == 0) {
+			return false;
+		}
+		uint64_t length;
+		const unsigned char *entry = entry_at(slot, length);
+		if (entry == nullptr || !entry_is(entry, key)) {
+			continue;
+		}
+		if (binary != nullptr && !entry_full(entry)) {
+			return false;
+		}
+
+		uint32_t loads = get<uint32_t>(entry + 60);
+		uint32_t needed = get<uint32_t>(entry + 96);
+		uint32_t rpath = get<uint32_t>(entry + 100);
+		if (loads > (length - ENTRY_FIXED) / ENTRY_SEGMENT) {
+			return false;
+		}
+		ident._kind = (IdentKind)entry[48];
+		ident._class = entry[49];
+		ident._data = entry[50];
+		ident._osabi = entry[51];
+		ident._type = get<uint16_t>(entry + 52);
+		ident._machine = get<uint16_t>(entry + 54);
+		ident._have_phdrs = entry[56];
+		ident._dyn_offset = get<uint64_t>(entry + 64);
+		ident._dyn_size = get<uint64_t>(entry + 72);
+		ident._shoff = get<uint64_t>(entry + 80);
+		ident._shsize = get<uint64_t>(entry + 88);
+		ident._loads.clear();
+		const unsigned char *p = entry + ENTRY_FIXED;
+		for (uint32_t j = 0; j < loads; j++, p += ENTRY_SEGMENT) {
+			ElfSegment seg;
+			seg._vaddr = get<uint64_t>(p);
+			seg._offset = get<uint64_t>(p + 8);
+			seg._filesz = get<uint64_t>(p + 16);
+			ident._loads.push_back(seg);
+		}
+		if (binary == nullptr) {
+			return true;
+		}
+
+		const unsigned char *end = entry + length;
+		for (uint32_t j = 0; j < needed + rpath; j++) {
+			const unsigned char *nul = (const unsigned char*)memchr(p, '\0', end - p);
+			if (nul == nullptr) {
+				binary->_depends.clear();
+				binary->_rpath.clear();
+				return false;
+			}
+			auto& list = j < needed ? binary->_depends : binary->_rpath;
+			list.push_back(strings.view(string_view((const char*)p, nul - p)));
+			p = nul + 1;
+		}
+		return true;
+	}
+	return false;
+}
+
+void ParseCache::insert(const struct stat& st, const ElfIdent& ident, const Binary *binary)
+{
+	Key key = key_of(st);
+	uint64_t length = ENTRY_FIXED + ident._loads.size() * ENTRY_SEGMENT;
+	if (binary != nullptr) {
+		for (auto& s : binary->_depends) {
+			length += s.size() + 1;
+		}
+		for (auto& s : binary->_rpath) {
+			length += s.size() + 1;
+		}
+	}
+	length = ALIGN8(length);
+	if (length > CACHE_DATA_SIZE) {
+		return;
+	}
+
+	vector<unsigned char> entry(length, 0);
+	put<uint32_t>(entry, 0, length);
+	put<uint32_t>(entry, 4, binary != nullptr ? ENTRY_FULL : 0);
+	put(entry, 8, key);
+	entry[48] = ident._kind;
+	entry[49] = ident._class;
+	entry[50] = ident._data;
+	entry[51] = ident._osabi;
+	put<uint16_t>(entry, 52, ident._type);
+	put<uint16_t>(entry, 54, ident._machine);
+	entry[56] = ident._have_phdrs;
+	put<uint32_t>(entry, 60, ident._loads.size());
+	put<uint64_t>(entry, 64, ident._dyn_offset);
+	put<uint64_t>(entry, 72, ident._dyn_size);
+	put<uint64_t>(entry, 80, ident._shoff);
+	put<uint64_t>(entry, 88, ident._shsize);
+	size_t off = ENTRY_FIXED;
+	for (auto& seg : ident._loads) {
+		put<uint64_t>(entry, off, seg._vaddr);
+		put<uint64_t>(entry, off + 8, seg._offset);
+		put<uint64_t>(entry, off + 16, seg._filesz);
+		off += ENTRY_SEGMENT;
+	}
+	if (binary != nullptr) {
+		put<uint32_t>(entry, 96, binary->_depends.size());
+		put<uint32_t>(entry, 100, binary->_rpath.size());
+		for (auto list : { &binary->_depends, &binary->_rpath }) {
+			for (auto& s : *list) {
+				// already NUL terminated, since it's zeroed
+				memcpy(entry.data() + off, s.data(), s.size());
+				off += s.size() + 1;
+			}
+		}
+	}
+
+	uint64_t hash = xxh64(&key, sizeof(key), 0);
+	uint64_t at = 0;
+	bool written = false;
+	for (int i = 0; i < CACHE_PROBES; i++) {
+		uint64_t *slot = &_slots[(hash + i) & (CACHE_SLOTS - 1)];
+		uint64_t cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+		for (;;) {
+			if (cur != 0) {
+				uint64_t cur_length;
+				const unsigned char *existing = entry_at(cur, cur_length);
+				if (existing == nullptr || !entry_is(existing, key)) {
+					// someone else's; keep probing
+					break;
+				}
+				if (entry_full(existing) || binary == nullptr) {
+					// nothing to add to what's there
+					return;
+				}
+			}
+			if (!written) {
+				at = __atomic_fetch_add((uint64_t*)(_map + 8), length, __ATOMIC_RELAXED);
+				if (at > CACHE_DATA_SIZE - length) {
+					// full up
+					return;
+				}
+				memcpy(_data + at, entry.data(), length);
+				written = true;
+			}
+			// the entry has to be visible before the slot pointing at
+			// it is; on failure, cur is whatever beat us there
+			if (__atomic_compare_exchange_n(slot, &cur, at + 1, false,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+				return;
+			}
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * xpldd: parse results shared between processes on the same machine
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_PARSECACHE_H
+#define XPLDD_PARSECACHE_H
+
+#include <string>
+
+#include "resolver.h"
+
+extern "C" {
+	#include <stdint.h>
+	#include <sys/stat.h>
+}
+
+// What files parsed to, kept in a file every xpldd on the machine can map
+// at once, so a library one of them has already read is never read again
+// by the others. Files are known by their device, inode, size, and change
+// times, not their paths, so a library changed in place (or replaced by a
+// new one at the same path) is a miss, never a stale hit.
+//
+// The file is a fixed size hash table with open addressing over an append
+// only area of entries. Adding one allocates space with an atomic add,
+// writes the entry, then publishes it with a compare and swap on its slot,
+// so there are no locks to be left held by a process that dies, and readers
+// never see a half written entry. Once it fills, new results just aren't
+// kept; removing the file starts it over.
+class ParseCache {
+public:
+	ParseCache();
+	~ParseCache();
+	ParseCache(const ParseCache&) = delete;
+	ParseCache& operator=(const ParseCache&) = delete;
+
+	// maps file, creating it if needed; false and sets error if it can't,
+	// or it isn't a parse cache
+	bool open(const std::string& file, std::string& error);
+
+	// fills in ident and (if it's given) the DT_NEEDED and DT_RPATH entries
+	// of binary for the file st is for; false if it isn't known, or only
+	// its header is and binary was asked for
+	bool find(const struct stat& st, ElfIdent& ident, Binary *binary,
+		StringTable& strings);
+	// remembers the header of the file st is for, and what it needs if
+	// binary is given; a header only entry is replaced by a full one
+	void insert(const struct stat& st, const ElfIdent& ident, const Binary *binary);
+
+private:
+	class Key {
+	public:
+		uint64_t _dev, _ino, _size, _mtime, _ctime;
+	};
+	static Key key_of(const struct stat& st);
+	const unsigned char *entry_at(uint64_t slot_value, uint64_t& length);
+	bool entry_is(const unsigned char *entry, const Key& key);
+	bool entry_full(const unsigned char *entry);
+
+	unsigned char *_map;
+	uint64_t *_slots;
+	unsigned char *_data;
+};
+
+#endif
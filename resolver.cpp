@@ -0,0 +1,1803 @@
+/*
+ * xpldd: resolving ELF dependencies, for the command line or in process
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "archivefs.h"
+#include "byteswap.h"
+#ifdef BUILTIN_ELF
+#include "elfparse.h"
+#endif
+#include "elfread.h"
+#include "ioengine.h"
+#include "overlayfs.h"
+#include "parsecache.h"
+#include "resolver.h"
+#include "vfs.h"
+
+using namespace std;
+
+extern "C" {
+	// open/close
+	#include <ar.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#ifndef BUILTIN_ELF
+	// libelf
+	#include <libelf.h>
+	#include <gelf.h>
+#endif
+}
+
+static string candidate_path(string_view name, string_view rpath, Resolver& state)
+{
+	return vfs_join(state._prefix + string(rpath), string(name));
+}
+
+static bool path_exists(string_view name, string_view rpath, Resolver& state)
+{
+	struct stat st;
+	return state._vfs->lookup(state._prefix + string(rpath), string(name), st) == 0;
+}
+
+// enough to cover the ELF header, and the start of any linker script
+#define IDENT_PAGE_SIZE 4096
+
+static bool looks_like_ldscript(const unsigned char *buf, size_t len)
+{
+	// plain text, using the commands libc and friends use in their .so
+	// stubs (i.e. GROUP ( libc.so.6 ... ) )
+	if (memchr(buf, '\0', len) != nullptr) {
+		return false;
+	}
+	string text((const char*)buf, len);
+	return text.find("GROUP") != string::npos
+		|| text.find("INPUT") != string::npos
+		|| text.find("OUTPUT_FORMAT") != string::npos;
+}
+
+template <typename R>
+static void parse_phdrs(ElfIdent& ident, const typename R::Ehdr& ehdr,
+		const unsigned char *hdr, size_t len)
+{
+	typedef typename R::Phdr Phdr;
+	uint64_t phoff = R::get(ehdr.e_phoff);
+	uint16_t phentsize = R::get(ehdr.e_phentsize), phnum = R::get(ehdr.e_phnum);
+	if (phentsize < sizeof(Phdr) || phoff > len || (uint64_t)phentsize * phnum > len - phoff) {
+		return;
+	}
+	for (uint16_t i = 0; i < phnum; i++) {
+		// wherever e_phoff says, so it might not be aligned
+		Phdr ph = R::template load<Phdr>(hdr + phoff + (uint64_t)i * phentsize);
+		uint32_t type = R::get(ph.p_type);
+		ElfSegment seg;
+		seg._offset = R::get(ph.p_offset);
+		seg._vaddr = R::get(ph.p_vaddr);
+		seg._filesz = R::get(ph.p_filesz);
+		if (type == PT_LOAD) {
+			ident._loads.push_back(seg);
+		} else if (type == PT_DYNAMIC) {
+			ident._dyn_offset = seg._offset;
+			ident._dyn_size = seg._filesz;
+		}
+	}
+	ident._have_phdrs = true;
+}
+
+template <typename R>
+static void parse_header(ElfIdent& ident, const unsigned char *hdr, size_t len)
+{
+	typedef typename R::Ehdr Ehdr;
+	// e_machine is the last field we need, and it's at the same offset
+	// for both classes
+	ident._type = R::get(R::template load<uint16_t>(hdr + offsetof(Ehdr, e_type)));
+	ident._machine = R::get(R::template load<uint16_t>(hdr + offsetof(Ehdr, e_machine)));
+	if (len < sizeof(Ehdr)) {
+		return;
+	}
+	Ehdr ehdr = R::template load<Ehdr>(hdr);
+	ident._shoff = R::get(ehdr.e_shoff);
+	ident._shsize = (uint64_t)R::get(ehdr.e_shentsize) * R::get(ehdr.e_shnum);
+	parse_phdrs<R>(ident, ehdr, hdr, len);
+}
+
+static void parse_ident(ElfIdent& ident, const unsigned char *hdr, ssize_t got)
+{
+	ident._kind = IDENT_UNREADABLE;
+	ident._have_phdrs = false;
+	ident._dyn_offset = ident._dyn_size = 0;
+	ident._shoff = ident._shsize = 0;
+	if (got <= 0) {
+		return;
+	}
+	if (got >= SARMAG && memcmp(hdr, ARMAG, SARMAG) == 0) {
+		ident._kind = IDENT_ARCHIVE;
+		return;
+	}
+	if (got < EI_NIDENT + 4 || memcmp(hdr, ELFMAG, SELFMAG) != 0) {
+		ident._kind = looks_like_ldscript(hdr, got) ? IDENT_LDSCRIPT : IDENT_OTHER;
+		return;
+	}
+	ident._class = hdr[EI_CLASS];
+	ident._data = hdr[EI_DATA];
+	ident._osabi = hdr[EI_OSABI];
+	if ((ident._data != ELFDATA2MSB && ident._data != ELFDATA2LSB)
+			|| (ident._class != ELFCLASS32 && ident._class != ELFCLASS64)) {
+		ident._kind = IDENT_OTHER;
+		return;
+	}
+	ident._kind = IDENT_ELF;
+	with_elf_reader(ident._class, ident._data, [&](auto reader) {
+		parse_header<decltype(reader)>(ident, hdr, got);
+	});
+}
+
+// Looks file up in the shared parse cache, for its header, and what it
+// needs if binary is given. The stat is usually free, since the file was
+// just probed for.
+static bool cache_find(const string& file, Resolver& state, ElfIdent& ident,
+		Binary *binary)
+{
+	struct stat st;
+	return state._cache != nullptr && state._vfs->stat(file, st) == 0
+		&& state._cache->find(st, ident, binary, state._strings);
+}
+
+static void cache_insert(const string& file, Resolver& state, const ElfIdent& ident,
+		const Binary *binary)
+{
+	struct stat st;
+	if (state._cache != nullptr && state._vfs->stat(file, st) == 0) {
+		state._cache->insert(st, ident, binary);
+	}
+}
+
+// if the caller already has the file open, pass it to avoid reopening it
+static ElfIdent& read_ident(const string& file, Resolver& state, VfsFile *f = nullptr)
+{
+	auto iter = state._idents.find(file);
+	if (iter != state._idents.end()) {
+		return iter->second;
+	}
+	ElfIdent& ident = state._idents[file];
+	if (cache_find(file, state, ident, nullptr)) {
+		return ident;
+	}
+
+	unsigned char hdr[IDENT_PAGE_SIZE];
+	VfsFile *opened = nullptr;
+	if (f == nullptr) {
+		if ((f = opened = state._vfs->open(file)) == nullptr) {
+			parse_ident(ident, hdr, 0);
+			return ident;
+		}
+	}
+	ssize_t got = f->read(0, hdr, sizeof(hdr));
+	delete opened;
+	parse_ident(ident, hdr, got);
+	if (got >= 0) {
+		cache_insert(file, state, ident, nullptr);
+	}
+	return ident;
+}
+
+static bool ident_compatible(const ElfIdent& parent, const ElfIdent& child)
+{
+	if (parent._kind != IDENT_ELF) {
+		// nothing to compare against, so take whatever exists
+		return true;
+	}
+	if (child._kind != IDENT_ELF) {
+		return false;
+	}
+	if (parent._class != child._class || parent._data != child._data
+			|| parent._machine != child._machine) {
+		return false;
+	}
+	// SysV objects are fine for anything (i.e. glibc mixes them with
+	// GNU ones), but otherwise the ABIs must agree
+	return parent._osabi == child._osabi
+		|| parent._osabi == ELFOSABI_SYSV
+		|| child._osabi == ELFOSABI_SYSV;
+}
+
+// The path name resolves to (interned), or name itself if it doesn't.
+static string_view resolve_symbol(string_view name, const vector<string_view>& rpaths,
+		const ElfIdent& parent, Resolver& state)
+{
+	if (name.empty() || name[0] == '/') {
+		return name;
+	}
+	for (size_t i = 0; i < rpaths.size(); i++) {
+		if (!path_exists(name, rpaths[i], state)) {
+			continue;
+		}
+		auto full_path = candidate_path(name, rpaths[i], state);
+		// like the loader, skip libraries for another class or
+		// machine (i.e. multilib) and keep looking
+		if (!ident_compatible(parent, read_ident(full_path, state))) {
+			continue;
+		}
+		return state._strings.view(full_path);
+	}
+	if (!state._soname_index) {
+		return name;
+	}
+	// no file is called that, but one might have it as its soname, as
+	// ldconfig would have put in ld.so.cache
+	auto range = state._by_soname.equal_range(name);
+	for (size_t i = 0; i < rpaths.size(); i++) {
+		string dir = state._prefix + string(rpaths[i]);
+		for (auto iter = range.first; iter != range.second; ++iter) {
+			auto indexed = state._indexed.find(iter->second);
+			if (indexed->second._dir == dir
+					&& ident_compatible(parent, read_ident(iter->second, state))) {
+				return state._strings.view(iter->second);
+			}
+		}
+	}
+	return name;
+}
+
+// the dynamic segment is tiny in practice; anything bigger is bogus
+#define MAX_DYNAMIC_SIZE (1024 * 1024)
+
+static bool vaddr_to_offset(const ElfIdent& ident, uint64_t vaddr, uint64_t& offset)
+{
+	for (auto& seg : ident._loads) {
+		if (vaddr >= seg._vaddr && vaddr - seg._vaddr < seg._filesz) {
+			offset = seg._offset + (vaddr - seg._vaddr);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Pulls DT_STRTAB/DT_STRSZ out of a raw dynamic segment, along with the
+// string offsets for what we'd otherwise get from libelf. The buffer came
+// from the allocator, so the array is aligned.
+template <typename R>
+static bool scan_dynamic(const ElfIdent& ident, const vector<unsigned char>& dyn,
+		vector<uint64_t>& needed, vector<uint64_t>& rpath, vector<uint64_t>& soname,
+		uint64_t& strtab, uint64_t& strsz)
+{
+	typedef typename R::Dyn Dyn;
+	const Dyn *dyns = (const Dyn*)dyn.data();
+	size_t count = dyn.size() / sizeof(Dyn);
+	bool have_strtab = false, have_strsz = false;
+	vector<uint64_t> runpath;
+	for (size_t i = 0; i < count; i++) {
+		int64_t tag = R::get(dyns[i].d_tag);
+		uint64_t val = R::get(dyns[i].d_un.d_val);
+		if (tag == DT_NULL) {
+			break;
+		}
+		switch (tag) {
+		case DT_NEEDED:
+			needed.push_back(val);
+			break;
+		case DT_RPATH:
+			rpath.push_back(val);
+			break;
+		case DT_RUNPATH:
+			runpath.push_back(val);
+			break;
+		case DT_SONAME:
+			soname.push_back(val);
+			break;
+		case DT_STRTAB:
+			have_strtab = vaddr_to_offset(ident, val, strtab);
+			break;
+		case DT_STRSZ:
+			strsz = val;
+			have_strsz = true;
+			break;
+		}
+	}
+	// like ld.so, DT_RPATH doesn't count when there's a DT_RUNPATH
+	if (!runpath.empty()) {
+		rpath.swap(runpath);
+	}
+	return have_strtab && have_strsz && strsz <= MAX_DYNAMIC_SIZE;
+}
+
+// A foreign endian segment is swapped into our byte order in bulk first,
+// since every field of a dynamic entry is the same size, so the walk over
+// it is the same as for a native one.
+static bool scan_dynamic_segment(const ElfIdent& ident, vector<unsigned char>& dyn,
+		vector<uint64_t>& needed, vector<uint64_t>& rpath, vector<uint64_t>& soname,
+		uint64_t& strtab, uint64_t& strsz)
+{
+	if (ident._data != ELFDATA_HOST) {
+		size_t word = ident._class == ELFCLASS64 ? 8 : 4;
+		bswap_words(dyn.data(), dyn.size() / word, word);
+	}
+	return with_elf_reader(ident._class, ELFDATA_HOST, [&](auto reader) {
+		return scan_dynamic<decltype(reader)>(ident, dyn, needed, rpath, soname,
+			strtab, strsz);
+	});
+}
+
+static bool dynstr_at(const vector<unsigned char>& dynstr, uint64_t offset, string_view& out)
+{
+	if (offset >= dynstr.size()) {
+		return false;
+	}
+	const char *start = (const char*)&dynstr[offset];
+	const char *end = (const char*)memchr(start, '\0', dynstr.size() - offset);
+	if (end == nullptr) {
+		return false;
+	}
+	out = string_view(start, end - start);
+	return true;
+}
+
+// A parsed file on the worklist, waiting for what it needs to be resolved.
+class PendingFile {
+public:
+	Binary *_binary;
+	const ElfIdent *_ident;
+	// -R entries, then the binary's own
+	vector<string_view> _rpath;
+};
+
+// Everything one library in a frontier needs from the VFS.
+class FrontierFile {
+public:
+	FrontierFile(const string& path) : _path(path), _file(nullptr),
+		_want_dynamic(false), _strtab(0), _strsz(0) {}
+
+	string _path;
+	VfsFile *_file;
+	bool _want_dynamic;
+	vector<uint64_t> _needed, _rpath, _soname;
+	uint64_t _strtab, _strsz;
+};
+
+// Reads one range per file that needs it, picked by range_of; returns false
+// from range_of to skip a file.
+template <typename F>
+static vector<VfsRange> read_for(vector<FrontierFile>& files, Resolver& state, F range_of)
+{
+	vector<VfsRange> batch;
+	vector<size_t> owners;
+	for (size_t i = 0; i < files.size(); i++) {
+		uint64_t offset, length;
+		if (files[i]._file != nullptr && range_of(files[i], offset, length)) {
+			batch.push_back(VfsRange(files[i]._file, offset, length));
+			owners.push_back(i);
+		}
+	}
+	state._vfs->read_many(batch);
+	// line the results up with the files again; skipped files get an
+	// empty range that failed
+	vector<VfsRange> results(files.size(), VfsRange(nullptr, 0, 0));
+	for (size_t i = 0; i < files.size(); i++) {
+		results[i]._result = -ENOENT;
+	}
+	for (size_t i = 0; i < batch.size(); i++) {
+		results[owners[i]] = move(batch[i]);
+	}
+	return results;
+}
+
+static void open_files(vector<FrontierFile>& files, size_t first, Resolver& state)
+{
+	vector<string> paths;
+	for (size_t i = first; i < files.size(); i++) {
+		paths.push_back(files[i]._path);
+	}
+	vector<VfsFile*> opened;
+	state._vfs->open_many(paths, opened);
+	for (size_t i = 0; i < opened.size(); i++) {
+		files[first + i]._file = opened[i];
+	}
+}
+
+// Asks for [offset, offset + length) of every open file that range_of picks
+// one for to be read in, without waiting on any of it.
+template <typename F>
+static void advise_files(vector<FrontierFile>& files, Resolver& state, F range_of)
+{
+	vector<VfsRange> hints;
+	for (auto& file : files) {
+		uint64_t ranges[4];
+		size_t count = file._file == nullptr ? 0 : range_of(file, ranges);
+		for (size_t i = 0; i < count; i++) {
+			hints.push_back(VfsRange(file._file, ranges[i * 2], ranges[i * 2 + 1]));
+		}
+	}
+	state._vfs->advise_many(hints);
+}
+
+// Warms the caches resolve_symbol and parse_file use for a whole frontier
+// (the DT_NEEDED entries of every file in a level of the worklist) at once,
+// so the VFS can have all of it in flight together: probes for every
+// candidate, then headers for whatever exists, then the dynamic segment and
+// dynstr of what we'll recurse into.
+static void prefetch_frontier(vector<PendingFile>& level, Resolver& state)
+{
+	vector<VfsLookup> probes;
+	for (auto& pending : level) {
+		for (auto& name : pending._binary->_depends) {
+			if (name.empty() || name[0] == '/') {
+				continue;
+			}
+			for (auto& rpath : pending._rpath) {
+				probes.push_back(VfsLookup(state._prefix + string(rpath), string(name)));
+			}
+		}
+	}
+	state._vfs->lookup_many(probes);
+
+	vector<FrontierFile> files;
+	set<string> seen;
+	for (auto& probe : probes) {
+		auto path = vfs_join(probe._dir, probe._name);
+		if (probe._result != 0 || !S_ISREG(probe._st.st_mode)
+				|| state._idents.count(path) || !seen.insert(path).second) {
+			continue;
+		}
+		ElfIdent cached;
+		if (cache_find(path, state, cached, nullptr)) {
+			state._idents[path] = cached;
+		} else {
+			files.push_back(FrontierFile(path));
+		}
+	}
+	open_files(files, 0, state);
+	advise_files(files, state, [](FrontierFile&, uint64_t *ranges) -> size_t {
+		ranges[0] = 0;
+		ranges[1] = IDENT_PAGE_SIZE;
+		return 1;
+	});
+	auto headers = read_for(files, state, [](FrontierFile&, uint64_t& offset, uint64_t& length) {
+		offset = 0;
+		length = IDENT_PAGE_SIZE;
+		return true;
+	});
+	for (size_t i = 0; i < files.size(); i++) {
+		ElfIdent& ident = state._idents[files[i]._path];
+		parse_ident(ident, headers[i]._buf.data(), headers[i]._result);
+		if (headers[i]._result >= 0) {
+			cache_insert(files[i]._path, state, ident, nullptr);
+		}
+	}
+
+	// with every candidate's header in hand, settle what each name
+	// resolves to, so only what we'll actually recurse into gets read
+	if (state._recurse) {
+		size_t first_new = files.size();
+		map<string, size_t> index;
+		for (size_t i = 0; i < files.size(); i++) {
+			index[files[i]._path] = i;
+		}
+		for (auto& pending : level) {
+			for (auto& name : pending._binary->_depends) {
+				if (name.empty() || name[0] == '/') {
+					continue;
+				}
+				string path(resolve_symbol(name, pending._rpath, *pending._ident, state));
+				if (path.empty() || path[0] != '/' || state._found_binaries.count(path)
+						|| state._preloaded.count(path)) {
+					continue;
+				}
+				// another process may have read it already
+				ElfIdent ident;
+				Binary *cached = new Binary();
+				if (cache_find(path, state, ident, cached)) {
+					cached->_name = path;
+					state._preloaded[path] = cached;
+					continue;
+				}
+				delete cached;
+				auto file = index.find(path);
+				if (file == index.end()) {
+					files.push_back(FrontierFile(path));
+					file = index.emplace(path, files.size() - 1).first;
+				}
+				files[file->second]._want_dynamic = true;
+			}
+		}
+		open_files(files, first_new, state);
+	}
+
+	// we know where everything we're about to recurse into keeps its
+	// dynamic segment now, so get the disk going on all of it at once;
+	// the section headers are for when libelf has to take over
+	advise_files(files, state, [&state](FrontierFile& file, uint64_t *ranges) -> size_t {
+		const ElfIdent& ident = state._idents[file._path];
+		if (!file._want_dynamic || ident._kind != IDENT_ELF) {
+			return 0;
+		}
+		size_t count = 0;
+		if (ident._shsize != 0) {
+			ranges[count * 2] = ident._shoff;
+			ranges[count++ * 2 + 1] = ident._shsize;
+		}
+		if (ident._dyn_size != 0) {
+			ranges[count * 2] = ident._dyn_offset;
+			ranges[count++ * 2 + 1] = ident._dyn_size;
+		}
+		return count;
+	});
+
+	auto dynamics = read_for(files, state, [&state](FrontierFile& file,
+			uint64_t& offset, uint64_t& length) {
+		if (!file._want_dynamic) {
+			return false;
+		}
+		const ElfIdent& ident = state._idents[file._path];
+		if (ident._kind != IDENT_ELF || !ident._have_phdrs
+				|| (ident._type != ET_EXEC && ident._type != ET_DYN)
+				|| ident._dyn_size == 0 || ident._dyn_size > MAX_DYNAMIC_SIZE) {
+			return false;
+		}
+		offset = ident._dyn_offset;
+		length = ident._dyn_size;
+		return true;
+	});
+	for (size_t i = 0; i < files.size(); i++) {
+		FrontierFile& file = files[i];
+		if (dynamics[i]._result <= 0) {
+			file._want_dynamic = false;
+			continue;
+		}
+		file._want_dynamic = scan_dynamic_segment(state._idents[file._path],
+			dynamics[i]._buf, file._needed, file._rpath, file._soname,
+			file._strtab, file._strsz);
+	}
+
+	auto dynstrs = read_for(files, state, [](FrontierFile& file,
+			uint64_t& offset, uint64_t& length) {
+		offset = file._strtab;
+		length = file._strsz;
+		return file._want_dynamic;
+	});
+	for (size_t i = 0; i < files.size(); i++) {
+		FrontierFile& file = files[i];
+		if (!file._want_dynamic || dynstrs[i]._result <= 0) {
+			continue;
+		}
+		Binary *binary = new Binary();
+		binary->_name = file._path;
+		binary->_depends.reserve(file._needed.size());
+		binary->_rpath.reserve(file._rpath.size());
+		bool ok = true;
+		string_view str;
+		for (auto offset : file._needed) {
+			ok = ok && dynstr_at(dynstrs[i]._buf, offset, str);
+			binary->_depends.push_back(state._strings.view(str));
+		}
+		for (auto offset : file._rpath) {
+			ok = ok && dynstr_at(dynstrs[i]._buf, offset, str);
+			if (!str.empty()) {
+				binary->_rpath.push_back(state._strings.view(str));
+			}
+		}
+		if (!ok) {
+			// let libelf have a go at it instead
+			delete binary;
+			continue;
+		}
+		cache_insert(file._path, state, state._idents[file._path], binary);
+		state._preloaded[file._path] = binary;
+	}
+
+	vector<VfsFile*> closes;
+	for (auto& file : files) {
+		closes.push_back(file._file);
+	}
+	state._vfs->close_many(closes);
+}
+
+// the longest soname read out of a file's dynstr
+#define MAX_SONAME_LENGTH 256
+
+// Reads DT_SONAME from every shared object in dirs that aren't in the index
+// yet, all of them together in batches like prefetch_frontier: the
+// listings and a probe of each entry, then headers we don't have, then
+// dynamic segments, then just the soname out of each dynstr.
+static void index_sonames(const vector<string>& dirs, Resolver& state)
+{
+	vector<VfsLookup> probes;
+	for (auto& dir : dirs) {
+		vector<string> names;
+		if (!state._indexed_dirs.insert(dir).second || state._vfs->list(dir, names) != 0) {
+			continue;
+		}
+		for (auto& name : names) {
+			// i.e. libz.so and libz.so.1.2.13, not libz.a
+			if (name.find(".so") != string::npos) {
+				probes.push_back(VfsLookup(dir, name));
+			}
+		}
+	}
+	state._vfs->lookup_many(probes);
+
+	vector<FrontierFile> files;
+	vector<string> file_dirs;
+	for (auto& probe : probes) {
+		if (probe._result == 0 && S_ISREG(probe._st.st_mode)) {
+			files.push_back(FrontierFile(vfs_join(probe._dir, probe._name)));
+			file_dirs.push_back(probe._dir);
+		}
+	}
+	open_files(files, 0, state);
+	auto headers = read_for(files, state, [&state](FrontierFile& file,
+			uint64_t& offset, uint64_t& length) {
+		if (state._idents.count(file._path)) {
+			return false;
+		}
+		ElfIdent cached;
+		if (cache_find(file._path, state, cached, nullptr)) {
+			state._idents[file._path] = cached;
+			return false;
+		}
+		offset = 0;
+		length = IDENT_PAGE_SIZE;
+		return true;
+	});
+	for (size_t i = 0; i < files.size(); i++) {
+		if (headers[i]._file == nullptr) {
+			continue;
+		}
+		ElfIdent& ident = state._idents[files[i]._path];
+		parse_ident(ident, headers[i]._buf.data(), headers[i]._result);
+		if (headers[i]._result >= 0) {
+			cache_insert(files[i]._path, state, ident, nullptr);
+		}
+	}
+
+	auto dynamics = read_for(files, state, [&state](FrontierFile& file,
+			uint64_t& offset, uint64_t& length) {
+		auto ident = state._idents.find(file._path);
+		if (ident == state._idents.end() || ident->second._kind != IDENT_ELF
+				|| !ident->second._have_phdrs || ident->second._type != ET_DYN
+				|| ident->second._dyn_size == 0
+				|| ident->second._dyn_size > MAX_DYNAMIC_SIZE) {
+			return false;
+		}
+		offset = ident->second._dyn_offset;
+		length = ident->second._dyn_size;
+		return true;
+	});
+	for (size_t i = 0; i < files.size(); i++) {
+		FrontierFile& file = files[i];
+		file._want_dynamic = dynamics[i]._result > 0
+			&& scan_dynamic_segment(state._idents[file._path], dynamics[i]._buf,
+				file._needed, file._rpath, file._soname, file._strtab, file._strsz);
+		// a shared object without a soname goes by its file name
+		IndexedObject& object = state._indexed[file._path];
+		object._dir = file_dirs[i];
+		object._soname.clear();
+	}
+
+	auto sonames = read_for(files, state, [](FrontierFile& file,
+			uint64_t& offset, uint64_t& length) {
+		if (!file._want_dynamic || file._soname.empty()
+				|| file._soname[0] >= file._strsz) {
+			return false;
+		}
+		offset = file._strtab + file._soname[0];
+		length = min<uint64_t>(file._strsz - file._soname[0], MAX_SONAME_LENGTH);
+		return true;
+	});
+	for (size_t i = 0; i < files.size(); i++) {
+		string_view soname;
+		if (sonames[i]._result > 0 && dynstr_at(sonames[i]._buf, 0, soname)) {
+			state._indexed[files[i]._path]._soname = soname;
+			state._by_soname.emplace(soname, files[i]._path);
+		}
+	}
+
+	vector<VfsFile*> closes;
+	for (auto& file : files) {
+		closes.push_back(file._file);
+	}
+	state._vfs->close_many(closes);
+}
+
+// Drops a directory from the index, for it to be read again.
+static void forget_sonames(const string& dir, Resolver& state)
+{
+	state._indexed_dirs.erase(dir);
+	for (auto iter = state._indexed.begin(); iter != state._indexed.end(); ) {
+		if (iter->second._dir != dir) {
+			++iter;
+			continue;
+		}
+		auto range = state._by_soname.equal_range(iter->second._soname);
+		for (auto path = range.first; path != range.second; ) {
+			path = path->second == iter->first ? state._by_soname.erase(path) : next(path);
+		}
+		iter = state._indexed.erase(iter);
+	}
+}
+
+// With the soname index, complains (once) about a DT_NEEDED entry that
+// resolved to a file with some other soname, or that didn't resolve, with
+// anything in the index that looks like it could be what was meant: the
+// same soname in a directory that isn't searched, or another version.
+static void check_soname(string_view name, string_view dep, Resolver& state)
+{
+	if (name.empty() || name[0] == '/' || !state._soname_reported.insert(string(dep)).second) {
+		return;
+	}
+	if (dep[0] == '/') {
+		auto indexed = state._indexed.find(dep);
+		if (indexed != state._indexed.end() && !indexed->second._soname.empty()
+				&& indexed->second._soname != name) {
+			cerr << dep << ": soname is " << indexed->second._soname
+				<< ", but it's needed as " << name << "\n";
+		}
+		return;
+	}
+	// libfoo.so.1 could be libfoo.so.2, or libfoo.so.1 somewhere else
+	string stem(name.substr(0, name.find(".so")));
+	stem += ".so";
+	vector<string> candidates;
+	for (auto iter = state._by_soname.lower_bound(stem); iter != state._by_soname.end()
+			&& iter->first.compare(0, stem.size(), stem) == 0; ++iter) {
+		candidates.push_back(iter->second + " (" + iter->first + ")");
+	}
+	if (candidates.empty()) {
+		return;
+	}
+	cerr << name << " not found; the soname index has";
+	for (size_t i = 0; i < candidates.size(); i++) {
+		cerr << (i == 0 ? " " : ", ") << candidates[i];
+	}
+	cerr << "\n";
+}
+
+// Lists what an archive member needs, under its name.
+static void print_member(const Binary& member, const vector<string>& undefined)
+{
+	for (auto& dep : member._depends) {
+		cout << "\t\t" << dep << "\n";
+	}
+	for (auto& sym : undefined) {
+		cout << "\t\tU " << sym << "\n";
+	}
+}
+
+#ifdef BUILTIN_ELF
+// The whole file in memory, for the built-in parser.
+static const unsigned char *map_file(VfsFile *f, size_t& size)
+{
+	size = f->size();
+	const unsigned char *data = f->map(0, size);
+	if (data == nullptr) {
+		cerr << "couldn't map file\n";
+	}
+	return data;
+}
+
+// Streams through the members of an ar archive off one mapping, printing
+// what each needs: DT_NEEDED for anything dynamic, and undefined symbols
+// for the usual relocatable objects. Members are never extracted.
+static bool scan_archive(VfsFile *f, StringTable& strings)
+{
+	size_t size;
+	const unsigned char *data = map_file(f, size);
+	if (data == nullptr) {
+		return false;
+	}
+	bool failed = false;
+	string error;
+	bool ok = ar_image_walk(data, size, [&](string_view name,
+			const unsigned char *member_data, size_t member_size) {
+		if (!elf_image_is_elf(member_data, member_size)) {
+			return;
+		}
+		cout << "\t" << name << ":\n";
+		Binary member;
+		vector<string> undefined;
+		string member_error;
+		if (!elf_image_scan(member_data, member_size, &member, strings,
+				&undefined, member_error)) {
+			cerr << name << ": " << member_error << "\n";
+			failed = true;
+			return;
+		}
+		if (!member_error.empty()) {
+			cerr << name << ": " << member_error << "\n";
+		}
+		print_member(member, undefined);
+	}, error);
+	if (!ok) {
+		cerr << error << "\n";
+	}
+	return ok && !failed;
+}
+
+// Reads DT_NEEDED and friends from the section headers; returns false if
+// the file can't be used at all, and sets failed for problems partway
+// through.
+static bool scan_sections(VfsFile *f, Binary *binary, StringTable& strings, bool& failed)
+{
+	size_t size;
+	const unsigned char *data = map_file(f, size);
+	string error;
+	if (data == nullptr) {
+		failed = true;
+		return false;
+	}
+	if (!elf_image_scan(data, size, binary, strings, nullptr, error)) {
+		cerr << error << "\n";
+		failed = true;
+	} else if (!error.empty()) {
+		cerr << binary->_name << ": " << error << "\n";
+	}
+	return true;
+}
+#else
+// libelf has already translated data to our byte order, so it's an array
+// of the class' structures as is.
+template <typename R>
+static void walk_dynamic(Elf *e, GElf_Shdr *shdr, Elf_Data *data,
+		Binary* binary, StringTable& strings)
+{
+	typedef typename R::Dyn Dyn;
+	const Dyn *dyns = (const Dyn*)data->d_buf;
+	size_t count = data->d_size / sizeof(Dyn);
+	vector<string_view> runpath;
+	bool empty = false;
+	for (size_t i = 0; i < count; i++) {
+		const char *str;
+		if (dyns[i].d_tag != DT_NEEDED && dyns[i].d_tag != DT_RPATH
+				&& dyns[i].d_tag != DT_RUNPATH) {
+			continue;
+		}
+		// an empty name can't be looked for anywhere
+		str = elf_strptr (e, shdr->sh_link, dyns[i].d_un.d_val);
+		if (str == nullptr || str[0] == '\0') {
+			empty |= str != nullptr && dyns[i].d_tag == DT_NEEDED;
+			continue;
+		}
+		auto& list = dyns[i].d_tag == DT_NEEDED ? binary->_depends
+			: dyns[i].d_tag == DT_RPATH ? binary->_rpath : runpath;
+		list.push_back(strings.view(str));
+	}
+	if (empty) {
+		cerr << binary->_name << ": empty DT_NEEDED entry, skipping it\n";
+	}
+	// like ld.so, DT_RPATH doesn't count when there's a DT_RUNPATH
+	if (!runpath.empty()) {
+		binary->_rpath.swap(runpath);
+	}
+}
+
+static bool handle_dynamic(Elf *e, Elf_Scn *scn, GElf_Shdr *shdr,
+		Binary* binary, StringTable& strings)
+{
+	size_t shstrndx;
+	if (elf_getshdrstrndx (e, &shstrndx) < 0) {
+		cerr << "elf_getshdrstrndx\n";
+		return false;
+	}
+	Elf_Data *data = elf_getdata (scn, nullptr);
+	if (data == nullptr) {
+		cerr << "elf_getdata\n";
+		return false;
+	}
+	GElf_Shdr glink_mem;
+	GElf_Shdr *glink = gelf_getshdr (elf_getscn (e, shdr->sh_link), &glink_mem);
+	if (glink == nullptr) {
+		cerr << "gelf_getshdr for glink\n";
+		return false;
+	}
+	with_elf_reader(gelf_getclass (e), ELFDATA_HOST, [&](auto reader) {
+		walk_dynamic<decltype(reader)>(e, shdr, data, binary, strings);
+	});
+	return true;
+}
+
+// As with the dynamic section, the translated data is an array as is.
+template <typename R>
+static void walk_symtab(Elf *e, GElf_Shdr *shdr, Elf_Data *data,
+		vector<string>& undefined)
+{
+	typedef typename R::Sym Sym;
+	const Sym *syms = (const Sym*)data->d_buf;
+	size_t count = data->d_size / sizeof(Sym);
+	// the first symbol is always the null one
+	for (size_t cnt = 1; cnt < count; ++cnt) {
+		if (syms[cnt].st_shndx != SHN_UNDEF || syms[cnt].st_name == 0) {
+			continue;
+		}
+		const char *name = elf_strptr (e, shdr->sh_link, syms[cnt].st_name);
+		if (name != nullptr) {
+			undefined.push_back(name);
+		}
+	}
+}
+
+static bool handle_symtab(Elf *e, Elf_Scn *scn, GElf_Shdr *shdr,
+		vector<string>& undefined)
+{
+	Elf_Data *data = elf_getdata (scn, nullptr);
+	if (data == nullptr) {
+		cerr << "elf_getdata for symtab\n";
+		return false;
+	}
+	with_elf_reader(gelf_getclass (e), ELFDATA_HOST, [&](auto reader) {
+		walk_symtab<decltype(reader)>(e, shdr, data, undefined);
+	});
+	return true;
+}
+
+static bool scan_member(Elf *e, const char *name, StringTable& strings)
+{
+	Elf_Scn *scn = nullptr;
+	Binary member;
+	vector<string> undefined;
+
+	member._name = name;
+
+	while ((scn = elf_nextscn (e, scn)) != nullptr) {
+		GElf_Shdr shdr_mem;
+		GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
+		if (shdr == nullptr) {
+			cerr << "gelf_getshdr for member\n";
+			return false;
+		}
+		if (shdr->sh_type == SHT_DYNAMIC) {
+			if (!handle_dynamic(e, scn, shdr, &member, strings)) {
+				return false;
+			}
+		} else if (shdr->sh_type == SHT_SYMTAB) {
+			if (!handle_symtab(e, scn, shdr, undefined)) {
+				return false;
+			}
+		}
+	}
+	print_member(member, undefined);
+	return true;
+}
+
+// Streams through the members of an ar archive off one mapping, printing
+// what each needs: DT_NEEDED for anything dynamic, and undefined symbols
+// for the usual relocatable objects. Members are never extracted. The
+// archive is read from fd, or from memory if fd is -1; libelf takes members
+// of an elf_memory parent out of its image and never looks at the fd.
+static bool scan_archive(Elf *ar, int fd, StringTable& strings)
+{
+	bool failed = false;
+	Elf_Cmd cmd = ELF_C_READ_MMAP;
+	Elf *member;
+
+	if (elf_kind (ar) != ELF_K_AR) {
+		cerr << "not an archive\n";
+		return false;
+	}
+	while ((member = elf_begin(fd, cmd, ar)) != nullptr) {
+		Elf_Arhdr *arhdr = elf_getarhdr(member);
+		// the symbol index and long name table show up as members
+		// too, but their names start with a slash
+		if (arhdr != nullptr && arhdr->ar_name[0] != '/'
+				&& elf_kind (member) == ELF_K_ELF) {
+			cout << "\t" << arhdr->ar_name << ":\n";
+			if (!scan_member(member, arhdr->ar_name, strings)) {
+				failed = true;
+			}
+		}
+		cmd = elf_next(member);
+		elf_end(member);
+	}
+	return !failed;
+}
+
+// Reads DT_NEEDED and friends with libelf; returns false if the file can't
+// be used at all, and sets failed for problems partway through.
+static bool scan_sections(Elf *e, Binary *binary, StringTable& strings, bool& failed)
+{
+	Elf_Scn *scn = nullptr;
+
+	if (elf_kind (e) != ELF_K_ELF) {
+		cerr << "wrong elf kind\n";
+		failed = true;
+		return false;
+	}
+
+	// prep, scan
+	while ((scn = elf_nextscn (e, scn)) != nullptr) {
+		GElf_Shdr shdr_mem;
+		GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
+		if (shdr == nullptr) {
+			cerr << "gelf_getshdr for dyn\n";
+			failed = true;
+			return false;
+		}
+
+		if (shdr->sh_type == SHT_DYNAMIC) {
+			if (!handle_dynamic(e, scn, shdr, binary, strings)) {
+				failed |= true;
+			}
+		}
+	}
+	return true;
+}
+
+// libelf on the file's descriptor if it has one, or its contents in memory
+static Elf *begin_elf(VfsFile *f, Elf_Cmd cmd)
+{
+	if (f->fd() != -1) {
+		return elf_begin(f->fd(), cmd, nullptr);
+	}
+	const unsigned char *data = f->map(0, f->size());
+	if (data == nullptr) {
+		return nullptr;
+	}
+	return elf_memory((char*)data, f->size());
+}
+
+// the same as the built-in parser's, on libelf
+static bool scan_archive(VfsFile *f, StringTable& strings)
+{
+	Elf *e = begin_elf(f, ELF_C_READ_MMAP);
+	bool ok = scan_archive(e, f->fd(), strings);
+	elf_end(e);
+	return ok;
+}
+
+static bool scan_sections(VfsFile *f, Binary *binary, StringTable& strings, bool& failed)
+{
+	Elf *e = begin_elf(f, ELF_C_READ);
+	bool ok = scan_sections(e, binary, strings, failed);
+	elf_end(e);
+	return ok;
+}
+#endif
+
+// The parse stage: what file needs and where it looks, from what
+// prefetch_frontier already read if it could, or the section headers
+// otherwise. Returns
+// nullptr if there's nothing to resolve; failed is set for any problem.
+static Binary *parse_file(const string& file, Resolver& state, const ElfIdent *&ident,
+		bool& failed)
+{
+	VfsFile *f;
+
+	Binary *binary;
+	auto preloaded = state._preloaded.find(file);
+	if (preloaded != state._preloaded.end()) {
+		// the I/O engine already read the dynamic segment for us, and
+		// it only does that for ELF files it checked the header of
+		binary = preloaded->second;
+		state._preloaded.erase(preloaded);
+		ident = &read_ident(file, state);
+		return binary;
+	}
+
+	binary = new Binary();
+	binary->_name = file;
+	ElfIdent cached;
+	if (cache_find(file, state, cached, binary)) {
+		ident = &state._idents.emplace(file, cached).first->second;
+		return binary;
+	}
+
+	if ((f = state._vfs->open(file)) == nullptr) {
+		cerr << "fd open\n";
+		delete binary;
+		failed = true;
+		return nullptr;
+	}
+	// check the first page before going through libelf, since scans can
+	// easily run into scripts, data, and linker scripts posing as a .so
+	ident = &read_ident(file, state, f);
+	if (ident->_kind == IDENT_ARCHIVE) {
+		// there's nothing to resolve, so the members are printed as
+		// we go rather than added to the graph
+		failed = !scan_archive(f, state._strings);
+		delete f;
+		delete binary;
+		return nullptr;
+	}
+	if (ident->_kind != IDENT_ELF
+			|| (ident->_type != ET_EXEC && ident->_type != ET_DYN)) {
+		switch (ident->_kind) {
+		case IDENT_UNREADABLE:
+			cerr << file << ": couldn't read header\n";
+			break;
+		case IDENT_LDSCRIPT:
+			cerr << file << ": linker script\n";
+			break;
+		case IDENT_ARCHIVE:
+		case IDENT_OTHER:
+			cerr << file << ": not an ELF file\n";
+			break;
+		case IDENT_ELF:
+			cerr << file << ": not an executable or shared object\n";
+			break;
+		}
+		delete f;
+		delete binary;
+		failed = true;
+		return nullptr;
+	}
+	if (!scan_sections(f, binary, state._strings, failed)) {
+		delete f;
+		delete binary;
+		return nullptr;
+	}
+	delete f;
+	if (!failed) {
+		cache_insert(file, state, *ident, binary);
+	}
+	return binary;
+}
+
+// What a parsed file needs resolving against: the -R entries, then its own.
+static void start_pending(PendingFile& pending, Resolver& state)
+{
+	// insert all of original rpath plus Binary's (not ideal)
+	pending._rpath.assign(state._orig_rpath.begin(), state._orig_rpath.end());
+	pending._rpath.insert(pending._rpath.end(),
+		pending._binary->_rpath.begin(), pending._binary->_rpath.end());
+}
+
+// Resolves the DT_NEEDED entries of a level of parsed files, after getting
+// them all in flight together; whatever they resolve to that's new (and
+// not already in queued) goes on discovered.
+static void resolve_level(vector<PendingFile>& level, Resolver& state,
+		set<string>& queued, vector<string>& discovered)
+{
+	// a DT_NEEDED offset pointing at a NUL (or a malformed dynstr) gives
+	// an empty name, which can't be looked for anywhere
+	for (auto& pending : level) {
+		auto& depends = pending._binary->_depends;
+		auto empty = remove(depends.begin(), depends.end(), string_view());
+		if (empty != depends.end()) {
+			cerr << pending._binary->_name << ": empty DT_NEEDED entry, skipping it\n";
+			depends.erase(empty, depends.end());
+		}
+	}
+	if (state._soname_index) {
+		vector<string> dirs;
+		for (auto& pending : level) {
+			for (auto& rpath : pending._rpath) {
+				dirs.push_back(state._prefix + string(rpath));
+			}
+		}
+		index_sonames(dirs, state);
+	}
+	// get everything this level needs in flight before resolving
+	// one by one
+	prefetch_frontier(level, state);
+
+	for (auto& pending : level) {
+		Binary *binary = pending._binary;
+		binary->_needed = binary->_depends;
+		for (auto& dep : binary->_depends) {
+			string_view name = dep;
+			dep = resolve_symbol(dep, pending._rpath, *pending._ident, state);
+			if (state._soname_index) {
+				check_soname(name, dep, state);
+			}
+			if (state._recurse) {
+				if (dep.empty() || dep[0] != '/') {
+					// we want an absolute path, not an unresolved one
+					continue;
+				}
+				if (state._found_binaries.count(dep) || !queued.insert(string(dep)).second) {
+					// no need to reprocess a binary we already have
+					continue;
+				}
+				discovered.push_back(string(dep));
+			} else if (!state._found_binaries.count(dep)) {
+				// the binaries won't get added into the list
+				// unless they're parsed, but since we're
+				// skipping that, add a skeleton
+				Binary* child = new Binary();
+				child->_name = dep;
+				state._found_binaries[child->_name] = child;
+			}
+		}
+	}
+}
+
+// Parses and resolves discovered, then whatever they need that's new, and
+// so on, a level at a time: every file discovered in one level is parsed,
+// then the whole level's DT_NEEDED entries are resolved together, and
+// whatever they resolve to that's new becomes the next level. Nothing
+// recurses, so long chains of libraries don't grow the stack. Returns false
+// if the first file in discovered had problems; the rest complain but don't
+// count.
+static bool process_files(vector<string>& discovered, Resolver& state, set<string>& queued)
+{
+	bool first_failed = false, at_first = true;
+	while (!discovered.empty()) {
+		vector<PendingFile> level;
+		for (auto& path : discovered) {
+			bool failed = false;
+			PendingFile pending;
+			pending._binary = parse_file(path, state, pending._ident, failed);
+			if (at_first) {
+				first_failed = failed;
+				at_first = false;
+			}
+			if (pending._binary == nullptr) {
+				continue;
+			}
+			// -n leaves a skeleton for what a root needs, and that
+			// might be a root itself; fill it in rather than replace it
+			auto found = state._found_binaries.find(path);
+			if (found == state._found_binaries.end()) {
+				state._found_binaries[path] = pending._binary;
+			} else {
+				*found->second = move(*pending._binary);
+				delete pending._binary;
+				pending._binary = found->second;
+			}
+			start_pending(pending, state);
+			level.push_back(move(pending));
+		}
+		discovered.clear();
+		resolve_level(level, state, queued, discovered);
+	}
+	return !first_failed;
+}
+
+// Resolves file and (unless -n) everything it needs. Returns false if file
+// itself had problems; its dependencies complain but don't count.
+static bool process_file(string& file, Resolver& state)
+{
+	vector<string> discovered(1, file);
+	// everything queued by this call, so a file that fails to parse is
+	// only tried (and complained about) once
+	set<string> queued;
+	queued.insert(file);
+	return process_files(discovered, state, queued);
+}
+
+static Binary *find_binary(string_view path, Resolver& state)
+{
+	auto iter = state._found_binaries.find(path);
+	return iter == state._found_binaries.end() ? nullptr : iter->second;
+}
+
+// Tarjan's algorithm with an explicit stack, so a long chain of libraries
+// can't run out of ours. Binaries already in a component are left alone,
+// since everything they need was resolved before them; that way this can
+// be run for each root as it's resolved, without redoing earlier ones.
+static void find_components(Binary *root, Resolver& state)
+{
+	class Frame {
+	public:
+		Binary *_binary;
+		size_t _next;
+	};
+	if (root->_component != -1) {
+		return;
+	}
+	vector<Frame> frames;
+	vector<Binary*> stack;
+	int index = 0;
+	auto visit = [&](Binary *binary) {
+		binary->_index = binary->_low = index++;
+		binary->_on_stack = true;
+		stack.push_back(binary);
+		frames.push_back({ binary, 0 });
+	};
+	visit(root);
+	while (!frames.empty()) {
+		Binary *binary = frames.back()._binary;
+		size_t& next = frames.back()._next;
+		if (next < binary->_depends.size()) {
+			Binary *dep = find_binary(binary->_depends[next++], state);
+			if (dep == nullptr || dep->_component != -1) {
+				continue;
+			} else if (dep->_index == -1) {
+				visit(dep);
+			} else if (dep->_on_stack) {
+				binary->_low = min(binary->_low, dep->_index);
+			}
+			continue;
+		}
+		frames.pop_back();
+		if (!frames.empty()) {
+			Binary *parent = frames.back()._binary;
+			parent->_low = min(parent->_low, binary->_low);
+		}
+		if (binary->_low != binary->_index) {
+			continue;
+		}
+		// binary is the first of its component to have been visited,
+		// and the rest are above it on the stack
+		int id = state._components.size();
+		Component component;
+		component._cycle = false;
+		component._reported = false;
+		Binary *member;
+		do {
+			member = stack.back();
+			stack.pop_back();
+			member->_on_stack = false;
+			member->_component = id;
+			component._members.push_back(member);
+		} while (member != binary);
+		for (auto m : component._members) {
+			for (auto& path : m->_depends) {
+				Binary *dep = find_binary(path, state);
+				if (dep == nullptr) {
+					continue;
+				} else if (dep->_component == id) {
+					component._cycle = true;
+				} else if (find(component._needs.begin(), component._needs.end(),
+						dep->_component) == component._needs.end()) {
+					component._needs.push_back(dep->_component);
+				}
+			}
+		}
+		state._components.push_back(component);
+	}
+}
+
+// every component reachable from the root's, each once
+static void gather_components(Binary* binary, Resolver& state, vector<int>& reached)
+{
+	vector<bool> seen(state._components.size(), false);
+	vector<int> work(1, binary->_component);
+	seen[binary->_component] = true;
+	while (!work.empty()) {
+		int id = work.back();
+		work.pop_back();
+		reached.push_back(id);
+		for (auto next : state._components[id]._needs) {
+			if (!seen[next]) {
+				seen[next] = true;
+				work.push_back(next);
+			}
+		}
+	}
+}
+
+// Whether path is new to a load order; a file counts as itself no matter
+// what path it was reached by (i.e. /lib and /usr/lib on a merged /usr).
+static bool first_load(string_view path, set<pair<dev_t, ino_t>>& files,
+		set<string_view>& names, Resolver& state)
+{
+	struct stat st;
+	if (!path.empty() && path[0] == '/' && state._vfs->stat(string(path), st) == 0) {
+		return files.insert(make_pair(st.st_dev, st.st_ino)).second;
+	}
+	// unresolved, so all there is to go on is the name
+	return names.insert(path).second;
+}
+
+// Like ld.so: breadth first from the root, taking each file's DT_NEEDED
+// entries in order and skipping whatever's already loaded. That's the
+// order symbols interpose in and (backwards) constructors run in. The root
+// itself comes first.
+static void walk_load_order(Binary* binary, Resolver& state, vector<string>& order)
+{
+	set<pair<dev_t, ino_t>> files;
+	set<string_view> names;
+	first_load(binary->_name, files, names, state);
+	order.push_back(binary->_name);
+	vector<Binary*> queue(1, binary);
+	for (size_t i = 0; i < queue.size(); i++) {
+		for (auto& dep : queue[i]->_depends) {
+			if (!first_load(dep, files, names, state)) {
+				continue;
+			}
+			order.push_back(string(dep));
+			Binary *next = find_binary(dep, state);
+			if (next != nullptr) {
+				queue.push_back(next);
+			}
+		}
+	}
+}
+
+// past this many, --why stops listing paths; there can be exponentially many
+#define MAX_WHY_PATHS 1000
+
+// if a DT_NEEDED entry (resolved to dep) is what --why asked about
+static bool why_matches(string_view dep, string_view needed, string_view lib)
+{
+	if (dep == lib || needed == lib) {
+		return true;
+	}
+	size_t slash = dep.rfind('/');
+	return slash != string_view::npos && dep.substr(slash + 1) == lib;
+}
+
+// Breadth first from the root, like the load order, until the first level
+// with an entry for lib; every file on the way keeps which files one level
+// up need it, which is all the shortest paths to it. They're read back out
+// from each file needing lib up to the root, with an explicit stack.
+static bool walk_why(Binary *root, string_view lib, bool all, Resolver& state,
+		vector<vector<string>>& out)
+{
+	vector<Binary*> nodes(1, root);
+	vector<size_t> depth(1, 0);
+	vector<vector<size_t>> parents(1);
+	map<Binary*, size_t> index;
+	index[root] = 0;
+	// which file needs what lib resolved to, for each entry found
+	vector<pair<size_t, string_view>> hits;
+	for (size_t i = 0; i < nodes.size(); i++) {
+		if (!hits.empty() && depth[i] > depth[hits[0].first]) {
+			break;
+		}
+		Binary *binary = nodes[i];
+		for (size_t j = 0; j < binary->_depends.size(); j++) {
+			string_view dep = binary->_depends[j];
+			string_view needed = j < binary->_needed.size() ? binary->_needed[j] : dep;
+			if (why_matches(dep, needed, lib)) {
+				if (hits.empty() || (all && hits.back() != make_pair(i, dep))) {
+					hits.push_back(make_pair(i, dep));
+				}
+				continue;
+			}
+			Binary *next = find_binary(dep, state);
+			if (next == nullptr) {
+				continue;
+			}
+			auto seen = index.find(next);
+			if (seen == index.end()) {
+				index[next] = nodes.size();
+				nodes.push_back(next);
+				depth.push_back(depth[i] + 1);
+				parents.push_back(vector<size_t>(1, i));
+			} else if (all && depth[seen->second] == depth[i] + 1
+					&& parents[seen->second].back() != i) {
+				parents[seen->second].push_back(i);
+			}
+		}
+	}
+
+	for (auto& hit : hits) {
+		// each frame is a file and which of its parents to try next
+		vector<pair<size_t, size_t>> stack(1, make_pair(hit.first, 0));
+		while (!stack.empty()) {
+			auto& top = stack.back();
+			if (top.first == 0) {
+				if (out.size() == MAX_WHY_PATHS) {
+					return false;
+				}
+				vector<string> path;
+				for (auto frame = stack.rbegin(); frame != stack.rend(); ++frame) {
+					path.push_back(nodes[frame->first]->_name);
+				}
+				path.push_back(string(hit.second));
+				out.push_back(path);
+				stack.pop_back();
+			} else if (top.second < parents[top.first].size()) {
+				size_t parent = parents[top.first][top.second++];
+				stack.push_back(make_pair(parent, 0));
+			} else {
+				stack.pop_back();
+			}
+		}
+	}
+	return true;
+}
+
+// Clears every component, for find_components to start over on a graph
+// that's changed under it.
+static void reset_components(Resolver& state)
+{
+	state._components.clear();
+	for (auto iter = state._found_binaries.begin(); iter != state._found_binaries.end(); ++iter) {
+		Binary *binary = iter->second;
+		binary->_component = binary->_index = binary->_low = -1;
+		binary->_on_stack = false;
+	}
+}
+
+static bool same_time(const struct timespec& a, const struct timespec& b)
+{
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool within_any(const string& path, const vector<string>& dirs)
+{
+	for (auto& dir : dirs) {
+		if (vfs_within(path, dir)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether path is another file, or the same one changed, since the VFS
+// last looked; it's forgotten either way.
+static bool restat_changed(const string& path, Resolver& state)
+{
+	struct stat before, after;
+	int had = state._vfs->stat(path, before);
+	state._vfs->forget(path);
+	int has = state._vfs->stat(path, after);
+	if (had != 0 || has != 0) {
+		return had != has;
+	}
+	return before.st_dev != after.st_dev || before.st_ino != after.st_ino
+		|| before.st_size != after.st_size
+		|| !same_time(before.st_mtim, after.st_mtim)
+		|| !same_time(before.st_ctim, after.st_ctim);
+}
+
+Resolver::Resolver()
+{
+	_prefix = "";
+	_recurse = true;
+	_soname_index = false;
+
+	_io = nullptr;
+	_owns_io = false;
+	_io_name = "auto";
+	_timeout_ms = 0;
+	_vfs = nullptr;
+	_cache = nullptr;
+}
+
+Resolver::~Resolver()
+{
+	for (auto iter = _found_binaries.begin(); iter != _found_binaries.end(); ++iter) {
+		delete iter->second;
+	}
+	for (auto iter = _preloaded.begin(); iter != _preloaded.end(); ++iter) {
+		delete iter->second;
+	}
+	delete _cache;
+	delete _vfs;
+	if (_owns_io) {
+		delete _io;
+	}
+}
+
+// Sets up where files come from, per -A and -P.
+bool Resolver::open(string& error)
+{
+	if (_io == nullptr) {
+		if ((_io = make_io_engine(_io_name, _timeout_ms)) == nullptr) {
+			error = _timeout_ms != 0 ? "only the threads I/O engine can time out"
+				: "unknown I/O engine " + _io_name;
+			return false;
+		}
+		_owns_io = true;
+	}
+#ifndef BUILTIN_ELF
+	elf_version (EV_CURRENT);
+#endif
+
+	if (!_archive_path.empty()) {
+		ArchiveFs *archive = new ArchiveFs();
+		if (!archive->load(_archive_path, error)) {
+			error = _archive_path + ": " + error;
+			delete archive;
+			return false;
+		}
+		_vfs = new CachingVfs(archive);
+	} else if (_layers.size() > 1) {
+		OverlayVfs *overlay = new OverlayVfs(_layers, _io);
+		if (!overlay->load(error)) {
+			delete overlay;
+			return false;
+		}
+		_vfs = new CachingVfs(overlay);
+	} else {
+		_vfs = new CachingVfs(new HostVfs(_prefix, _io));
+	}
+
+	if (!_cache_path.empty()) {
+		// only the host has inodes that mean the same thing to every
+		// process looking at them
+		if (!_archive_path.empty() || _layers.size() > 1) {
+			error = "the parse cache only works with the host's files";
+			return false;
+		}
+		_cache = new ParseCache();
+		if (!_cache->open(_cache_path, error)) {
+			error = _cache_path + ": " + error;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Resolver::resolve(const string& path)
+{
+	string file = path;
+	bool ok = process_file(file, *this);
+	Binary *binary = find(path);
+	if (binary != nullptr) {
+		find_components(binary, *this);
+	}
+	return ok;
+}
+
+Binary *Resolver::find(string_view path)
+{
+	return find_binary(path, *this);
+}
+
+bool Resolver::edges(const string& path, vector<pair<string, string>>& out)
+{
+	Binary *binary = find(path);
+	if (binary == nullptr) {
+		return false;
+	}
+	out.clear();
+	for (size_t i = 0; i < binary->_depends.size() && i < binary->_needed.size(); i++) {
+		out.push_back(make_pair(string(binary->_needed[i]), string(binary->_depends[i])));
+	}
+	return true;
+}
+
+void Resolver::components(Binary *root, vector<int>& reached)
+{
+	find_components(root, *this);
+	gather_components(root, *this, reached);
+}
+
+void Resolver::closure(const string& root, vector<string>& out)
+{
+	out.clear();
+	Binary *binary = find(root);
+	if (binary == nullptr) {
+		return;
+	}
+	vector<int> reached;
+	components(binary, reached);
+	set<string_view> all_deps;
+	for (auto id : reached) {
+		for (auto member : _components[id]._members) {
+			all_deps.insert(member->_depends.begin(), member->_depends.end());
+		}
+	}
+	out.assign(all_deps.begin(), all_deps.end());
+}
+
+bool Resolver::why(const string& root, string_view lib, bool all,
+		vector<vector<string>>& out)
+{
+	out.clear();
+	Binary *binary = find(root);
+	return binary == nullptr || walk_why(binary, lib, all, *this, out);
+}
+
+void Resolver::load_order(const string& root, vector<string>& out)
+{
+	out.clear();
+	Binary *binary = find(root);
+	if (binary != nullptr) {
+		walk_load_order(binary, *this, out);
+	}
+}
+
+void Resolver::refresh(const vector<string>& changed, vector<string>& reparsed)
+{
+	reparsed.clear();
+	set<string> paths, dirs, names;
+	string dir, name;
+	for (auto& path : changed) {
+		_vfs->forget(path);
+		paths.insert(path);
+		_soname_reported.erase(path);
+		if (vfs_split(path, dir, name)) {
+			dirs.insert(dir);
+			names.insert(name);
+			_soname_reported.erase(name);
+		}
+	}
+	// a changed directory is read into the soname index again next time
+	// it's searched; it might be spelled another way than the path is
+	vector<string> reindex;
+	for (auto& indexed : _indexed_dirs) {
+		for (auto& path : changed) {
+			if (vfs_split(path, dir, name) && vfs_join(indexed, name) == path) {
+				reindex.push_back(indexed);
+				break;
+			}
+		}
+	}
+	for (auto& indexed : reindex) {
+		forget_sonames(indexed, *this);
+	}
+	// a library found by a symlink (i.e. libz.so.1) changes when what it
+	// points to does, which only shows in its stat; sonames point within
+	// the same directory, so that's all that gets looked at again. A
+	// directory that changed (i.e. was removed and made again) takes
+	// everything in it along.
+	for (auto iter = _found_binaries.begin(); iter != _found_binaries.end(); ++iter) {
+		if (paths.count(iter->first)) {
+			continue;
+		}
+		if (within_any(iter->first, changed)
+				|| (vfs_split(iter->first, dir, name) && dirs.count(dir)
+					&& restat_changed(iter->first, *this))) {
+			paths.insert(iter->first);
+		}
+	}
+
+	// whatever's known about a changed file goes, and the ones that were
+	// parsed are parsed again if they're still there
+	vector<string> discovered;
+	set<string> queued;
+	for (auto& path : paths) {
+		_idents.erase(path);
+		auto preloaded = _preloaded.find(path);
+		if (preloaded != _preloaded.end()) {
+			delete preloaded->second;
+			_preloaded.erase(preloaded);
+		}
+		auto found = _found_binaries.find(path);
+		if (found == _found_binaries.end()) {
+			continue;
+		}
+		delete found->second;
+		_found_binaries.erase(found);
+		struct stat st;
+		if (_vfs->stat(path, st) == 0) {
+			discovered.push_back(path);
+			queued.insert(path);
+		}
+	}
+	reparsed = discovered;
+
+	// anything that needs one of the names (or found one of the paths)
+	// might resolve it somewhere else now, but doesn't need parsing again
+	vector<PendingFile> level;
+	for (auto iter = _found_binaries.begin(); iter != _found_binaries.end(); ++iter) {
+		Binary *binary = iter->second;
+		PendingFile pending;
+		pending._binary = binary;
+		start_pending(pending, *this);
+		bool stale = false;
+		for (size_t i = 0; !stale && i < binary->_needed.size(); i++) {
+			stale = names.count(string(binary->_needed[i]))
+				|| paths.count(string(binary->_depends[i]));
+		}
+		// or a directory it searches came or went
+		for (size_t i = 0; !stale && i < pending._rpath.size(); i++) {
+			stale = within_any(_prefix + string(pending._rpath[i]), changed);
+		}
+		if (!stale) {
+			continue;
+		}
+		binary->_depends = binary->_needed;
+		pending._ident = &read_ident(iter->first, *this);
+		level.push_back(move(pending));
+	}
+	resolve_level(level, *this, queued, discovered);
+	process_files(discovered, *this, queued);
+	reset_components(*this);
+}
+
+void Resolver::search_dirs(vector<string>& out)
+{
+	set<string> dirs;
+	for (auto& rpath : _orig_rpath) {
+		dirs.insert(_prefix + rpath);
+	}
+	string dir, name;
+	for (auto iter = _found_binaries.begin(); iter != _found_binaries.end(); ++iter) {
+		for (auto& rpath : iter->second->_rpath) {
+			dirs.insert(_prefix + string(rpath));
+		}
+		if (iter->first[0] != '/') {
+			// a relative path given on the command line
+			dirs.insert(vfs_split(iter->first, dir, name) ? dir : "");
+		} else if (vfs_split(iter->first, dir, name)) {
+			dirs.insert(dir);
+		}
+	}
+	out.assign(dirs.begin(), dirs.end());
+}
@@ -0,0 +1,194 @@
+/*
+ * xpldd: resolving ELF dependencies, for the command line or in process
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_RESOLVER_H
+#define XPLDD_RESOLVER_H
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "stringtable.h"
+
+extern "C" {
+	#include <stdint.h>
+}
+
+class IoEngine;
+class ParseCache;
+class Vfs;
+
+// The names and paths are views of strings interned in the Resolver's
+// _strings, so they're only valid as long as it is, and parsing a library
+// doesn't copy any of them out of its .dynstr.
+class Binary {
+public:
+	std::string _name;
+	std::vector<std::string_view> _depends;
+	// DT_NEEDED as written, before _depends has them resolved
+	std::vector<std::string_view> _needed;
+	std::vector<std::string_view> _rpath;
+	//std::string _interp;
+	bool _resolved;
+	// which Component it's in, or -1 before find_components sees it;
+	// the rest is scratch for Tarjan's algorithm
+	int _component = -1;
+	int _index = -1, _low = -1;
+	bool _on_stack = false;
+};
+
+// Binaries that all (transitively) need each other, or just one on its own.
+// With those collapsed, what's left of the graph has no cycles.
+class Component {
+public:
+	std::vector<Binary*> _members;
+	// more than one member, or one that needs itself
+	bool _cycle;
+	// other components the members need
+	std::vector<int> _needs;
+	// the cycle has been reported already
+	bool _reported;
+};
+
+enum IdentKind {
+	IDENT_UNREADABLE,
+	IDENT_ELF,
+	IDENT_LDSCRIPT,
+	IDENT_ARCHIVE,
+	IDENT_OTHER,
+};
+
+class ElfSegment {
+public:
+	uint64_t _vaddr, _offset, _filesz;
+};
+
+// The parts of the ELF header that decide if the loader will take a library
+// for a given binary; read from the first page of the file. If the program
+// headers fit in that page too, where the dynamic segment lives is kept so
+// it can be read without libelf.
+class ElfIdent {
+public:
+	IdentKind _kind;
+	unsigned char _class, _data, _osabi;
+	uint16_t _type, _machine;
+	bool _have_phdrs;
+	uint64_t _dyn_offset, _dyn_size;
+	// the section header table, which libelf reads first
+	uint64_t _shoff, _shsize;
+	std::vector<ElfSegment> _loads;
+};
+
+// A shared object found in a search directory by the soname index.
+class IndexedObject {
+public:
+	std::string _dir, _soname;
+};
+
+// Everything resolution knows: how it was asked to look, where files come
+// from, and every file resolved so far. Keep one around to resolve more
+// roots, and whatever earlier ones already found (the libraries, their
+// headers, and every probe of a search directory) is reused.
+//
+// Set the configuration, then open() it, then resolve() roots and look at
+// what they need. Problems with files are complained about on stderr as
+// they're found, like the xpldd command does.
+class Resolver {
+	// who needs getters and setters?
+public:
+	Resolver();
+	virtual ~Resolver();
+	Resolver(const Resolver&) = delete;
+	Resolver& operator=(const Resolver&) = delete;
+
+	// sets up the I/O engine (unless one was given) and where files come
+	// from; returns false and sets error if it can't
+	bool open(std::string& error);
+	// resolves path and (unless _recurse is off) everything it needs;
+	// returns false if path itself had problems
+	bool resolve(const std::string& path);
+
+	// the file resolved at path, or nullptr if it wasn't
+	Binary *find(std::string_view path);
+	// each DT_NEEDED entry of path, and what it resolved to (itself if it
+	// didn't); returns false if path wasn't resolved
+	bool edges(const std::string& path,
+		std::vector<std::pair<std::string, std::string>>& out);
+	// everything path's closure needs, resolved or not, sorted
+	void closure(const std::string& root, std::vector<std::string>& out);
+	// path's closure in the order ld.so would load it, the root first
+	void load_order(const std::string& root, std::vector<std::string>& out);
+	// the components reachable from root's, each once
+	void components(Binary *root, std::vector<int>& reached);
+	// the shortest chains of DT_NEEDED entries from root to lib (a path,
+	// a DT_NEEDED name, or a file name), each the root, then the files in
+	// between, then what lib resolved to; just the first one found (in
+	// load order) unless all is set. Returns false if there were more
+	// than it would list.
+	bool why(const std::string& root, std::string_view lib, bool all,
+		std::vector<std::vector<std::string>>& out);
+
+	// Brings what's been resolved up to date after the files at changed
+	// were added, removed, or rewritten. Those that had been parsed are
+	// parsed again (reparsed lists them), and anything needing one of
+	// their names is resolved again, since it might be found somewhere
+	// else now; nothing else is read. Only for resolving with _recurse.
+	void refresh(const std::vector<std::string>& changed,
+		std::vector<std::string>& reparsed);
+	// every directory resolution looked in: the search path of each file,
+	// and where each file was found ("" for the current one)
+	void search_dirs(std::vector<std::string>& out);
+
+	// configuration; -P gives the prefix, or the layers if more than one
+	std::string _prefix;
+	// every -P given; more than one stacks them like overlayfs, and
+	// paths are in the merged view rather than prefixed
+	std::vector<std::string> _layers;
+	std::vector<std::string> _orig_rpath;
+	bool _recurse;
+	// reads DT_SONAME from every shared object in each search directory,
+	// to find names no file is called by (like ld.so.cache does), and to
+	// point out sonames that don't match and likely candidates for names
+	// that don't resolve
+	bool _soname_index;
+	std::string _io_name;
+	// if set, how long (in milliseconds) to wait on any one file operation
+	// before giving up on it, and on the search directory it was in
+	unsigned _timeout_ms;
+	// can be shared between resolvers; freed with this one if it made it
+	// or _owns_io is set
+	IoEngine *_io;
+	bool _owns_io;
+	// with -A, a tar or cpio archive stands in for the filesystem
+	// entirely, and paths are looked up inside of it
+	std::string _archive_path;
+	// where every file comes from, host or archive; it caches lookups
+	Vfs *_vfs;
+	// if set, parses are shared through this file with every other
+	// resolver using it, in this process or others (host files only)
+	std::string _cache_path;
+	ParseCache *_cache;
+	// stuff we track; every name and path Binaries refer to is in here
+	StringTable _strings;
+	std::map<std::string, Binary*, std::less<>> _found_binaries;
+	std::map<std::string, ElfIdent> _idents;
+	// dynamic segments the I/O engine read ahead of process_file
+	std::map<std::string, Binary*> _preloaded;
+	// every component so far; one only needs ones numbered before it
+	std::vector<Component> _components;
+	// with _soname_index, the directories read so far, every shared
+	// object in them by path, and their paths by soname
+	std::set<std::string> _indexed_dirs;
+	std::map<std::string, IndexedObject, std::less<>> _indexed;
+	std::multimap<std::string, std::string, std::less<>> _by_soname;
+	// names and paths already complained about
+	std::set<std::string, std::less<>> _soname_reported;
+};
+
+#endif
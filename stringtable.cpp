@@ -0,0 +1,20 @@
+/*
+ * xpldd: interned strings, so each name and path is kept once
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include "stringtable.h"
+
+using namespace std;
+
+uint32_t StringTable::intern(string_view s)
+{
+	auto iter = _ids.find(s);
+	if (iter != _ids.end()) {
+		return iter->second;
+	}
+	uint32_t id = _strings.size();
+	_strings.emplace_back(s);
+	_ids[_strings.back()] = id;
+	return id;
+}
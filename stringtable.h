@@ -0,0 +1,34 @@
+/*
+ * xpldd: interned strings, so each name and path is kept once
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_STRINGTABLE_H
+#define XPLDD_STRINGTABLE_H
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+extern "C" {
+	#include <stdint.h>
+}
+
+// Every string goes in once and gets an id; asking for one that's already
+// in allocates nothing. Views of them stay valid for as long as the table
+// does, so they can be handed out in place of copies.
+class StringTable {
+public:
+	uint32_t intern(std::string_view s);
+	// the interned copy of s
+	std::string_view view(std::string_view s) { return str(intern(s)); }
+	const std::string& str(uint32_t id) const { return _strings[id]; }
+
+private:
+	// a deque so the views used as keys stay put
+	std::deque<std::string> _strings;
+	std::unordered_map<std::string_view, uint32_t> _ids;
+};
+
+#endif
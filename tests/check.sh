@@ -0,0 +1,787 @@
+#!/bin/sh
+#
+# xpldd: checks for make check, against small sysroots built on the spot
+#
+# Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+#
+# The fixtures are linked without libc, so all they need is a C++ compiler
+# that can make ELF shared objects. The sysroot has a program needing
+# liba.so.1, which needs libb.so.1, all finding each other through a
+# DT_RPATH of /lib. Files for other machines (or that aren't quite ELF) are
+# written by mkelf.
+
+XPLDD=${XPLDD:-$(pwd)/xpldd}
+EMBED=${EMBED:-$(pwd)/tests/embed}
+CXX=${CXX:-c++}
+SRCDIR=${srcdir:-.}
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+SR=$T/sr
+TAB=$(printf '\t')
+failed=0
+
+fail()
+{
+	echo "FAIL: $1"
+	failed=$((failed + 1))
+}
+
+# name, expected, actual
+check()
+{
+	if [ "$2" = "$3" ]; then
+		echo "ok: $1"
+	else
+		fail "$1"
+		printf 'expected:\n%s\ngot:\n%s\n' "$2" "$3"
+	fi
+}
+
+# what a listing looks like: the root, then each line indented once
+listing()
+{
+	printf '%s:' "$1"
+	shift
+	printf '\n\t%s' "$@"
+}
+
+link()
+{
+	"$CXX" -nostdlib -fPIC -Wl,--no-as-needed \
+		-Wl,-rpath,/lib -Wl,--disable-new-dtags "$@"
+}
+
+make_sysroot()
+{
+	mkdir -p "$1/bin" "$1/lib"
+	link -Wl,-rpath-link,"$1/lib" -shared -Wl,-soname,libb.so.1 -o "$1/lib/libb.so.1" "$T/b.cpp"
+	link -Wl,-rpath-link,"$1/lib" -shared -Wl,-soname,liba.so.1 -o "$1/lib/liba.so.1" "$T/a.cpp" "$1/lib/libb.so.1"
+	link -Wl,-rpath-link,"$1/lib" -Wl,-e,main -o "$1/bin/prog" "$T/prog.cpp" "$1/lib/liba.so.1"
+}
+
+mkelf()
+{
+	"$T/mkelf" "$@"
+}
+
+# overwrites the bytes at an offset in a file: file, offset, printf format
+poke()
+{
+	printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc 2>/dev/null
+}
+
+pad()
+{
+	i=0
+	while [ $i -lt "$1" ]; do
+		printf '\0'
+		i=$((i + 1))
+	done
+}
+
+# one newc entry: name, mode (decimal), file to take the contents from
+cpio_entry()
+{
+	size=0
+	if [ -n "$3" ]; then
+		size=$(wc -c < "$3")
+	fi
+	ino=$((ino + 1))
+	namesize=$((${#1} + 1))
+	printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+		$ino "$2" 0 0 1 0 "$size" 0 0 0 0 $namesize 0
+	printf '%s\0' "$1"
+	pad $(((4 - (110 + namesize) % 4) % 4))
+	if [ -n "$3" ]; then
+		cat "$3"
+	fi
+	pad $(((4 - size % 4) % 4))
+}
+
+# there's no telling if cpio(1) is around, so the archive is written here;
+# liba.so.1 is a symlink to the real file, like a linker would leave it
+make_cpio()
+{
+	ino=0
+	printf 'liba.so.1.0' > "$T/cpio-link"
+	for dir in bin lib; do
+		cpio_entry $dir 16877
+	done
+	cpio_entry bin/prog 33188 "$1/bin/prog"
+	cpio_entry lib/liba.so.1.0 33188 "$1/lib/liba.so.1"
+	cpio_entry lib/liba.so.1 41471 "$T/cpio-link"
+	cpio_entry lib/libb.so.1 33188 "$1/lib/libb.so.1"
+	cpio_entry TRAILER!!! 0
+}
+
+echo 'extern "C" int a(void) { return 1; }' > "$T/a.cpp"
+echo 'extern "C" int b(void) { return 2; }' > "$T/b.cpp"
+echo 'extern "C" int a(void); extern "C" int main(void) { return a(); }' > "$T/prog.cpp"
+if ! make_sysroot "$SR" || ! "$CXX" -o "$T/mkelf" "$SRCDIR/tests/mkelf.cpp"; then
+	echo "couldn't build the fixtures with $CXX"
+	exit 77
+fi
+LIBA=$SR/lib/liba.so.1
+LIBB=$SR/lib/libb.so.1
+
+# the class, byte order, and machine we're building for, for mkelf
+set -- $(od -An -tu1 -j4 -N2 "$SR/bin/prog") $(od -An -tu1 -j18 -N2 "$SR/bin/prog")
+CLASS=$1
+DATA=$2
+if [ "$DATA" -eq 2 ]; then
+	MACHINE=$(($3 * 256 + $4))
+else
+	MACHINE=$(($4 * 256 + $3))
+fi
+
+# listing
+check "flat" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" \
+	"$("$XPLDD" -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+check "tree" "$(printf '%s:\n\t%s\n\t\t%s' "$SR/bin/prog" "$LIBA" "$LIBB")" \
+	"$("$XPLDD" -t -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+check "no recursion" "$(listing "$SR/bin/prog" "$LIBA")" \
+	"$("$XPLDD" -n -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+check "-R" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" \
+	"$("$XPLDD" -R "$SR/lib" "$SR/bin/prog" 2>/dev/null)"
+mkdir -p "$T/missing/lib"
+cp "$LIBA" "$T/missing/lib/"
+check "unresolved" "$(listing "$SR/bin/prog" "$T/missing/lib/liba.so.1" libb.so.1)" \
+	"$("$XPLDD" -P "$T/missing" "$SR/bin/prog" 2>/dev/null)"
+
+# candidates for another class or machine are passed over for the next one
+mkdir -p "$SR/wrongclass" "$SR/wrongmachine"
+mkelf -c $((3 - CLASS)) -d "$DATA" -m "$MACHINE" "$SR/wrongclass/liba.so.1"
+mkelf -c "$CLASS" -d "$DATA" -m $((MACHINE + 1)) "$SR/wrongmachine/liba.so.1"
+check "wrong class and machine skipped" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" \
+	"$("$XPLDD" -P "$SR" -R /wrongclass -R /wrongmachine "$SR/bin/prog" 2>/dev/null)"
+mkdir -p "$T/wrong/lib"
+cp "$SR/wrongclass/liba.so.1" "$T/wrong/lib/"
+check "only a wrong class" "$(listing "$SR/bin/prog" liba.so.1)" \
+	"$("$XPLDD" -P "$T/wrong" "$SR/bin/prog" 2>/dev/null)"
+
+# anything that isn't an executable or shared object is turned away on its
+# header, before libelf sees it
+mkdir -p "$T/bad"
+printf 'GROUP ( libc.so.6 )\n' > "$T/bad/libc.so"
+printf 'hello\n' > "$T/bad/text"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -t 1 "$T/bad/object.o"
+mkelf -c 7 -d "$DATA" -m "$MACHINE" "$T/bad/class.so"
+mkelf -c "$CLASS" -d 7 -m "$MACHINE" "$T/bad/data.so"
+for bad in "libc.so: linker script" "text: not an ELF file" \
+		"object.o: not an executable or shared object" \
+		"class.so: not an ELF file" "data.so: not an ELF file"; do
+	check "header of ${bad%%:*}" "$T/bad/$bad" \
+		"$("$XPLDD" "$T/bad/${bad%%:*}" 2>&1 >/dev/null | head -n 1)"
+done
+"$XPLDD" "$T/bad/text" > /dev/null 2>&1
+check "nothing resolved" 3 $?
+mkdir -p "$SR/ldscript"
+cp "$T/bad/libc.so" "$SR/ldscript/liba.so.1"
+check "linker script skipped" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" \
+	"$("$XPLDD" -P "$SR" -R /ldscript "$SR/bin/prog" 2>/dev/null)"
+
+# every I/O engine gets the same answers; uring falls back to threads if the
+# kernel won't have it
+for engine in sync threads uring auto; do
+	check "-I $engine" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" \
+		"$("$XPLDD" -I $engine -P "$SR" -R /wrongclass "$SR/bin/prog" 2>/dev/null)"
+done
+"$XPLDD" -I bogus "$SR/bin/prog" > /dev/null 2>&1
+check "unknown engine" 1 $?
+
+# symlinks under -P are followed inside the prefix, like in a chroot, even
+# when they're absolute or climb out of it with ..
+mkdir -p "$T/links/bin" "$T/links/lib" "$T/links/real"
+cp "$SR/bin/prog" "$T/links/bin/"
+cp "$LIBA" "$LIBB" "$T/links/real/"
+ln -s /real/liba.so.1 "$T/links/lib/liba.so.1"
+ln -s ../../../../../../../../../../real/libb.so.1 "$T/links/lib/libb.so.1"
+mkdir -p "$T/escape/bin" "$T/escape/lib"
+cp "$SR/bin/prog" "$T/escape/bin/"
+ln -s "$LIBA" "$T/escape/lib/liba.so.1"
+for engine in sync uring; do
+	check "symlinks in the prefix ($engine)" \
+		"$(listing "$T/links/bin/prog" "$T/links/lib/liba.so.1" "$T/links/lib/libb.so.1")" \
+		"$("$XPLDD" -I $engine -P "$T/links" "$T/links/bin/prog" 2>/dev/null)"
+	check "symlink out of the prefix ($engine)" "$(listing "$T/escape/bin/prog" liba.so.1)" \
+		"$("$XPLDD" -I $engine -P "$T/escape" "$T/escape/bin/prog" 2>/dev/null)"
+done
+
+# static archives list what each member needs, without being extracted
+mkdir -p "$T/ar"
+"$CXX" -c -fPIC -o "$T/ar/needs_b_with_a_long_name.o" -x c++ - <<'END'
+extern "C" int b(void);
+extern "C" int needs_b(void) { return b(); }
+END
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -n libz.so.1 "$T/ar/dep.so"
+printf 'not an object\n' > "$T/ar/notes.txt"
+(cd "$T/ar" && ar rc libneeds.a needs_b_with_a_long_name.o notes.txt dep.so)
+check "static archive" \
+	"$(printf '%s:\n\t%s:\n\t\tU b\n\tdep.so:\n\t\tlibz.so.1' "$T/ar/libneeds.a" needs_b_with_a_long_name.o)" \
+	"$("$XPLDD" "$T/ar/libneeds.a" 2>/dev/null)"
+"$XPLDD" "$T/ar/libneeds.a" > /dev/null 2>&1
+check "static archive status" 0 $?
+# and one in a sysroot archive is read out of memory rather than its own fd
+if (cd "$T/ar" && tar -cf "$T/ar.tar" libneeds.a) 2>/dev/null; then
+	check "static archive in memory" \
+		"$(printf '%s:\n\t%s:\n\t\tU b\n\tdep.so:\n\t\tlibz.so.1' /libneeds.a needs_b_with_a_long_name.o)" \
+		"$("$XPLDD" -A "$T/ar.tar" /libneeds.a 2>/dev/null)"
+else
+	echo "skipped: static archive in memory"
+fi
+
+# a sysroot can be a tar or cpio archive; paths are relative to its top.
+# the tree has an absolute symlink, a hard link, and a path too long for a
+# plain tar header, so GNU and pax both need their extension headers
+LONG=long-$(printf '%0120d' 0)
+mkdir -p "$T/arch/bin" "$T/arch/lib" "$T/arch/$LONG"
+cp "$SR/bin/prog" "$T/arch/bin/"
+cp "$LIBA" "$T/arch/lib/liba.so.1.0"
+ln -s /lib/liba.so.1.0 "$T/arch/lib/liba.so.1"
+cp "$LIBB" "$T/arch/$LONG/"
+ln "$T/arch/$LONG/libb.so.1" "$T/arch/lib/libb.so.1"
+for format in gnu pax; do
+	if ! (cd "$T/arch" && tar --format=$format -cf "$T/$format.tar" bin lib "$LONG") 2>/dev/null; then
+		echo "skipped: tar ($format)"
+		continue
+	fi
+	check "tar ($format)" "$(listing /bin/prog /lib/liba.so.1 /lib/libb.so.1)" \
+		"$("$XPLDD" -A "$T/$format.tar" /bin/prog 2>/dev/null)"
+	check "tar long name ($format)" "$(listing /bin/prog /lib/liba.so.1 "/$LONG/libb.so.1")" \
+		"$("$XPLDD" -A "$T/$format.tar" -R "/$LONG" /bin/prog 2>/dev/null)"
+done
+make_cpio "$SR" > "$T/sr.cpio"
+check "cpio" "$(listing /bin/prog /lib/liba.so.1 /lib/libb.so.1)" \
+	"$("$XPLDD" -A "$T/sr.cpio" /bin/prog 2>/dev/null)"
+if gzip -c "$T/sr.cpio" > "$T/sr.cpio.gz" 2>/dev/null && \
+		! "$XPLDD" -A "$T/sr.cpio.gz" /bin/prog 2>&1 | grep -q "not built in"; then
+	check "gzip" "$(listing /bin/prog /lib/liba.so.1 /lib/libb.so.1)" \
+		"$("$XPLDD" -A "$T/sr.cpio.gz" /bin/prog 2>/dev/null)"
+else
+	echo "skipped: gzip"
+fi
+# a megabyte of zeros ahead of the sysroot squeezes down to next to nothing,
+# so zstd has far more output to give than input left to read
+head -c 1048576 /dev/zero > "$T/zeros"
+{ ino=0; cpio_entry zeros 33188 "$T/zeros"; make_cpio "$SR"; } > "$T/zeros.cpio"
+if zstd -q -c "$T/zeros.cpio" > "$T/zeros.cpio.zst" 2>/dev/null && \
+		! "$XPLDD" -A "$T/zeros.cpio.zst" /bin/prog 2>&1 | grep -q "not built in"; then
+	check "zstd" "$(listing /bin/prog /lib/liba.so.1 /lib/libb.so.1)" \
+		"$("$XPLDD" -A "$T/zeros.cpio.zst" /bin/prog 2>/dev/null)"
+	head -c $(($(wc -c < "$T/zeros.cpio.zst") - 8)) "$T/zeros.cpio.zst" > "$T/short.cpio.zst"
+	"$XPLDD" -A "$T/short.cpio.zst" /bin/prog > /dev/null 2>&1
+	check "truncated zstd" 1 $?
+else
+	echo "skipped: zstd"
+fi
+head -c 700 "$T/sr.cpio" > "$T/short.cpio"
+"$XPLDD" -A "$T/short.cpio" /bin/prog > /dev/null 2>&1
+check "truncated archive" 1 $?
+# a pax header claiming to be 8GiB is turned down, not buffered
+{
+	printf 'PaxHeader'
+	pad 91
+	printf '%s\0' 0000644 0000000 0000000 77777777777 00000000000
+	printf '        x'
+	pad 100
+	printf '%s\0' ustar
+	printf 00
+	pad 247
+} > "$T/huge.tar"
+sum=$(od -An -v -tu1 "$T/huge.tar" | awk '{ for (i = 1; i <= NF; i++) s += $i } END { print s }')
+poke "$T/huge.tar" 148 "$(printf '%06o' "$sum")\\0 "
+check "huge tar extension header" "$T/huge.tar: tar extension header too big" \
+	"$("$XPLDD" -A "$T/huge.tar" /bin/prog 2>&1)"
+
+# host directories and archives behave the same behind the VFS, including
+# for search directories that are missing or aren't directories at all
+for root in "-P $SR" "-A $T/sr.cpio"; do
+	prefix=${root#-P }
+	[ "$prefix" = "$root" ] && prefix=
+	check "odd search directories (${root%% *})" \
+		"$(listing "$prefix/bin/prog" "$prefix/lib/liba.so.1" "$prefix/lib/libb.so.1")" \
+		"$("$XPLDD" $root -R /nowhere -R /bin/prog -R /nowhere "$prefix/bin/prog" 2>/dev/null)"
+done
+
+# -P given more than once stacks the prefixes like overlayfs; paths are in
+# the merged view. whiteouts in an upper layer hide libb.so.1, whether OCI's
+# .wh. files, an opaque directory, or overlayfs's own 0:0 character device,
+# and a layer above that can bring it back
+mkdir -p "$T/wh/lib" "$T/opq/lib" "$T/back/lib"
+touch "$T/wh/lib/.wh.libb.so.1" "$T/opq/lib/.wh..wh..opq"
+cp "$LIBA" "$T/opq/lib/"
+cp "$LIBB" "$T/back/lib/"
+layers="wh opq"
+if mkdir -p "$T/chr/lib" && mknod "$T/chr/lib/libb.so.1" c 0 0 2>/dev/null; then
+	layers="$layers chr"
+else
+	echo "skipped: overlay (chr), can't mknod"
+fi
+for layer in $layers; do
+	check "overlay ($layer)" "$(listing /bin/prog /lib/liba.so.1 libb.so.1)" \
+		"$("$XPLDD" -P "$SR" -P "$T/$layer" /bin/prog 2>/dev/null)"
+	check "overlay ($layer, then back)" "$(listing /bin/prog /lib/liba.so.1 /lib/libb.so.1)" \
+		"$("$XPLDD" -P "$SR" -P "$T/$layer" -P "$T/back" /bin/prog 2>/dev/null)"
+done
+mkdir -p "$T/shadow/lib"
+cp "$T/bad/libc.so" "$T/shadow/lib/liba.so.1"
+check "overlay shadowed by a linker script" "$(listing /bin/prog liba.so.1)" \
+	"$("$XPLDD" -P "$SR" -P "$T/shadow" /bin/prog 2>/dev/null)"
+
+# saved graphs against each other, live sysroots, and archives; libb.so.1
+# is taken away on one side and needs something new on another
+"$XPLDD" --save "$T/graph" -P "$SR" "$SR/bin/prog" > /dev/null 2>&1
+check "diff saved with itself" "" "$("$XPLDD" --diff "$T/graph" --diff "$T/graph" /bin/prog 2>/dev/null)"
+check "diff saved with live" "" "$("$XPLDD" --diff "$T/graph" --diff "$SR" /bin/prog 2>/dev/null)"
+check "diff saved with an archive" "" "$("$XPLDD" --diff "$T/graph" --diff "$T/sr.cpio" /bin/prog 2>/dev/null)"
+cp -R "$SR" "$T/nolibb"
+rm "$T/nolibb/lib/libb.so.1"
+check "diff retargeted" "~$TAB/lib/liba.so.1${TAB}libb.so.1$TAB/lib/libb.so.1${TAB}libb.so.1" \
+	"$("$XPLDD" --diff "$T/graph" --diff "$T/nolibb" /bin/prog 2>/dev/null)"
+cp -R "$SR" "$T/more"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libb.so.1 -n libz.so.1 "$T/more/lib/libb.so.1"
+check "diff added" "+$TAB/lib/libb.so.1${TAB}libz.so.1${TAB}libz.so.1" \
+	"$("$XPLDD" --diff "$T/graph" --diff "$T/more" /bin/prog 2>/dev/null)"
+check "diff removed" "-$TAB/lib/libb.so.1${TAB}libz.so.1${TAB}libz.so.1" \
+	"$("$XPLDD" --diff "$T/more" -P "$SR" /bin/prog 2>/dev/null)"
+head -c 40 "$T/graph" > "$T/short.graph"
+check "truncated graph" "$T/short.graph: not a saved graph" \
+	"$("$XPLDD" --diff "$T/short.graph" --diff "$T/graph" /bin/prog 2>&1 >/dev/null)"
+
+# libraries needing each other are listed once, and the cycle is reported;
+# the tree follows it around until it comes back, as does a longer one
+cp -R "$SR" "$T/cyc"
+link -Wl,-rpath-link,"$T/cyc/lib" -shared -Wl,-soname,libb.so.1 -o "$T/cyc/lib/libb.so.1" \
+	"$T/b.cpp" "$T/cyc/lib/liba.so.1"
+CA=$T/cyc/lib/liba.so.1
+CB=$T/cyc/lib/libb.so.1
+check "cycle" "$(listing "$T/cyc/bin/prog" "$CA" "$CB")" \
+	"$("$XPLDD" -P "$T/cyc" "$T/cyc/bin/prog" 2>/dev/null)"
+check "cycle reported" "dependency cycle: $CA $CB" \
+	"$("$XPLDD" -P "$T/cyc" "$T/cyc/bin/prog" 2>&1 >/dev/null)"
+check "cycle tree" "$(printf '%s:\n\t%s\n\t\t%s\n\t\t\t%s (cycle)' "$T/cyc/bin/prog" "$CA" "$CB" "$CA")" \
+	"$("$XPLDD" -t -P "$T/cyc" "$T/cyc/bin/prog" 2>/dev/null)"
+mkdir -p "$T/ring/lib"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n libr1.so "$T/ring/top.so"
+for i in 1 2 3; do
+	mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -s libr$i.so -n libr$((i % 3 + 1)).so \
+		-n libb.so.1 "$T/ring/lib/libr$i.so"
+done
+cp "$LIBB" "$T/ring/lib/"
+R=$T/ring/lib
+check "longer cycle tree" \
+	"$(printf '%s:\n\t%s\n\t\t%s\n\t\t\t%s\n\t\t\t\t%s (cycle)\n\t\t\t\t%s\n\t\t\t%s\n\t\t%s' \
+		"$T/ring/top.so" "$R/libr1.so" "$R/libr2.so" "$R/libr3.so" "$R/libr1.so" "$R/libb.so.1" \
+		"$R/libb.so.1" "$R/libb.so.1")" \
+	"$("$XPLDD" -t -P "$T/ring" "$T/ring/top.so" 2>/dev/null)"
+
+# dependencies are resolved a level at a time: a long chain ends up whole,
+# and something needed from two places is found once
+mkdir -p "$T/chain/lib"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n libc1.so "$T/chain/top.so"
+i=1
+while [ $i -lt 100 ]; do
+	mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -s libc$i.so -n libc$((i + 1)).so \
+		"$T/chain/lib/libc$i.so"
+	i=$((i + 1))
+done
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libc100.so "$T/chain/lib/libc100.so"
+check "long chain" 100 \
+	"$("$XPLDD" -P "$T/chain" "$T/chain/top.so" 2>/dev/null | grep -c "^$TAB$T/chain/lib/libc")"
+check "long chain tree" "$(printf '%100s' '' | tr ' ' "$TAB")$T/chain/lib/libc100.so" \
+	"$("$XPLDD" -t -P "$T/chain" "$T/chain/top.so" 2>/dev/null | tail -n 1)"
+mkdir -p "$T/diamond/lib"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n libx.so -n liby.so "$T/diamond/top.so"
+for lib in x y; do
+	mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -s lib$lib.so -n libb.so.1 \
+		"$T/diamond/lib/lib$lib.so"
+done
+cp "$LIBB" "$T/diamond/lib/"
+D=$T/diamond/lib
+check "diamond" "$(listing "$T/diamond/top.so" "$D/libb.so.1" "$D/libx.so" "$D/liby.so")" \
+	"$("$XPLDD" -P "$T/diamond" "$T/diamond/top.so" 2>/dev/null)"
+check "diamond tree" "$(printf '%s:\n\t%s\n\t\t%s\n\t%s\n\t\t%s' "$T/diamond/top.so" \
+		"$D/libx.so" "$D/libb.so.1" "$D/liby.so" "$D/libb.so.1")" \
+	"$("$XPLDD" -t -P "$T/diamond" "$T/diamond/top.so" 2>/dev/null)"
+# with -n, a root another one needs is filled in where it was only a name
+check "no recursion, root needed by a root" \
+	"$(printf '%s:\n\t%s\n\t%s\n%s:\n\t%s' "$T/diamond/top.so" "$D/libx.so" "$D/liby.so" \
+		"$D/libx.so" "$D/libb.so.1")" \
+	"$("$XPLDD" -n -P "$T/diamond" "$T/diamond/top.so" "$D/libx.so" 2>/dev/null)"
+
+# --load-order goes breadth first like ld.so, and a library reached through
+# two paths (a merged /usr) is loaded once
+mkdir -p "$T/order/lib" "$T/order/usr"
+ln -s ../lib "$T/order/usr/lib"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n libx.so -n liby.so -n libgone.so \
+	"$T/order/top.so"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -s libx.so -n libb.so.1 "$T/order/lib/libx.so"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /usr/lib -s liby.so -n libb.so.1 "$T/order/lib/liby.so"
+cp "$LIBB" "$T/order/lib/"
+O=$T/order/lib
+check "load order" "$(listing "$T/order/top.so" "$O/libx.so" "$O/liby.so" libgone.so "$O/libb.so.1")" \
+	"$("$XPLDD" --load-order -P "$T/order" "$T/order/top.so" 2>/dev/null)"
+check "load order with a cycle" "$(listing "$T/cyc/bin/prog" "$CA" "$CB")" \
+	"$("$XPLDD" --load-order -P "$T/cyc" "$T/cyc/bin/prog" 2>/dev/null)"
+
+# --bundle copies the closure to the same paths as under the prefix, for a
+# program given by a relative path too; --bundle-symlinks keeps soname links
+files()
+{
+	(cd "$1" && find . ! -type d | sed 's,^\./,,' | sort)
+}
+"$XPLDD" --bundle "$T/bundle" -P "$SR" "$SR/bin/prog" > /dev/null 2>&1
+check "bundle" "$(printf 'bin/prog\nlib/liba.so.1\nlib/libb.so.1')" "$(files "$T/bundle")"
+check "bundle lists the same" "$(listing "$T/bundle/bin/prog" "$T/bundle/lib/liba.so.1" "$T/bundle/lib/libb.so.1")" \
+	"$("$XPLDD" -P "$T/bundle" "$T/bundle/bin/prog" 2>/dev/null)"
+(cd "$T" && "$XPLDD" --bundle "$T/relbundle" -P "$SR" sr/bin/prog > /dev/null 2>&1)
+check "bundle relative" "$(printf 'bin/prog\nlib/liba.so.1\nlib/libb.so.1')" "$(files "$T/relbundle")"
+(cd "$T" && "$XPLDD" --bundle "$T/outbundle" -P "$SR/lib" sr/bin/prog > /dev/null 2>&1)
+check "bundle outside the prefix" 1 $?
+"$XPLDD" --bundle "$T/cpiobundle" --bundle-symlinks -A "$T/sr.cpio" /bin/prog > /dev/null 2>&1
+check "bundle symlinks" "$(printf 'bin/prog\nlib/liba.so.1\nlib/liba.so.1.0\nlib/libb.so.1')" \
+	"$(files "$T/cpiobundle")"
+check "bundle symlink target" liba.so.1.0 "$(readlink "$T/cpiobundle/lib/liba.so.1")"
+if cmp -s "$LIBB" "$T/cpiobundle/lib/libb.so.1"; then
+	echo "ok: bundle contents"
+else
+	fail "bundle contents"
+fi
+
+# fingerprints only change with the files, or the order they're loaded in
+first=$("$XPLDD" --fingerprint -P "$SR" "$SR/bin/prog" 2>/dev/null)
+check "fingerprint stable" "$first" "$("$XPLDD" --fingerprint -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+check "fingerprint from an archive" "${first%% *}" \
+	"$("$XPLDD" --fingerprint -A "$T/sr.cpio" /bin/prog 2>/dev/null | cut -d' ' -f1)"
+cp -R "$SR" "$T/copy"
+check "fingerprint independent of path" "${first%% *}" \
+	"$("$XPLDD" --fingerprint -P "$T/copy" "$T/copy/bin/prog" 2>/dev/null | cut -d' ' -f1)"
+printf 'x' >> "$T/copy/lib/libb.so.1"
+changed=$("$XPLDD" --fingerprint -P "$T/copy" "$T/copy/bin/prog" 2>/dev/null)
+if [ "${first%% *}" = "${changed%% *}" ]; then
+	fail "fingerprint follows contents"
+else
+	echo "ok: fingerprint follows contents"
+fi
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n libx.so -n liby.so -n libgone.so \
+	"$T/order/same.so"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n liby.so -n libx.so -n libgone.so \
+	"$T/order/top2.so"
+set -- $("$XPLDD" --fingerprint -P "$T/order" "$T/order/top.so" "$T/order/same.so" \
+	"$T/order/top2.so" 2>/dev/null | cut -d' ' -f1)
+check "fingerprint of identical programs" "$1" "$2"
+if [ "$1" = "$3" ]; then
+	fail "fingerprint follows load order"
+else
+	echo "ok: fingerprint follows load order"
+fi
+"$XPLDD" --fingerprint -t "$SR/bin/prog" > /dev/null 2>&1
+check "fingerprint with -t" 1 $?
+
+# libxpldd resolves the same as the command, with what one root found kept
+# for the next, and a root that isn't there doesn't spoil the rest
+if [ -x "$EMBED" ]; then
+	check "embedded" "$(printf '%s:\n\t%s\n\t%s\n\t%s => %s\n%s: not resolved\n%s:\n\t%s\n\t%s => %s' \
+			"$SR/bin/prog" "$LIBA" "$LIBB" liba.so.1 "$LIBA" "$SR/bin/gone" \
+			"$LIBA" "$LIBB" libb.so.1 "$LIBB")" \
+		"$("$EMBED" "$SR" "$SR/bin/prog" "$SR/bin/gone" "$LIBA" 2>/dev/null)"
+else
+	echo "skipped: embedded, no $EMBED"
+fi
+"$XPLDD" -P "$SR" "$SR/bin/gone" > /dev/null 2>&1
+check "missing root" 3 $?
+
+# the parse cache gives the same answers the second time around, and from
+# several processes at once; a library changed in place, keeping its size
+# and mtime, is read again rather than taken from the cache
+"$XPLDD" --cache "$T/cache" -P "$SR" "$SR/bin/prog" > /dev/null 2>&1
+check "cache" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" \
+	"$("$XPLDD" --cache "$T/cache" -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+for i in 1 2 3 4; do
+	"$XPLDD" --cache "$T/cache" -P "$T/chain" "$T/chain/top.so" > "$T/cached.$i" 2>/dev/null &
+done
+wait
+"$XPLDD" -P "$T/chain" "$T/chain/top.so" > "$T/uncached" 2>/dev/null
+for i in 1 2 3 4; do
+	if cmp -s "$T/uncached" "$T/cached.$i"; then
+		echo "ok: cache shared $i"
+	else
+		fail "cache shared $i"
+	fi
+done
+mkdir -p "$T/inplace"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libt.so -n libq.so.1 "$T/inplace/before.so"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libt.so -n libz.so.1 "$T/inplace/after.so"
+for engine in sync threads uring; do
+	mkdir -p "$T/inplace/$engine/lib"
+	mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n libt.so "$T/inplace/$engine/top.so"
+	L=$T/inplace/$engine/lib/libt.so
+	cp -p "$T/inplace/before.so" "$L"
+	"$XPLDD" -I $engine --cache "$T/cache" -P "$T/inplace/$engine" "$T/inplace/$engine/top.so" > /dev/null 2>&1
+	cat "$T/inplace/after.so" > "$L"
+	touch -r "$T/inplace/before.so" "$L"
+	check "cache changed in place ($engine)" "$(listing "$T/inplace/$engine/top.so" "$L" libz.so.1)" \
+		"$("$XPLDD" -I $engine --cache "$T/cache" -P "$T/inplace/$engine" "$T/inplace/$engine/top.so" 2>/dev/null)"
+done
+printf 'garbage\n' > "$T/notcache"
+check "not a cache" "$T/notcache: not a parse cache" \
+	"$("$XPLDD" --cache "$T/notcache" -P "$SR" "$SR/bin/prog" 2>&1 >/dev/null)"
+
+# --timeout gives up on a search directory that hangs, like a dead NFS
+# mount, and carries on with the next; a preloaded shim makes opening it
+# take far longer than the timeout
+cat > "$T/stall.cpp" <<'END'
+#include <cstdarg>
+#include <cstring>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int stall(const char *name, int dirfd, const char *path, int flags, va_list ap)
+{
+	size_t len = strlen(path);
+	if (len >= 8 && strcmp(path + len - 8, "/stalled") == 0) {
+		sleep(10);
+	}
+	int (*real)(int, const char *, int, ...) =
+		(int (*)(int, const char *, int, ...))dlsym(RTLD_NEXT, name);
+	return real(dirfd, path, flags, (flags & O_CREAT) ? va_arg(ap, int) : 0);
+}
+
+extern "C" int openat(int dirfd, const char *path, int flags, ...)
+{
+	va_list ap;
+	va_start(ap, flags);
+	int ret = stall("openat", dirfd, path, flags, ap);
+	va_end(ap);
+	return ret;
+}
+
+extern "C" int openat64(int dirfd, const char *path, int flags, ...)
+{
+	va_list ap;
+	va_start(ap, flags);
+	int ret = stall("openat64", dirfd, path, flags, ap);
+	va_end(ap);
+	return ret;
+}
+END
+mkdir -p "$T/stalled"
+cp "$LIBA" "$T/stalled/"
+if "$CXX" -shared -fPIC -o "$T/stall.so" "$T/stall.cpp" -ldl 2>/dev/null; then
+	start=$(date +%s)
+	LD_PRELOAD=$T/stall.so "$XPLDD" -I threads --timeout 200 -R "$T/stalled" -R "$SR/lib" \
+		"$SR/bin/prog" > "$T/timeout.out" 2> "$T/timeout.err"
+	check "timeout" "$(listing "$SR/bin/prog" "$LIBA" "$LIBB")" "$(cat "$T/timeout.out")"
+	check "timeout reported" "$T/stalled: timed out, not searching it again" "$(cat "$T/timeout.err")"
+	if [ $(($(date +%s) - start)) -lt 8 ]; then
+		echo "ok: timeout doesn't wait"
+	else
+		fail "timeout doesn't wait"
+	fi
+else
+	echo "skipped: timeout, can't build the shim"
+fi
+for timeout in 0 -5 abc 10x "" 99999999999999999999; do
+	"$XPLDD" --timeout "$timeout" "$SR/bin/prog" > /dev/null 2>&1
+	check "bad timeout '$timeout'" 1 $?
+done
+"$XPLDD" -I uring --timeout 200 "$SR/bin/prog" > /dev/null 2>&1
+check "timeout with uring" 1 $?
+
+# an empty DT_NEEDED name is warned about and skipped, not looked up
+mkdir -p "$T/empty/lib"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -n "" -n libb.so.1 -n "" "$T/empty/top.so"
+cp "$LIBB" "$T/empty/lib/"
+check "empty DT_NEEDED" "$(listing "$T/empty/top.so" "$T/empty/lib/libb.so.1")" \
+	"$("$XPLDD" -P "$T/empty" "$T/empty/top.so" 2>/dev/null)"
+check "empty DT_NEEDED reported" "$T/empty/top.so: empty DT_NEEDED entry, skipping it" \
+	"$("$XPLDD" -P "$T/empty" "$T/empty/top.so" 2>&1 >/dev/null)"
+
+# every class and byte order reads the same, ours or not: the headers and
+# dynamic segment are swapped where they need to be, on every engine
+for class in 1 2; do
+	for data in 1 2; do
+		E=$T/endian-$class$data
+		mkdir -p "$E/lib"
+		mkelf -c $class -d $data -m "$MACHINE" -r /lib -n libe1.so "$E/top.so"
+		mkelf -c $class -d $data -m "$MACHINE" -r /lib -s libe1.so -n libe2.so -n libgone.so \
+			"$E/lib/libe1.so"
+		mkelf -c $class -d $data -m "$MACHINE" -s libe2.so "$E/lib/libe2.so"
+		for engine in sync uring; do
+			check "class $class, data $data ($engine)" \
+				"$(listing "$E/top.so" "$E/lib/libe1.so" "$E/lib/libe2.so" libgone.so)" \
+				"$("$XPLDD" -I $engine -P "$E" "$E/top.so" 2>/dev/null)"
+		done
+		(cd "$E" && tar -cf "$T/endian-$class$data.tar" top.so lib)
+		check "class $class, data $data (archive)" \
+			"$(listing /top.so /lib/libe1.so /lib/libe2.so libgone.so)" \
+			"$("$XPLDD" -A "$T/endian-$class$data.tar" /top.so 2>/dev/null)"
+	done
+done
+
+# a foreign endian dynamic segment is swapped in bulk; one with an odd
+# number of entries has whatever the vector loop leaves over swapped too
+for class in 1 2; do
+	W=$T/wide-$class
+	mkdir -p "$W/lib"
+	set --
+	i=10
+	while [ $i -lt 47 ]; do
+		set -- "$@" -n libn$i.so
+		i=$((i + 1))
+	done
+	mkelf -c $class -d $((3 - DATA)) -m "$MACHINE" -r /lib -n libwide.so "$W/top.so"
+	mkelf -c $class -d $((3 - DATA)) -m "$MACHINE" -r /nowhere -r /lib -s libwide.so \
+		"$@" -n libe2.so "$W/lib/libwide.so"
+	mkelf -c $class -d $((3 - DATA)) -m "$MACHINE" -s libe2.so "$W/lib/libe2.so"
+	expected="$W/top.so:$(printf '\n\t%s' "$W/lib/libe2.so" "$W/lib/libwide.so")"
+	i=10
+	while [ $i -lt 47 ]; do
+		expected="$expected$(printf '\n\tlibn%s.so' $i)"
+		i=$((i + 1))
+	done
+	check "foreign endian, class $class, many entries" "$expected" \
+		"$("$XPLDD" -P "$W" "$W/top.so" 2>/dev/null)"
+done
+
+# hostile and truncated images are turned away without a crash; the
+# built-in parser (--without-libelf) says what was wrong with them. They're
+# 64-bit little endian whatever we are, so the offsets are known: the
+# section headers are the last 256 bytes, and .dynamic is the third
+mkdir -p "$T/hostile"
+H=$T/hostile
+mkelf -c 2 -d 1 -r /lib -n libz.so.1 "$H/good.so"
+SHOFF=$(($(wc -c < "$H/good.so") - 256))
+cp "$H/good.so" "$H/shoff.so"
+poke "$H/shoff.so" 40 '\377\377\377\377\377\377\377\177'
+head -c $((SHOFF + 100)) "$H/good.so" > "$H/truncated.so"
+cp "$H/good.so" "$H/shentsize.so"
+poke "$H/shentsize.so" 58 '\041\000'
+cp "$H/good.so" "$H/dynoff.so"
+poke "$H/dynoff.so" $((SHOFF + 128 + 24)) '\000\000\000\000\000\001\000\000'
+cp "$H/good.so" "$H/dynlink.so"
+poke "$H/dynlink.so" $((SHOFF + 128 + 40)) '\177\000\000\000'
+cp "$H/good.so" "$H/stroff.so"
+poke "$H/stroff.so" 200 '\377\377\377\377\000\000\000\000'
+printf '!<arch>\n0123456789' > "$H/arhead.a"
+printf '!<arch>\n%-16s%-12s%-6s%-6s%-8s%-10s`\n' x.o 0 0 0 644 lots > "$H/arsize.a"
+printf '!<arch>\n%-16s%-12s%-6s%-6s%-8s%-10s`\n' /99 0 0 0 644 0 > "$H/arname.a"
+head -c 100 "$H/good.so" > "$H/member.o"
+(cd "$H" && ar rc armember.a member.o)
+for hostile in "shoff.so: section headers out of bounds" \
+		"truncated.so: section headers out of bounds" \
+		"shentsize.so: bad section header size" \
+		"dynoff.so: dynamic section out of bounds" \
+		"dynlink.so: dynamic section out of bounds" \
+		"arhead.a: truncated member header" "arsize.a: bad member header" \
+		"arname.a: bad long member name" "armember.a: member.o: section headers out of bounds"; do
+	file=${hostile%%: *}
+	"$XPLDD" "$H/$file" > /dev/null 2> "$T/hostile.err"
+	status=$?
+	if [ $status -ge 128 ]; then
+		fail "hostile $file (status $status)"
+	elif [ "$ELF_PARSER" = builtin ]; then
+		check "hostile $file" "${hostile#*: }" "$(head -n 1 "$T/hostile.err")"
+	else
+		echo "ok: hostile $file"
+	fi
+done
+# a name that's off the end of .dynstr is passed over, and an empty one
+# in an archive member is too, with a warning
+check "hostile name offset" "$H/stroff.so:" "$("$XPLDD" "$H/stroff.so" 2>/dev/null)"
+mkelf -c 2 -d 1 -n "" -n libz.so.1 "$H/emptyname.so"
+(cd "$H" && ar rc emptyname.a emptyname.so)
+check "empty name in a member" "$(printf '%s:\n\temptyname.so:\n\t\tlibz.so.1' "$H/emptyname.a")" \
+	"$("$XPLDD" "$H/emptyname.a" 2>/dev/null)"
+check "empty name in a member reported" "emptyname.so: empty DT_NEEDED entry, skipping it" \
+	"$("$XPLDD" "$H/emptyname.a" 2>&1 >/dev/null)"
+check "not hostile" "$(listing "$H/good.so" libz.so.1)" "$("$XPLDD" "$H/good.so" 2>/dev/null)"
+
+# a runpath replaces the rpath, and empty names and search paths are passed
+# over; the root is read from its section headers and the library it needs
+# from its dynamic segment, so both get a go. an empty search path would
+# find the decoys at the top
+mkdir -p "$T/runpath/lib"
+RP=$T/runpath
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /nowhere -R "" -R /lib -n "" -n libmid.so "$RP/top.so"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -r /lib -R "" -R /elsewhere -s libmid.so -n libb.so.1 \
+	"$RP/lib/libmid.so"
+cp "$LIBB" "$RP/lib/"
+cp "$RP/lib/libmid.so" "$RP/lib/libb.so.1" "$RP/"
+check "runpath" "$(listing "$RP/top.so" "$RP/lib/libmid.so" libb.so.1)" \
+	"$("$XPLDD" -P "$RP" "$RP/top.so" 2>/dev/null)"
+
+# --watch picks up a library changing what it needs, and a library
+# directory being removed and made again
+if command -v timeout > /dev/null; then
+	cp -R "$SR" "$T/watched"
+	mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libb.so.1 -n libz.so.1 "$T/libb-z.so"
+	timeout 6 "$XPLDD" --watch -P "$T/watched" "$T/watched/bin/prog" > "$T/watch.out" 2>/dev/null &
+	sleep 1
+	cp "$T/libb-z.so" "$T/watched/lib/libb.so.1.new"
+	mv "$T/watched/lib/libb.so.1.new" "$T/watched/lib/libb.so.1"
+	sleep 1
+	rm -rf "$T/watched/lib"
+	sleep 1
+	cp -R "$SR/lib" "$T/watched/lib"
+	wait
+	W=$T/watched
+	check "watch" "$(printf '%s\n%s\n%s\n%s' \
+		"{\"event\":\"closure\",\"root\":\"$W/bin/prog\",\"closure\":[\"$W/lib/liba.so.1\",\"$W/lib/libb.so.1\"]}" \
+		"{\"event\":\"changed\",\"root\":\"$W/bin/prog\",\"added\":[\"libz.so.1\"],\"removed\":[]}" \
+		"{\"event\":\"changed\",\"root\":\"$W/bin/prog\",\"added\":[\"liba.so.1\"],\"removed\":[\"$W/lib/liba.so.1\",\"$W/lib/libb.so.1\",\"libz.so.1\"]}" \
+		"{\"event\":\"changed\",\"root\":\"$W/bin/prog\",\"added\":[\"$W/lib/liba.so.1\",\"$W/lib/libb.so.1\"],\"removed\":[\"liba.so.1\"]}")" \
+		"$(grep -v reparsed "$T/watch.out")"
+else
+	echo "skipped: watch, no timeout(1)"
+fi
+
+# --why gives the shortest chain to a library, by name or path; with
+# --all-paths, every one of them
+check "why" "$(listing "$SR/bin/prog" "$LIBA -> $LIBB")" \
+	"$("$XPLDD" --why libb.so.1 -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+check "why by path" "$(listing "$SR/bin/prog" "$LIBA -> $LIBB")" \
+	"$("$XPLDD" --why "$LIBB" -P "$SR" "$SR/bin/prog" 2>/dev/null)"
+check "why first" "$(listing "$T/diamond/top.so" "$D/libx.so -> $D/libb.so.1")" \
+	"$("$XPLDD" --why libb.so.1 -P "$T/diamond" "$T/diamond/top.so" 2>/dev/null)"
+check "why all paths" "$(listing "$T/diamond/top.so" "$D/libx.so -> $D/libb.so.1" "$D/liby.so -> $D/libb.so.1")" \
+	"$("$XPLDD" --why libb.so.1 --all-paths -P "$T/diamond" "$T/diamond/top.so" 2>/dev/null)"
+check "why unresolved" "$(listing "$T/order/top.so" libgone.so)" \
+	"$("$XPLDD" --why libgone.so -P "$T/order" "$T/order/top.so" 2>/dev/null)"
+check "why not" "$(printf '%s:\nlibq.so isn'"'"'t needed' "$SR/bin/prog")" \
+	"$("$XPLDD" --why libq.so -P "$SR" "$SR/bin/prog" 2>&1)"
+check "why through a cycle" "$(listing "$T/ring/top.so" "$R/libr1.so -> $R/libr2.so -> $R/libr3.so")" \
+	"$("$XPLDD" --why libr3.so -P "$T/ring" "$T/ring/top.so" 2>/dev/null)"
+"$XPLDD" --why libb.so.1 -t "$SR/bin/prog" > /dev/null 2>&1
+check "why with -t" 1 $?
+
+# --soname-index finds a library by its soname when no file is named after
+# it, warns about one found under a name its soname disagrees with, and
+# suggests what an unresolved name might have meant
+mkdir -p "$T/soname/bin" "$T/soname/lib"
+cp "$SR/bin/prog" "$T/soname/bin/"
+cp "$LIBA" "$T/soname/lib/liba-1.0.so"
+cp "$LIBB" "$T/soname/lib/libb-1.0.so"
+S=$T/soname/lib
+check "soname index" "$(listing "$T/soname/bin/prog" "$S/liba-1.0.so" "$S/libb-1.0.so")" \
+	"$("$XPLDD" --soname-index -P "$T/soname" "$T/soname/bin/prog" 2>/dev/null)"
+check "soname index off" "$(listing "$T/soname/bin/prog" liba.so.1)" \
+	"$("$XPLDD" -P "$T/soname" "$T/soname/bin/prog" 2>/dev/null)"
+rm "$S/libb-1.0.so"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libb.so.2 "$S/libb.so.9"
+check "soname suggested" "libb.so.1 not found; the soname index has $S/libb.so.9 (libb.so.2)" \
+	"$("$XPLDD" --soname-index -P "$T/soname" "$T/soname/bin/prog" 2>&1 >/dev/null)"
+mkelf -c "$CLASS" -d "$DATA" -m "$MACHINE" -s libb.so.2 "$S/libb.so.1"
+check "soname mismatch" "$S/libb.so.1: soname is libb.so.2, but it's needed as libb.so.1" \
+	"$("$XPLDD" --soname-index -P "$T/soname" "$T/soname/bin/prog" 2>&1 >/dev/null)"
+check "soname index with an empty DT_NEEDED" "$(listing "$T/empty/top.so" "$T/empty/lib/libb.so.1")" \
+	"$("$XPLDD" --soname-index -P "$T/empty" "$T/empty/top.so" 2>/dev/null)"
+check "soname index with an empty DT_NEEDED reported" "$T/empty/top.so: empty DT_NEEDED entry, skipping it" \
+	"$("$XPLDD" --soname-index -P "$T/empty" "$T/empty/top.so" 2>&1 >/dev/null)"
+
+if [ $failed -ne 0 ]; then
+	echo "$failed failed"
+	exit 1
+fi
+exit 0
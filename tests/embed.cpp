@@ -0,0 +1,52 @@
+/*
+ * xpldd: resolves through libxpldd for make check, the way a program
+ * embedding it would, with one Resolver kept around for every root
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "resolver.h"
+
+using namespace std;
+
+// prints each root's closure in load order, like xpldd --load-order, and
+// then what its own DT_NEEDED entries resolved to
+int main(int argc, char **argv)
+{
+	if (argc < 3) {
+		cerr << "usage: " << argv[0] << " prefix elf..\n";
+		return 1;
+	}
+	Resolver resolver;
+	resolver._prefix = argv[1];
+	resolver._layers.push_back(argv[1]);
+	string error;
+	if (!resolver.open(error)) {
+		cerr << error << "\n";
+		return 1;
+	}
+	int ret = 0;
+	for (int i = 2; i < argc; i++) {
+		string root = argv[i];
+		if (!resolver.resolve(root) || resolver.find(root) == nullptr) {
+			cout << root << ": not resolved\n";
+			ret = 3;
+			continue;
+		}
+		vector<string> order;
+		resolver.load_order(root, order);
+		cout << root << ":\n";
+		for (size_t j = 1; j < order.size(); j++) {
+			cout << "\t" << order[j] << "\n";
+		}
+		vector<pair<string, string>> edges;
+		resolver.edges(root, edges);
+		for (auto& edge : edges) {
+			cout << "\t" << edge.first << " => " << edge.second << "\n";
+		}
+	}
+	return ret;
+}
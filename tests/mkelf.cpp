@@ -0,0 +1,226 @@
+/*
+ * xpldd: writes small ELF shared objects for make check, in any class, byte
+ * order, and machine, so the checks don't need a cross compiler
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+extern "C" {
+	#include <elf.h>
+	#include <getopt.h>
+}
+
+// What goes in the file; the dynamic section and its string table are all
+// there is, with program headers pointing at them like a linker would.
+class ElfSpec {
+public:
+	unsigned char _class, _data, _osabi;
+	uint16_t _machine, _type;
+	vector<string> _needed, _rpath, _runpath;
+	string _soname;
+};
+
+template <typename Ehdr, typename Phdr, typename Shdr, typename Dyn>
+class ElfWriter {
+public:
+	ElfWriter(const ElfSpec& spec) : _spec(spec) {}
+
+	// an integer at off, in the file's byte order
+	template <typename T>
+	void put(size_t off, T val)
+	{
+		for (size_t i = 0; i < sizeof(T); i++) {
+			size_t shift = _spec._data == ELFDATA2MSB ? sizeof(T) - 1 - i : i;
+			_out[off + i] = (unsigned char)((uint64_t)val >> (shift * 8));
+		}
+	}
+
+	size_t add_string(const string& str)
+	{
+		size_t off = _dynstr.size();
+		_dynstr.insert(_dynstr.end(), str.begin(), str.end());
+		_dynstr.push_back('\0');
+		return off;
+	}
+
+	vector<unsigned char> write()
+	{
+		// the empty string is at 0, like any string table
+		_dynstr.push_back('\0');
+		vector<pair<int64_t, uint64_t>> dyns;
+		for (auto& needed : _spec._needed) {
+			dyns.push_back(make_pair(DT_NEEDED, needed.empty() ? 0 : add_string(needed)));
+		}
+		for (auto& rpath : _spec._rpath) {
+			dyns.push_back(make_pair(DT_RPATH, add_string(rpath)));
+		}
+		for (auto& runpath : _spec._runpath) {
+			dyns.push_back(make_pair(DT_RUNPATH, add_string(runpath)));
+		}
+		if (!_spec._soname.empty()) {
+			dyns.push_back(make_pair(DT_SONAME, add_string(_spec._soname)));
+		}
+		const char shstrtab[] = "\0.dynstr\0.dynamic\0.shstrtab";
+
+		// headers, .dynstr, .dynamic, .shstrtab, then the section headers;
+		// it's all one PT_LOAD at address 0, so addresses are offsets
+		size_t phoff = sizeof(Ehdr);
+		size_t dynstr = phoff + 2 * sizeof(Phdr);
+		size_t dynamic = align(dynstr + _dynstr.size());
+		size_t dynsize = (dyns.size() + 3) * sizeof(Dyn);
+		size_t shstr = dynamic + dynsize;
+		size_t shoff = align(shstr + sizeof(shstrtab));
+		_out.assign(shoff + 4 * sizeof(Shdr), 0);
+
+		memcpy(&_out[0], ELFMAG, SELFMAG);
+		_out[EI_CLASS] = _spec._class;
+		_out[EI_DATA] = _spec._data;
+		_out[EI_VERSION] = EV_CURRENT;
+		_out[EI_OSABI] = _spec._osabi;
+		put(offsetof(Ehdr, e_type), _spec._type);
+		put(offsetof(Ehdr, e_machine), _spec._machine);
+		put(offsetof(Ehdr, e_version), (uint32_t)EV_CURRENT);
+		put(offsetof(Ehdr, e_phoff), (decltype(Ehdr().e_phoff))phoff);
+		put(offsetof(Ehdr, e_shoff), (decltype(Ehdr().e_shoff))shoff);
+		put(offsetof(Ehdr, e_ehsize), (uint16_t)sizeof(Ehdr));
+		put(offsetof(Ehdr, e_phentsize), (uint16_t)sizeof(Phdr));
+		put(offsetof(Ehdr, e_phnum), (uint16_t)2);
+		put(offsetof(Ehdr, e_shentsize), (uint16_t)sizeof(Shdr));
+		put(offsetof(Ehdr, e_shnum), (uint16_t)4);
+		put(offsetof(Ehdr, e_shstrndx), (uint16_t)3);
+
+		phdr(phoff, PT_LOAD, 0, _out.size());
+		phdr(phoff + sizeof(Phdr), PT_DYNAMIC, dynamic, dynsize);
+
+		memcpy(&_out[dynstr], _dynstr.data(), _dynstr.size());
+		dyns.push_back(make_pair(DT_STRTAB, dynstr));
+		dyns.push_back(make_pair(DT_STRSZ, _dynstr.size()));
+		dyns.push_back(make_pair(DT_NULL, 0));
+		for (size_t i = 0; i < dyns.size(); i++) {
+			size_t off = dynamic + i * sizeof(Dyn);
+			put(off + offsetof(Dyn, d_tag), (decltype(Dyn().d_tag))dyns[i].first);
+			put(off + offsetof(Dyn, d_un), (decltype(Dyn().d_un.d_val))dyns[i].second);
+		}
+		memcpy(&_out[shstr], shstrtab, sizeof(shstrtab));
+
+		shdr(shoff + sizeof(Shdr), 1, SHT_STRTAB, dynstr, _dynstr.size(), 0, 0);
+		shdr(shoff + 2 * sizeof(Shdr), 9, SHT_DYNAMIC, dynamic, dynsize, 1, sizeof(Dyn));
+		shdr(shoff + 3 * sizeof(Shdr), 18, SHT_STRTAB, shstr, sizeof(shstrtab), 0, 0);
+		return _out;
+	}
+
+private:
+	static size_t align(size_t off)
+	{
+		return (off + 7) & ~(size_t)7;
+	}
+
+	void phdr(size_t off, uint32_t type, uint64_t offset, uint64_t size)
+	{
+		put(off + offsetof(Phdr, p_type), type);
+		put(off + offsetof(Phdr, p_offset), (decltype(Phdr().p_offset))offset);
+		put(off + offsetof(Phdr, p_vaddr), (decltype(Phdr().p_vaddr))offset);
+		put(off + offsetof(Phdr, p_paddr), (decltype(Phdr().p_paddr))offset);
+		put(off + offsetof(Phdr, p_filesz), (decltype(Phdr().p_filesz))size);
+		put(off + offsetof(Phdr, p_memsz), (decltype(Phdr().p_memsz))size);
+		put(off + offsetof(Phdr, p_flags), (uint32_t)(PF_R | PF_W));
+		put(off + offsetof(Phdr, p_align), (decltype(Phdr().p_align))8);
+	}
+
+	void shdr(size_t off, uint32_t name, uint32_t type, uint64_t offset,
+		uint64_t size, uint32_t link, uint64_t entsize)
+	{
+		put(off + offsetof(Shdr, sh_name), name);
+		put(off + offsetof(Shdr, sh_type), type);
+		put(off + offsetof(Shdr, sh_flags), (decltype(Shdr().sh_flags))SHF_ALLOC);
+		put(off + offsetof(Shdr, sh_addr), (decltype(Shdr().sh_addr))offset);
+		put(off + offsetof(Shdr, sh_offset), (decltype(Shdr().sh_offset))offset);
+		put(off + offsetof(Shdr, sh_size), (decltype(Shdr().sh_size))size);
+		put(off + offsetof(Shdr, sh_link), link);
+		put(off + offsetof(Shdr, sh_addralign), (decltype(Shdr().sh_addralign))1);
+		put(off + offsetof(Shdr, sh_entsize), (decltype(Shdr().sh_entsize))entsize);
+	}
+
+	const ElfSpec& _spec;
+	vector<unsigned char> _out;
+	vector<char> _dynstr;
+};
+
+static void usage(const char *argv0)
+{
+	cerr << "usage: " << argv0 << " [-c class] [-d data] [-m machine] [-o osabi] [-t type] [-s soname] [-r rpath..] [-R runpath..] [-n needed..] out\n";
+	cerr << "\tclass and data are the EI_CLASS and EI_DATA numbers; an empty -n is an empty DT_NEEDED\n";
+}
+
+int main(int argc, char **argv)
+{
+	ElfSpec spec;
+	spec._class = ELFCLASS64;
+	spec._data = ELFDATA2LSB;
+	spec._osabi = ELFOSABI_SYSV;
+	spec._machine = EM_X86_64;
+	spec._type = ET_DYN;
+
+	int ch;
+	while ((ch = getopt(argc, argv, "c:d:m:o:t:s:r:R:n:")) != -1) {
+		switch (ch) {
+		case 'c':
+			spec._class = atoi(optarg);
+			break;
+		case 'd':
+			spec._data = atoi(optarg);
+			break;
+		case 'm':
+			spec._machine = atoi(optarg);
+			break;
+		case 'o':
+			spec._osabi = atoi(optarg);
+			break;
+		case 't':
+			spec._type = atoi(optarg);
+			break;
+		case 's':
+			spec._soname = optarg;
+			break;
+		case 'r':
+			spec._rpath.push_back(optarg);
+			break;
+		case 'R':
+			spec._runpath.push_back(optarg);
+			break;
+		case 'n':
+			spec._needed.push_back(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	vector<unsigned char> out;
+	if (spec._class == ELFCLASS32) {
+		out = ElfWriter<Elf32_Ehdr, Elf32_Phdr, Elf32_Shdr, Elf32_Dyn>(spec).write();
+	} else {
+		out = ElfWriter<Elf64_Ehdr, Elf64_Phdr, Elf64_Shdr, Elf64_Dyn>(spec).write();
+	}
+	ofstream file(argv[optind], ios::binary);
+	file.write((const char*)out.data(), out.size());
+	if (!file) {
+		cerr << argv[optind] << ": couldn't write\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,665 @@
+/*
+ * xpldd: where files come from, so resolution doesn't care if it's the host,
+ * a sysroot, or an archive
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <set>
+
+#include "vfs.h"
+
+using namespace std;
+
+extern "C" {
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <limits.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+}
+
+string vfs_join(const string& dir, const string& name)
+{
+	filesystem::path name_path(name);
+	filesystem::path dir_path(dir);
+	return dir_path / name_path;
+}
+
+bool vfs_split(const string& path, string& dir, string& name)
+{
+	size_t slash = path.rfind('/');
+	if (slash == string::npos || slash + 1 == path.size()) {
+		return false;
+	}
+	dir = slash == 0 ? "/" : path.substr(0, slash);
+	name = path.substr(slash + 1);
+	return true;
+}
+
+bool vfs_within(const string& path, const string& dir)
+{
+	if (path.compare(0, dir.size(), dir) != 0) {
+		return false;
+	}
+	return path.size() == dir.size() || (!dir.empty() && dir.back() == '/')
+		|| path[dir.size()] == '/';
+}
+
+// everything in a map keyed by path that's at or under path
+template <typename T>
+static void erase_within(map<string, T>& entries, const string& path,
+		const function<void(T&)>& drop = nullptr)
+{
+	auto iter = entries.lower_bound(path);
+	while (iter != entries.end() && iter->first.compare(0, path.size(), path) == 0) {
+		if (!vfs_within(iter->first, path)) {
+			// just a sibling sharing the start of the name
+			++iter;
+			continue;
+		}
+		if (drop) {
+			drop(iter->second);
+		}
+		iter = entries.erase(iter);
+	}
+}
+
+// symlinks followed in one walk before giving up, like ELOOP
+#define MAX_SYMLINK_HOPS 40
+
+static void split_path(const string& path, vector<string>& parts)
+{
+	size_t start = 0;
+	while (start <= path.size()) {
+		size_t slash = path.find('/', start);
+		if (slash == string::npos) {
+			slash = path.size();
+		}
+		parts.push_back(path.substr(start, slash - start));
+		start = slash + 1;
+	}
+}
+
+int vfs_walk(const string& path, const function<int(const string&, string&)>& step,
+		string& real)
+{
+	// components left to walk, in reverse so the next one is at the back
+	vector<string> todo;
+	split_path(path, todo);
+	reverse(todo.begin(), todo.end());
+
+	string cur, link;
+	int hops = 0;
+	while (!todo.empty()) {
+		string comp = todo.back();
+		todo.pop_back();
+		if (comp.empty() || comp == ".") {
+			continue;
+		} else if (comp == "..") {
+			// can't go above the root, same as a chroot
+			size_t slash = cur.rfind('/');
+			cur.resize(slash == string::npos ? 0 : slash);
+			continue;
+		}
+		string next = cur + "/" + comp;
+		int kind = step(next, link);
+		if (kind < 0) {
+			return -ENOENT;
+		} else if (kind == 0) {
+			cur = next;
+			continue;
+		}
+		if (++hops > MAX_SYMLINK_HOPS) {
+			return -ELOOP;
+		}
+		// splice the target in where the link was
+		if (!link.empty() && link[0] == '/') {
+			cur.clear();
+		}
+		vector<string> parts;
+		split_path(link, parts);
+		todo.insert(todo.end(), parts.rbegin(), parts.rend());
+	}
+	real = cur;
+	return 0;
+}
+
+int Vfs::lookup(const string& dir, const string& name, struct stat& st)
+{
+	return stat(vfs_join(dir, name), st);
+}
+
+int Vfs::readlink(const string&, string&)
+{
+	return -EINVAL;
+}
+
+void Vfs::lookup_many(vector<VfsLookup>& lookups)
+{
+	for (auto& req : lookups) {
+		req._result = lookup(req._dir, req._name, req._st);
+	}
+}
+
+void Vfs::open_many(const vector<string>& paths, vector<VfsFile*>& files)
+{
+	files.clear();
+	for (auto& path : paths) {
+		files.push_back(open(path));
+	}
+}
+
+void Vfs::advise_many(vector<VfsRange>&)
+{
+}
+
+void Vfs::read_many(vector<VfsRange>& ranges)
+{
+	for (auto& range : ranges) {
+		range._buf.resize(range._length);
+		range._result = range._file->read(range._offset, range._buf.data(), range._length);
+		range._buf.resize(range._result >= 0 ? range._result : 0);
+	}
+}
+
+void Vfs::close_many(vector<VfsFile*>& files)
+{
+	for (auto file : files) {
+		delete file;
+	}
+	files.clear();
+}
+
+class HostFile : public VfsFile {
+public:
+	HostFile(int fd) : _fd(fd), _map(MAP_FAILED), _size(0), _have_size(false) {}
+	~HostFile()
+	{
+		if (_map != MAP_FAILED) {
+			munmap(_map, _size);
+		}
+		if (_fd != -1) {
+			close(_fd);
+		}
+	}
+
+	uint64_t size()
+	{
+		struct stat st;
+		if (!_have_size && fstat(_fd, &st) == 0) {
+			_size = st.st_size;
+			_have_size = true;
+		}
+		return _size;
+	}
+	ssize_t read(uint64_t offset, void *buf, size_t length)
+	{
+		ssize_t ret = pread(_fd, buf, length, offset);
+		return ret >= 0 ? ret : -errno;
+	}
+	const unsigned char *map(uint64_t offset, size_t length)
+	{
+		if (offset > size() || length > _size - offset) {
+			return nullptr;
+		}
+		// the whole file, once; pages only come in as they're touched
+		if (_map == MAP_FAILED && _size != 0) {
+			_map = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+		}
+		return _map == MAP_FAILED ? nullptr : (const unsigned char*)_map + offset;
+	}
+	int fd() { return _fd; }
+
+	int _fd;
+	void *_map;
+	uint64_t _size;
+	bool _have_size;
+};
+
+HostVfs::HostVfs(const string& prefix, IoEngine *io)
+	: _prefix(prefix), _io(io), _root_fd(-1)
+{
+	if (prefix.empty()) {
+		return;
+	}
+	_root_fd = ::open(prefix.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (_root_fd == -1) {
+		return;
+	}
+	// without openat2, we can only fall back to host paths under the
+	// prefix like we always have
+	int fd = openat2_resolve(_root_fd, ".", O_PATH | O_CLOEXEC, RESOLVE_IN_ROOT);
+	if (fd == -1) {
+		close(_root_fd);
+		_root_fd = -1;
+		return;
+	}
+	close(fd);
+}
+
+HostVfs::~HostVfs()
+{
+	for (auto iter = _dir_fds.begin(); iter != _dir_fds.end(); ++iter) {
+		if (iter->second != -1) {
+			close(iter->second);
+		}
+	}
+	if (_root_fd != -1) {
+		close(_root_fd);
+	}
+}
+
+// If path is under the prefix and it's open, gets the path relative to it.
+bool HostVfs::in_root(const string& path, string& rel)
+{
+	if (_root_fd == -1 || path.compare(0, _prefix.size(), _prefix) != 0) {
+		return false;
+	}
+	rel = path.substr(_prefix.size());
+	if (rel.empty()) {
+		rel = ".";
+	} else if (rel[0] != '/' && _prefix.back() != '/') {
+		// just a sibling sharing the start of the name
+		return false;
+	}
+	return true;
+}
+
+void HostVfs::fill_open(IoRequest& req, const string& path)
+{
+	string rel;
+	if (in_root(path, rel)) {
+		req._dirfd = _root_fd;
+		req._path = rel;
+		req._resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+	} else {
+		req._dirfd = AT_FDCWD;
+		req._path = path;
+		req._resolve = 0;
+	}
+}
+
+int HostVfs::dir_fd(const string& dir)
+{
+	auto iter = _dir_fds.find(dir);
+	if (iter != _dir_fds.end()) {
+		return iter->second;
+	}
+	int fd;
+	string rel;
+	if (in_root(dir, rel)) {
+		fd = openat2_resolve(_root_fd, rel.c_str(),
+			O_PATH | O_DIRECTORY | O_CLOEXEC, RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS);
+	} else {
+		fd = ::open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	}
+	return _dir_fds[dir] = fd;
+}
+
+// Opens every search directory a batch of lookups needs that isn't open
+// yet as a batch of its own, so a directory that hangs only holds things up
+// for as long as the I/O engine will wait on it.
+void HostVfs::open_dirs(const vector<VfsLookup>& lookups)
+{
+	vector<IoRequest> batch;
+	vector<string> dirs;
+	set<string> asked;
+	for (auto& lookup : lookups) {
+		const string& dir = lookup._dir;
+		if (_dir_fds.count(dir) || !asked.insert(dir).second) {
+			continue;
+		}
+		IoRequest req(IO_OPEN_DIR);
+		fill_open(req, dir);
+		batch.push_back(req);
+		dirs.push_back(dir);
+	}
+	if (batch.empty()) {
+		return;
+	}
+	_io->submit(batch);
+	for (size_t i = 0; i < batch.size(); i++) {
+		_dir_fds[dirs[i]] = batch[i]._result >= 0 ? batch[i]._result : -1;
+		if (batch[i]._result == -ETIMEDOUT) {
+			stall(dirs[i]);
+		}
+	}
+}
+
+void HostVfs::forget(const string& path)
+{
+	auto drop = [](int& fd) {
+		if (fd != -1) {
+			close(fd);
+		}
+	};
+	erase_within<int>(_dir_fds, path, drop);
+	string dir, name;
+	auto iter = vfs_split(path, dir, name) ? _dir_fds.find(dir) : _dir_fds.end();
+	if (iter != _dir_fds.end()) {
+		drop(iter->second);
+		_dir_fds.erase(iter);
+	}
+}
+
+void HostVfs::stall(const string& dir)
+{
+	if (_stalled.insert(dir).second) {
+		cerr << dir << ": timed out, not searching it again\n";
+	}
+}
+
+// Sets up a probe for name relative to its search directory. Returns false
+// if the directory doesn't exist (or stalled), so there's nothing to probe.
+bool HostVfs::fill_probe(IoRequest& req, const string& dir, const string& name)
+{
+	if (_stalled.count(dir)) {
+		return false;
+	}
+	req._dirfd = dir_fd(dir);
+	req._path = name;
+	// a symlink pointing out of the directory fails with EXDEV, and
+	// finish_probe walks it again from the root of the prefix
+	req._resolve = _root_fd != -1 ? RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS : 0;
+	return req._dirfd != -1;
+}
+
+int HostVfs::finish_probe(IoRequest& req, const string& dir, const string& name)
+{
+	if (req._result == -EXDEV) {
+		fill_open(req, vfs_join(dir, name));
+		run_request(req);
+	}
+	return req._result;
+}
+
+int HostVfs::stat(const string& path, struct stat& st)
+{
+	IoRequest req(IO_STAT);
+	fill_open(req, path);
+	run_request(req);
+	st = req._st;
+	return req._result;
+}
+
+int HostVfs::lookup(const string& dir, const string& name, struct stat& st)
+{
+	IoRequest req(IO_STAT);
+	if (!fill_probe(req, dir, name)) {
+		return -ENOENT;
+	}
+	run_request(req);
+	int ret = finish_probe(req, dir, name);
+	st = req._st;
+	return ret;
+}
+
+VfsFile *HostVfs::open(const string& path)
+{
+	IoRequest req(IO_OPEN);
+	fill_open(req, path);
+	run_request(req);
+	if (req._result < 0) {
+		errno = -req._result;
+		return nullptr;
+	}
+	return new HostFile(req._result);
+}
+
+int HostVfs::list(const string& dir, vector<string>& names)
+{
+	int pathfd = dir_fd(dir);
+	if (pathfd == -1) {
+		return -ENOENT;
+	}
+	// an O_PATH descriptor can't be read from, so open it for real
+	int fd = openat(pathfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DIR *d = fd == -1 ? nullptr : fdopendir(fd);
+	if (d == nullptr) {
+		int ret = -errno;
+		if (fd != -1) {
+			close(fd);
+		}
+		return ret;
+	}
+	names.clear();
+	struct dirent *ent;
+	while ((ent = readdir(d)) != nullptr) {
+		if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
+			names.push_back(ent->d_name);
+		}
+	}
+	closedir(d);
+	sort(names.begin(), names.end());
+	return 0;
+}
+
+int HostVfs::readlink(const string& path, string& target)
+{
+	string dir, name;
+	int fd;
+	if (!vfs_split(path, dir, name) || (fd = dir_fd(dir)) == -1) {
+		return -ENOENT;
+	}
+	char buf[PATH_MAX];
+	ssize_t len = readlinkat(fd, name.c_str(), buf, sizeof(buf));
+	if (len == -1) {
+		return -errno;
+	}
+	target.assign(buf, len);
+	return 0;
+}
+
+void HostVfs::lookup_many(vector<VfsLookup>& lookups)
+{
+	open_dirs(lookups);
+	vector<IoRequest> batch;
+	vector<size_t> owners;
+	for (size_t i = 0; i < lookups.size(); i++) {
+		IoRequest req(IO_STAT);
+		if (!fill_probe(req, lookups[i]._dir, lookups[i]._name)) {
+			lookups[i]._result = -ENOENT;
+			continue;
+		}
+		batch.push_back(req);
+		owners.push_back(i);
+	}
+	_io->submit(batch);
+	for (size_t i = 0; i < batch.size(); i++) {
+		VfsLookup& lookup = lookups[owners[i]];
+		if (batch[i]._result == -ETIMEDOUT) {
+			stall(lookup._dir);
+		}
+		lookup._result = finish_probe(batch[i], lookup._dir, lookup._name);
+		lookup._st = batch[i]._st;
+	}
+}
+
+void HostVfs::open_many(const vector<string>& paths, vector<VfsFile*>& files)
+{
+	vector<IoRequest> batch;
+	for (auto& path : paths) {
+		IoRequest req(IO_OPEN);
+		fill_open(req, path);
+		batch.push_back(req);
+	}
+	_io->submit(batch);
+	files.clear();
+	for (auto& req : batch) {
+		files.push_back(req._result >= 0 ? new HostFile(req._result) : nullptr);
+	}
+}
+
+void HostVfs::advise_many(vector<VfsRange>& ranges)
+{
+	vector<IoRequest> batch;
+	for (auto& range : ranges) {
+		IoRequest req(IO_ADVISE);
+		req._fd = range._file->fd();
+		req._offset = range._offset;
+		req._length = range._length;
+		batch.push_back(req);
+	}
+	_io->submit(batch);
+	for (size_t i = 0; i < batch.size(); i++) {
+		ranges[i]._result = batch[i]._result;
+	}
+}
+
+void HostVfs::read_many(vector<VfsRange>& ranges)
+{
+	vector<IoRequest> batch;
+	for (auto& range : ranges) {
+		IoRequest req(IO_READ);
+		req._fd = range._file->fd();
+		req._offset = range._offset;
+		req._length = range._length;
+		batch.push_back(req);
+	}
+	_io->submit(batch);
+	for (size_t i = 0; i < batch.size(); i++) {
+		ranges[i]._result = batch[i]._result;
+		ranges[i]._buf = move(batch[i]._buf);
+	}
+}
+
+void HostVfs::close_many(vector<VfsFile*>& files)
+{
+	vector<IoRequest> batch;
+	for (auto file : files) {
+		HostFile *host = (HostFile*)file;
+		if (host != nullptr && host->_fd != -1) {
+			IoRequest req(IO_CLOSE);
+			req._fd = host->_fd;
+			batch.push_back(req);
+			// the engine closes it, not the destructor
+			host->_fd = -1;
+		}
+	}
+	_io->submit(batch);
+	Vfs::close_many(files);
+}
+
+int CachingVfs::stat(const string& path, struct stat& st)
+{
+	auto iter = _stats.find(path);
+	if (iter == _stats.end()) {
+		Stat& entry = _stats[path];
+		entry._result = _inner->stat(path, entry._st);
+		iter = _stats.find(path);
+	}
+	st = iter->second._st;
+	return iter->second._result;
+}
+
+int CachingVfs::lookup(const string& dir, const string& name, struct stat& st)
+{
+	// a lookup ends up at the same file as stat on the joined path, so
+	// they share the cache
+	string path = vfs_join(dir, name);
+	auto iter = _stats.find(path);
+	if (iter == _stats.end()) {
+		Stat& entry = _stats[path];
+		entry._result = _inner->lookup(dir, name, entry._st);
+		iter = _stats.find(path);
+	}
+	st = iter->second._st;
+	return iter->second._result;
+}
+
+VfsFile *CachingVfs::open(const string& path)
+{
+	// no need to ask about something we know isn't there
+	auto iter = _stats.find(path);
+	if (iter != _stats.end() && iter->second._result < 0) {
+		errno = -iter->second._result;
+		return nullptr;
+	}
+	return _inner->open(path);
+}
+
+int CachingVfs::list(const string& dir, vector<string>& names)
+{
+	auto iter = _dirs.find(dir);
+	if (iter == _dirs.end()) {
+		Listing& entry = _dirs[dir];
+		entry._result = _inner->list(dir, entry._names);
+		iter = _dirs.find(dir);
+	}
+	names = iter->second._names;
+	return iter->second._result;
+}
+
+int CachingVfs::readlink(const string& path, string& target)
+{
+	// only bundling asks, and only once per file
+	return _inner->readlink(path, target);
+}
+
+void CachingVfs::lookup_many(vector<VfsLookup>& lookups)
+{
+	vector<VfsLookup> misses;
+	vector<size_t> owners;
+	set<string> asked;
+	for (size_t i = 0; i < lookups.size(); i++) {
+		string path = vfs_join(lookups[i]._dir, lookups[i]._name);
+		auto iter = _stats.find(path);
+		if (iter != _stats.end()) {
+			lookups[i]._result = iter->second._result;
+			lookups[i]._st = iter->second._st;
+			continue;
+		}
+		// a name can come up twice in one batch; ask once
+		if (asked.insert(path).second) {
+			misses.push_back(lookups[i]);
+		}
+		owners.push_back(i);
+	}
+	_inner->lookup_many(misses);
+	for (auto& miss : misses) {
+		Stat& entry = _stats[vfs_join(miss._dir, miss._name)];
+		entry._result = miss._result;
+		entry._st = miss._st;
+	}
+	for (auto i : owners) {
+		Stat& entry = _stats[vfs_join(lookups[i]._dir, lookups[i]._name)];
+		lookups[i]._result = entry._result;
+		lookups[i]._st = entry._st;
+	}
+}
+
+void CachingVfs::open_many(const vector<string>& paths, vector<VfsFile*>& files)
+{
+	_inner->open_many(paths, files);
+}
+
+void CachingVfs::advise_many(vector<VfsRange>& ranges)
+{
+	_inner->advise_many(ranges);
+}
+
+void CachingVfs::read_many(vector<VfsRange>& ranges)
+{
+	_inner->read_many(ranges);
+}
+
+void CachingVfs::close_many(vector<VfsFile*>& files)
+{
+	_inner->close_many(files);
+}
+
+void CachingVfs::forget(const string& path)
+{
+	erase_within(_stats, path);
+	erase_within(_dirs, path);
+	string dir, name;
+	if (vfs_split(path, dir, name)) {
+		_dirs.erase(dir);
+	}
+	_inner->forget(path);
+}
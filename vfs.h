@@ -0,0 +1,200 @@
+/*
+ * xpldd: where files come from, so resolution doesn't care if it's the host,
+ * a sysroot, or an archive
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_VFS_H
+#define XPLDD_VFS_H
+
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ioengine.h"
+
+extern "C" {
+	#include <stdint.h>
+	#include <sys/stat.h>
+	#include <sys/types.h>
+}
+
+// An open file. Deleting it closes it.
+class VfsFile {
+public:
+	virtual ~VfsFile() {}
+	virtual uint64_t size() = 0;
+	// like pread; returns bytes read, or -errno
+	virtual ssize_t read(uint64_t offset, void *buf, size_t length) = 0;
+	// the whole of [offset, offset + length) in memory, valid until the
+	// file is closed; nullptr if it can't be had
+	virtual const unsigned char *map(uint64_t offset, size_t length) = 0;
+	// a real descriptor for libelf, or -1 if the file doesn't have one
+	virtual int fd() { return -1; }
+};
+
+// One name to look up in a search directory, for lookup_many.
+class VfsLookup {
+public:
+	VfsLookup(const std::string& dir, const std::string& name)
+		: _dir(dir), _name(name), _result(0) {}
+
+	std::string _dir, _name;
+	// results; 0 or -errno, and _st follows symlinks
+	int _result;
+	struct stat _st;
+};
+
+// A range of an open file, for advise_many and read_many.
+class VfsRange {
+public:
+	VfsRange(VfsFile *file, uint64_t offset, size_t length)
+		: _file(file), _offset(offset), _length(length), _result(0) {}
+
+	VfsFile *_file;
+	uint64_t _offset;
+	size_t _length;
+	// results; bytes read or -errno, and what was read
+	ssize_t _result;
+	std::vector<unsigned char> _buf;
+};
+
+// Paths are whatever resolution came up with (-P prefix included), and a
+// backend decides what they mean. Errors are -errno, like the I/O engine.
+//
+// The *_many calls are for a whole frontier of libraries at once; by
+// default they just loop, but a backend can do better (i.e. the host hands
+// them to the I/O engine).
+class Vfs {
+public:
+	virtual ~Vfs() {}
+	virtual int stat(const std::string& path, struct stat& st) = 0;
+	// stats name in a search directory, like the loader probing it
+	virtual int lookup(const std::string& dir, const std::string& name, struct stat& st);
+	// nullptr with errno set if it can't be opened
+	virtual VfsFile *open(const std::string& path) = 0;
+	// the names in a directory, sorted
+	virtual int list(const std::string& dir, std::vector<std::string>& names) = 0;
+	// where path points if it's a symlink itself (the directories up to it
+	// are followed); -EINVAL if it isn't one
+	virtual int readlink(const std::string& path, std::string& target);
+
+	virtual void lookup_many(std::vector<VfsLookup>& lookups);
+	// files[i] is nullptr where paths[i] couldn't be opened
+	virtual void open_many(const std::vector<std::string>& paths,
+		std::vector<VfsFile*>& files);
+	// hints that the ranges will be read soon
+	virtual void advise_many(std::vector<VfsRange>& ranges);
+	virtual void read_many(std::vector<VfsRange>& ranges);
+	// closes (deletes) every file, skipping nullptr
+	virtual void close_many(std::vector<VfsFile*>& files);
+
+	// drops anything remembered about path (and the listing of the
+	// directory it's in), since it changed; for a directory, that's
+	// everything under it too
+	virtual void forget(const std::string&) {}
+};
+
+// the path of name in dir, the same way every caller spells it
+std::string vfs_join(const std::string& dir, const std::string& name);
+// path without its last component, and that component; false for the root
+bool vfs_split(const std::string& path, std::string& dir, std::string& name);
+// if path is dir, or somewhere under it
+bool vfs_within(const std::string& path, const std::string& dir);
+
+// Walks an absolute path one component at a time over an index of paths,
+// like the kernel would in a chroot of it. step(next, link) is given each
+// symlink-free path along the way and returns -1 if it isn't there, 1 if
+// it's a symlink (setting link), or 0 otherwise. On success, real is the
+// path with every symlink gone ("" for the root); returns 0 or -errno.
+int vfs_walk(const std::string& path,
+	const std::function<int(const std::string&, std::string&)>& step,
+	std::string& real);
+
+// The host's files, with an optional prefix treated as the root of a chroot
+// (needs openat2 for symlinks to resolve inside it). Batches go through io,
+// which the caller still owns.
+class HostVfs : public Vfs {
+public:
+	HostVfs(const std::string& prefix, IoEngine *io);
+	~HostVfs();
+
+	int stat(const std::string& path, struct stat& st);
+	int lookup(const std::string& dir, const std::string& name, struct stat& st);
+	VfsFile *open(const std::string& path);
+	int list(const std::string& dir, std::vector<std::string>& names);
+	int readlink(const std::string& path, std::string& target);
+
+	void lookup_many(std::vector<VfsLookup>& lookups);
+	void open_many(const std::vector<std::string>& paths, std::vector<VfsFile*>& files);
+	void advise_many(std::vector<VfsRange>& ranges);
+	void read_many(std::vector<VfsRange>& ranges);
+	void close_many(std::vector<VfsFile*>& files);
+
+	// closes the search directories at or under path, or that it's in,
+	// so one that was removed (or never there) is opened again next time;
+	// an open one would keep a removed directory's inode around, and
+	// inotify wouldn't say it was gone
+	void forget(const std::string& path);
+
+private:
+	bool in_root(const std::string& path, std::string& rel);
+	void fill_open(IoRequest& req, const std::string& path);
+	bool fill_probe(IoRequest& req, const std::string& dir, const std::string& name);
+	int finish_probe(IoRequest& req, const std::string& dir, const std::string& name);
+	int dir_fd(const std::string& dir);
+	void open_dirs(const std::vector<VfsLookup>& lookups);
+	void stall(const std::string& dir);
+
+	std::string _prefix;
+	IoEngine *_io;
+	// the prefix and search directories, opened once so lookups don't
+	// walk the whole path each time
+	int _root_fd;
+	std::map<std::string, int> _dir_fds;
+	// search directories that timed out (i.e. a hung mount), which
+	// aren't probed again
+	std::set<std::string> _stalled;
+};
+
+// Remembers what another backend said about paths and directories, so each
+// is only asked about once. Takes ownership of the backend.
+class CachingVfs : public Vfs {
+public:
+	CachingVfs(Vfs *inner) : _inner(inner) {}
+	~CachingVfs() { delete _inner; }
+
+	int stat(const std::string& path, struct stat& st);
+	int lookup(const std::string& dir, const std::string& name, struct stat& st);
+	VfsFile *open(const std::string& path);
+	int list(const std::string& dir, std::vector<std::string>& names);
+	int readlink(const std::string& path, std::string& target);
+
+	void lookup_many(std::vector<VfsLookup>& lookups);
+	void open_many(const std::vector<std::string>& paths, std::vector<VfsFile*>& files);
+	void advise_many(std::vector<VfsRange>& ranges);
+	void read_many(std::vector<VfsRange>& ranges);
+	void close_many(std::vector<VfsFile*>& files);
+
+	void forget(const std::string& path);
+
+private:
+	class Stat {
+	public:
+		int _result;
+		struct stat _st;
+	};
+	class Listing {
+	public:
+		int _result;
+		std::vector<std::string> _names;
+	};
+
+	Vfs *_inner;
+	std::map<std::string, Stat> _stats;
+	std::map<std::string, Listing> _dirs;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * xpldd: watching the directories resolution looked in, for --watch
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#include <cerrno>
+#include <cstring>
+#include <set>
+
+#include "vfs.h"
+#include "watch.h"
+
+using namespace std;
+
+extern "C" {
+	#include <poll.h>
+	#include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+	#include <sys/inotify.h>
+#endif
+}
+
+// how long things have to stay quiet before a batch is handed back, and
+// the longest a batch waits for that
+#define WATCH_SETTLE_MS 100
+#define WATCH_MAX_SETTLE_MS 2000
+
+DirWatch::~DirWatch()
+{
+	if (_fd != -1) {
+		close(_fd);
+	}
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+bool DirWatch::open(string& error)
+{
+	if ((_fd = inotify_init1(IN_CLOEXEC)) == -1) {
+		error = string("inotify: ") + strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+bool DirWatch::watch(const string& dir)
+{
+	// a file being written counts once it's closed, not per write; the
+	// directory itself going away (or being renamed, i.e. a new one
+	// swapped in) means it has to be watched again
+	uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+		| IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+	int wd = inotify_add_watch(_fd, dir.empty() ? "." : dir.c_str(), mask);
+	if (wd == -1) {
+		return false;
+	}
+	_watches[dir] = wd;
+	_dirs[wd].push_back(dir);
+	return true;
+}
+
+bool DirWatch::add(const string& dir)
+{
+	// it might already be watched as a stand-in for one of these
+	_wanted.insert(dir);
+	if (_watches.count(dir)) {
+		return true;
+	}
+	if (watch(dir)) {
+		if (_pending.erase(dir)) {
+			_appeared.push_back(dir);
+		}
+		return true;
+	}
+	_pending.insert(dir);
+	// it can only turn up in its parent, so watch the nearest one there is
+	string path = dir, parent, name;
+	while (vfs_split(path, parent, name)) {
+		if (_watches.count(parent) || watch(parent)) {
+			break;
+		}
+		path = parent;
+	}
+	return false;
+}
+
+// Reads whatever events are queued into changed; false on error.
+bool DirWatch::read_events(set<string>& changed, bool& overflow)
+{
+	alignas(struct inotify_event) char buf[64 * 1024];
+	ssize_t got = read(_fd, buf, sizeof(buf));
+	if (got == -1) {
+		return errno == EINTR || errno == EAGAIN;
+	}
+	for (ssize_t off = 0; off < got; ) {
+		const struct inotify_event *event = (const struct inotify_event*)(buf + off);
+		off += sizeof(struct inotify_event) + event->len;
+		if (event->mask & IN_Q_OVERFLOW) {
+			overflow = true;
+			continue;
+		}
+		auto dir = _dirs.find(event->wd);
+		if (dir == _dirs.end()) {
+			continue;
+		}
+		if (event->mask & IN_MOVE_SELF) {
+			// still watching it under its new name, which isn't
+			// ours; IN_IGNORED follows
+			inotify_rm_watch(_fd, event->wd);
+		}
+		if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+			for (auto& name : dir->second) {
+				changed.insert(name);
+			}
+		}
+		if (event->mask & IN_IGNORED) {
+			// gone, so it's wanted again like one that never was; a
+			// parent that only stood in for one isn't, since the next
+			// add finds whatever parent is there now
+			for (auto& name : dir->second) {
+				_watches.erase(name);
+				if (_wanted.count(name)) {
+					_pending.insert(name);
+				}
+			}
+			_dirs.erase(dir);
+			continue;
+		}
+		if (event->len == 0) {
+			continue;
+		}
+		// a directory coming or going (i.e. a search directory removed
+		// and made again) counts too
+		for (auto& name : dir->second) {
+			changed.insert(vfs_join(name, event->name));
+		}
+	}
+	return true;
+}
+
+bool DirWatch::wait(vector<string>& changed, bool& overflow, string& error)
+{
+	set<string> paths;
+	overflow = false;
+	if (!_appeared.empty()) {
+		// nothing was watching these until now
+		changed = _appeared;
+		_appeared.clear();
+		return true;
+	}
+	struct pollfd pfd = { _fd, POLLIN, 0 };
+	// block for the first event, then take more until it goes quiet
+	int timeout = -1, waited = 0;
+	while (true) {
+		int ready = poll(&pfd, 1, timeout);
+		if (ready == -1 && errno == EINTR) {
+			continue;
+		} else if (ready == -1) {
+			error = string("poll: ") + strerror(errno);
+			return false;
+		} else if (ready == 0) {
+			break;
+		}
+		if (!read_events(paths, overflow)) {
+			error = string("inotify: ") + strerror(errno);
+			return false;
+		}
+		if (paths.empty() && !overflow) {
+			// nothing we're watching for
+			continue;
+		}
+		if (timeout != -1 && (waited += WATCH_SETTLE_MS) >= WATCH_MAX_SETTLE_MS) {
+			break;
+		}
+		timeout = WATCH_SETTLE_MS;
+	}
+	changed.assign(paths.begin(), paths.end());
+	return true;
+}
+#else
+bool DirWatch::open(string& error)
+{
+	error = "--watch needs inotify, which isn't available here";
+	return false;
+}
+
+bool DirWatch::add(const string&)
+{
+	return false;
+}
+
+bool DirWatch::wait(vector<string>&, bool&, string& error)
+{
+	error = "--watch needs inotify, which isn't available here";
+	return false;
+}
+#endif
@@ -0,0 +1,58 @@
+/*
+ * xpldd: watching the directories resolution looked in, for --watch
+ *
+ * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
+ */
+#ifndef XPLDD_WATCH_H
+#define XPLDD_WATCH_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Directories watched with inotify. Paths that change come back joined to
+// the directory as it was given to add, so they're spelled the same way
+// resolution spelled them.
+class DirWatch {
+public:
+	DirWatch() : _fd(-1) {}
+	~DirWatch();
+	DirWatch(const DirWatch&) = delete;
+	DirWatch& operator=(const DirWatch&) = delete;
+
+	// false with error set if there's no inotify
+	bool open(std::string& error);
+	// watches dir ("" for the current one), if it isn't already. If it
+	// doesn't exist, the nearest parent that does is watched instead, and
+	// it's tried again on the next add; once it's there, the next wait
+	// reports it as changed, since it could have been filled in already.
+	// false if dir itself isn't watched.
+	bool add(const std::string& dir);
+	// Waits for a file to be created, removed, renamed, or written in any
+	// watched directory, then for things to settle for a moment (so a
+	// whole rebuild comes back as one batch), and sets changed to every
+	// path touched, directories included (a watched one that's removed
+	// or renamed away comes back as itself). overflow is set if the kernel dropped events, in which
+	// case anything could have changed. false with error set if the
+	// events can't be read.
+	bool wait(std::vector<std::string>& changed, bool& overflow, std::string& error);
+
+private:
+	bool watch(const std::string& dir);
+	bool read_events(std::set<std::string>& changed, bool& overflow);
+
+	int _fd;
+	// the same directory can be given by more than one name, but it's one
+	// watch as far as the kernel cares
+	std::map<int, std::vector<std::string>> _dirs;
+	std::map<std::string, int> _watches;
+	// everything given to add, as opposed to parents watched for them
+	std::set<std::string> _wanted;
+	// directories asked for that aren't there (or went away), and ones
+	// that have turned up since
+	std::set<std::string> _pending;
+	std::vector<std::string> _appeared;
+};
+
+#endif
@@ -3,6 +3,12 @@
  *
  * Copyright (C) 2020 Calvin Buckley; licensed under the GPLv3
  */
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <iostream>
 #include <map>
@@ -10,244 +16,686 @@
 #include <string>
 #include <vector>
 
+#include "bundle.h"
+#include "graph.h"
+#include "hash.h"
+#include "ioengine.h"
+#include "resolver.h"
+#include "vfs.h"
+#include "watch.h"
+
 using namespace std;
 
 extern "C" {
 	// getopt, open/close
 	#include <fcntl.h>
+	#include <getopt.h>
 	#include <unistd.h>
-	// libelf
-	#include <libelf.h>
-	#include <gelf.h>
 }
 
-class Binary {
-public:
-	string _name;
-	vector<string> _depends;
-	vector<string> _rpath;
-	//string _interp;
-	bool _resolved;
-};
-
-class XplddState {
+// The resolver, and what to do with what it finds.
+class XplddState : public Resolver {
 	// who needs getters and setters?
 public:
 	// defaults
 	XplddState() {
-		_prefix = "";
-		_recurse = true;
-		_recurse = true;
 		_tree = false;
+		_load_order = false;
+		_fingerprint = false;
+		_bundle_links = false;
+		_watch = false;
+		_why_all = false;
 
 		_done = _failed = 0;
 	}
 
 	// configuration passed on args
-	string _prefix;
-	vector<string> _orig_rpath;
-	bool _recurse, _tree;
-	// stuff we track
-	map<string, Binary*> _found_binaries;
+	bool _tree, _load_order, _fingerprint;
+	// --watch keeps the closures up to date, printing changes as NDJSON
+	bool _watch;
+	// --why lists how the roots come to need this, every shortest way
+	// with --all-paths
+	std::string _why;
+	bool _why_all;
+	// --diff sides, and where --save writes the graph
+	std::vector<std::string> _diff;
+	std::string _save_path;
+	// --bundle copies everything resolved here, keeping soname symlinks
+	// as symlinks with --bundle-symlinks
+	std::string _bundle_dir;
+	bool _bundle_links;
 	int _done, _failed;
 };
 
 static void usage(string argv0)
 {
-	cerr << "usage: " << argv0 << " [-nt] [-P path_prefix] [-R rpath_entry..] [elf..]\n";
+	cerr << "usage: " << argv0 << " [-nt] [-A archive] [-I io_engine] [-P path_prefix] [-R rpath_entry..] [--load-order | --fingerprint | --why lib [--all-paths]] [--bundle dir [--bundle-symlinks]] [--diff side..] [--save file] [--cache file] [--timeout ms] [--soname-index] [--watch] [elf..]\n";
 	cerr << "\t-n: no recursion (optional)\n";
 	cerr << "\t-t: show dependencies in a tree (optional)\n";
 	cerr << "\t-R rpath_entry: add rpath entry (optional, useful if binaries lack them)\n";
 	cerr << "\t-P path_prefix: string to prefix rpaths with before resolution (optional, useful for chroots)\n";
+	cerr << "\t\tmore than one stacks them as overlay layers, lowest first\n";
+	cerr << "\t-A archive: look everything up inside a tar or cpio archive (optional)\n";
+	cerr << "\t-I io_engine: auto, uring, threads, or sync (optional, default auto)\n";
+	cerr << "\t--load-order: list dependencies in the order the loader would load them (optional)\n";
+	cerr << "\t--fingerprint: print a hash of the contents of everything each program needs (optional)\n";
+	cerr << "\t--why lib: show the shortest chain of libraries through which each program needs lib (optional)\n";
+	cerr << "\t--all-paths: show every shortest chain for --why, not just the first (optional)\n";
+	cerr << "\t--bundle dir: copy the programs and everything they need into dir (optional)\n";
+	cerr << "\t--bundle-symlinks: keep soname symlinks as symlinks in the bundle (optional)\n";
+	cerr << "\t--diff side: compare against a sysroot, archive, or saved graph (optional, once or twice)\n";
+	cerr << "\t--save file: save the resolved graph for a later --diff (optional)\n";
+	cerr << "\t--cache file: share parsed libraries with other xpldd processes through file (optional)\n";
+	cerr << "\t--timeout ms: give up on a search directory after a lookup in it takes this long (optional)\n";
+	cerr << "\t--soname-index: also find libraries by DT_SONAME, and point out mismatches (optional)\n";
+	cerr << "\t--watch: keep going, printing closures as JSON lines when files they need change (optional)\n";
 	cerr << "and takes at least one ELF file to operate on\n";
 }
 
-static string resolve_symbol(string& name, vector<string>& rpaths, string& prefix)
+static void report_cycles(vector<int>& reached, XplddState& state)
 {
-	if (name[0] == '/') {
-		return name;
+	for (auto id : reached) {
+		Component& component = state._components[id];
+		if (!component._cycle || component._reported) {
+			continue;
+		}
+		component._reported = true;
+		vector<string> names;
+		for (auto member : component._members) {
+			names.push_back(member->_name);
+		}
+		sort(names.begin(), names.end());
+		cerr << "dependency cycle:";
+		for (auto& name : names) {
+			cerr << " " << name;
+		}
+		cerr << "\n";
 	}
-	for (size_t i = 0; i < rpaths.size(); i++) {
-		filesystem::path name_path(name);
-		filesystem::path dir_path(prefix + rpaths[i]);
-		auto full_path = dir_path / name_path;
-		if (filesystem::exists(full_path)) {
-			return full_path;
+}
+
+static void print_flat_deps(Binary* binary, XplddState& state)
+{
+	vector<string> all_deps;
+	state.closure(binary->_name, all_deps);
+	for (auto iter = all_deps.begin(); iter != all_deps.end(); ++iter) {
+		cout << "\t" << *iter << "\n";
+	}
+	vector<int> reached;
+	state.components(binary, reached);
+	report_cycles(reached, state);
+}
+
+static void print_tree_line(const string& name, int depth, const char *suffix)
+{
+	for (int i = 0; i < depth; i++) {
+		cout << "\t";
+	}
+	cout << name << suffix << "\n";
+}
+
+// Each edge into another component is followed like before; inside a cycle,
+// the members are followed until one already printed on the way in, which
+// is marked instead of followed again. Walked with an explicit stack, like
+// find_components, so a long chain of libraries can't run out of ours;
+// each frame has what's been printed since coming into its binary's
+// component, if it's a cycle (an index into cycles, or -1).
+static void print_tree_deps(Binary* root, XplddState& state)
+{
+	class Frame {
+	public:
+		Binary *_binary;
+		int _depth;
+		size_t _next;
+		int _cycle;
+	};
+	vector<set<Binary*>> cycles(1);
+	cycles[0].insert(root);
+	vector<Frame> frames;
+	frames.push_back({ root, 0, 0, 0 });
+	while (!frames.empty()) {
+		Frame& frame = frames.back();
+		if (frame._next == frame._binary->_depends.size()) {
+			frames.pop_back();
+			continue;
+		}
+		// frame goes away once anything is pushed
+		Binary *binary = frame._binary;
+		int depth = frame._depth + 1, cycle = frame._cycle;
+		Binary* next = state.find(binary->_depends[frame._next++]);
+		if (next == nullptr) {
+			continue;
+		} else if (next->_component != binary->_component) {
+			int entered = -1;
+			if (state._components[next->_component]._cycle) {
+				entered = cycles.size();
+				cycles.push_back(set<Binary*>());
+				cycles.back().insert(next);
+			}
+			print_tree_line(next->_name, depth, "");
+			frames.push_back({ next, depth, 0, entered });
+		} else if (cycles[cycle].insert(next).second) {
+			print_tree_line(next->_name, depth, "");
+			frames.push_back({ next, depth, 0, cycle });
+		} else {
+			print_tree_line(next->_name, depth, " (cycle)");
 		}
 	}
-	return name;
 }
 
-static bool handle_dynamic(Elf *e, Elf_Scn *scn, GElf_Shdr *shdr,
-		Binary* binary)
+static void print_load_order(Binary* binary, XplddState& state)
 {
-	size_t shstrndx;
-	if (elf_getshdrstrndx (e, &shstrndx) < 0) {
-		cerr << "elf_getshdrstrndx\n";
-		return false;
-	}
-	Elf_Data *data = elf_getdata (scn, nullptr);
-	if (data == nullptr) {
-		cerr << "elf_getdata\n";
-		return false;
-	}
-	GElf_Shdr glink_mem;
-	GElf_Shdr *glink = gelf_getshdr (elf_getscn (e, shdr->sh_link), &glink_mem);
-	if (glink == nullptr) {
-		cerr << "gelf_getshdr for glink\n";
-		return false;
-	}
-	size_t sh_entsize = gelf_fsize (e, ELF_T_DYN, 1, EV_CURRENT);
-
-	for (size_t cnt = 0; cnt < shdr->sh_size / sh_entsize; ++cnt) {
-		GElf_Dyn dynmem;
-		GElf_Dyn *dyn = gelf_getdyn (data, cnt, &dynmem);
-		if (dyn == nullptr) {
-			cerr << "gelf_getdyn\n";
-			break;
+	vector<string> order;
+	state.load_order(binary->_name, order);
+	for (size_t i = 1; i < order.size(); i++) {
+		cout << "\t" << order[i] << "\n";
+	}
+}
+
+// Each shortest chain of libraries from binary to what --why asked about,
+// one per line.
+static void print_why(Binary* binary, XplddState& state)
+{
+	vector<vector<string>> paths;
+	bool complete = state.why(binary->_name, state._why, state._why_all, paths);
+	if (paths.empty()) {
+		cerr << state._why << " isn't needed\n";
+		return;
+	}
+	for (auto& path : paths) {
+		cout << "\t";
+		for (size_t i = 1; i < path.size(); i++) {
+			cout << (i > 1 ? " -> " : "") << path[i];
 		}
+		cout << "\n";
+	}
+	if (!complete) {
+		cerr << "too many paths to " << state._why << ", only showing some\n";
+	}
+}
 
-		switch (dyn->d_tag) {
-		case DT_NEEDED:
-			binary->_depends.push_back(elf_strptr (e, shdr->sh_link, dyn->d_un.d_val));
-			break;
-		case DT_RPATH:
-			binary->_rpath.push_back(elf_strptr (e, shdr->sh_link, dyn->d_un.d_val));
-			break;
+static bool hash_file(VfsFile *f, uint64_t& hash)
+{
+	uint64_t size = f->size();
+	const unsigned char *data = size == 0 ? nullptr : f->map(0, size);
+	if (size != 0 && data == nullptr) {
+		// can't be mapped, so it has to be read in
+		vector<unsigned char> buf(size);
+		if (f->read(0, buf.data(), size) != (ssize_t)size) {
+			return false;
 		}
+		hash = xxh64(buf.data(), size, 0);
+		return true;
 	}
+	hash = xxh64(data, size, 0);
 	return true;
 }
 
-static bool process_file(string& file, XplddState& state)
+// Hashes the contents of every file in each root's closure, each file (by
+// inode) once no matter how many roots or paths lead to it, and all of them
+// in parallel. Then each root gets a digest of those hashes in load order,
+// so it changes when any library does, or when the order they'd be loaded
+// in does. A name that didn't resolve goes in as the name, so the digest
+// changes once it does resolve.
+static void print_fingerprints(vector<string>& roots, XplddState& state)
 {
-	bool failed = false;
-	Elf *e;
-	int fd;
-	Elf_Scn *scn = nullptr;
-
-	vector<string> combined_rpath;
+	vector<vector<string>> orders(roots.size());
+	map<pair<dev_t, ino_t>, size_t> inodes;
+	map<string, size_t> owners;
+	vector<string> paths;
+	for (size_t i = 0; i < roots.size(); i++) {
+		state.load_order(roots[i], orders[i]);
+		for (auto& path : orders[i]) {
+			struct stat st;
+			if (path[0] != '/' || owners.count(path) || state._vfs->stat(path, st) != 0) {
+				continue;
+			}
+			auto inode = inodes.emplace(make_pair(st.st_dev, st.st_ino), paths.size());
+			if (inode.second) {
+				paths.push_back(path);
+			}
+			owners[path] = inode.first->second;
+		}
+	}
 
-	Binary *binary = new Binary();
-	binary->_name = file;
+	// the VFS opens them (it isn't for sharing between threads), and the
+	// pool only gets the mappings
+	vector<VfsFile*> files;
+	state._vfs->open_many(paths, files);
+	vector<uint64_t> hashes(files.size());
+	vector<char> hashed(files.size());
+	ThreadPool pool(ThreadPool::default_threads());
+	pool.parallel_for(files.size(), [&](size_t i) {
+		hashed[i] = files[i] != nullptr && hash_file(files[i], hashes[i]);
+	});
+	state._vfs->close_many(files);
+	for (size_t i = 0; i < paths.size(); i++) {
+		if (!hashed[i]) {
+			cerr << paths[i] << ": couldn't be hashed\n";
+		}
+	}
 
-	if ((fd = open(file.c_str(), O_RDONLY, 0)) == -1) {
-		cerr << "fd open\n";
-		return false;
+	for (size_t i = 0; i < roots.size(); i++) {
+		if (orders[i].empty()) {
+			continue;
+		}
+		// tagged, so a name can never read as someone's hash
+		vector<unsigned char> buf;
+		for (auto& path : orders[i]) {
+			auto owner = owners.find(path);
+			if (owner != owners.end() && hashed[owner->second]) {
+				buf.push_back('H');
+				for (int b = 0; b < 8; b++) {
+					buf.push_back(hashes[owner->second] >> (b * 8));
+				}
+			} else {
+				buf.push_back('N');
+				buf.insert(buf.end(), path.begin(), path.end());
+				buf.push_back('\0');
+			}
+		}
+		char digest[17];
+		snprintf(digest, sizeof(digest), "%016llx",
+			(unsigned long long)xxh64(buf.data(), buf.size(), 0));
+		cout << digest << "  " << roots[i] << "\n";
 	}
-	e = elf_begin(fd, ELF_C_READ, nullptr);
-	if (elf_kind (e) != ELF_K_ELF) {
-		cerr << "wrong elf kind\n";
-		failed = true;
-		goto err1;
+}
+
+static void print_tree(Binary* binary, XplddState& state)
+{
+	print_tree_deps(binary, state);
+	vector<int> reached;
+	state.components(binary, reached);
+	report_cycles(reached, state);
+}
+
+// the path relative to the -P prefix, so graphs from two roots line up
+static string_view strip_prefix(string_view path, Resolver& state)
+{
+	const string& prefix = state._prefix;
+	if (prefix.empty() || path.compare(0, prefix.size(), prefix) != 0
+			|| (path.size() > prefix.size() && path[prefix.size()] != '/')) {
+		return path;
 	}
+	return path.substr(prefix.size());
+}
 
-	// prep, scan
-	while ((scn = elf_nextscn (e, scn)) != nullptr) {
-		GElf_Shdr shdr_mem;
-		GElf_Shdr *shdr = gelf_getshdr (scn, &shdr_mem);
-		if (shdr == nullptr) {
-			cerr << "gelf_getshdr for dyn\n";
-			failed = true;
-			goto err1;
+static void build_graph(vector<string>& roots, Resolver& state, LiveGraph& graph)
+{
+	for (auto& root : roots) {
+		graph.add_root(strip_prefix(root, state));
+	}
+	vector<string_view> targets;
+	for (auto iter = state._found_binaries.begin(); iter != state._found_binaries.end(); ++iter) {
+		Binary *binary = iter->second;
+		if (binary == nullptr) {
+			continue;
+		}
+		targets.clear();
+		for (auto& dep : binary->_depends) {
+			targets.push_back(strip_prefix(dep, state));
 		}
+		graph.add_node(strip_prefix(iter->first, state), binary->_needed, targets);
+	}
+	graph.finish();
+}
 
-		if (shdr->sh_type == SHT_DYNAMIC) {
-			if (!handle_dynamic(e, scn, shdr, binary)) {
-				failed |= true;
+// Where path goes under the --bundle directory: the same place as under the
+// prefix, so rpaths still work in a chroot of it. A program given by a
+// relative path is taken from the current directory (or the top of an
+// archive or layers, where it was looked up); false if that isn't under
+// the prefix, so there's nowhere to put it.
+static bool bundle_path(const string& path, XplddState& state, string& dest)
+{
+	string full = path;
+	if (path[0] != '/') {
+		filesystem::path rel(path);
+		if (!state._archive_path.empty() || state._layers.size() > 1) {
+			full = (filesystem::path("/") / rel).lexically_normal().string();
+		} else {
+			full = filesystem::absolute(rel).lexically_normal().string();
+			if (!state._prefix.empty() && strip_prefix(full, state).size() == full.size()) {
+				return false;
 			}
 		}
 	}
+	string rel(strip_prefix(full, state));
+	dest = state._bundle_dir + (rel[0] == '/' ? "" : "/") + rel;
+	return true;
+}
 
-	state._found_binaries[file] = binary;
+// soname symlinks followed in one bundled file, like the loader's limit
+#define MAX_BUNDLE_LINKS 40
 
-	// insert all of original rpath plus Binary's (not ideal)
-	for (size_t i = 0; i < state._orig_rpath.size(); i++) {
-		combined_rpath.push_back(state._orig_rpath[i]);
+// Copies everything resolved into the --bundle directory. With
+// --bundle-symlinks, a symlink to a file in the same directory (i.e.
+// libz.so.1 to libz.so.1.2.13) is kept as one, with the file copied under
+// its own name, rather than copied under the link's.
+static bool bundle_closure(vector<string>& roots, XplddState& state)
+{
+	vector<BundleEntry> entries;
+	set<string> dests;
+	bool ok = true;
+	for (auto iter = state._found_binaries.begin(); iter != state._found_binaries.end(); ++iter) {
+		string path = iter->first, dest;
+		// anything else that isn't a path is a name that didn't resolve
+		if (iter->second == nullptr || (path[0] != '/'
+				&& find(roots.begin(), roots.end(), path) == roots.end())) {
+			continue;
+		}
+		string target, dir, name;
+		for (int hops = 0; state._bundle_links && hops < MAX_BUNDLE_LINKS
+				&& state._vfs->readlink(path, target) == 0
+				&& target.find('/') == string::npos
+				&& vfs_split(path, dir, name); hops++) {
+			if (bundle_path(path, state, dest) && dests.insert(dest).second) {
+				entries.push_back(BundleEntry(dest, "", target));
+			}
+			path = vfs_join(dir, target);
+		}
+		if (!bundle_path(path, state, dest)) {
+			cerr << path << ": not under " << state._prefix << ", so it can't be bundled\n";
+			ok = false;
+		} else if (dests.insert(dest).second) {
+			entries.push_back(BundleEntry(dest, path, ""));
+		}
 	}
-	for (size_t i = 0; i < binary->_rpath.size(); i++) {
-		combined_rpath.push_back(binary->_rpath[i]);
+	if (write_bundle(entries, *state._vfs)) {
+		return ok;
 	}
+	for (auto& entry : entries) {
+		if (entry._result != 0) {
+			cerr << entry._dest << ": " << strerror(-entry._result) << "\n";
+		}
+	}
+	return false;
+}
 
-	// now resolve it, and recurse as needed
-	for (size_t i = 0; i < binary->_depends.size(); i++) {
-		auto sym = resolve_symbol(binary->_depends[i], combined_rpath, state._prefix);
-		binary->_depends[i] = sym;
-		if (state._recurse) {
-			if (binary->_depends[i][0] != '/') {
-				// we want an absolute path, not an unresolved one
-				continue;
-			}
-			if (state._found_binaries.count(binary->_depends[i])) {
-				// no need to reprocess a binary we already have
-				continue;
+// One side of --diff: a saved graph, or the roots resolved (relative to
+// the top of it) in a sysroot directory, an archive, or what -P and -A say
+// if side is empty.
+static DepGraph *load_side(const string& side, vector<string>& roots, XplddState& state,
+		StringTable& strings, string& error)
+{
+	Resolver resolver;
+	resolver._orig_rpath = state._orig_rpath;
+	resolver._recurse = state._recurse;
+	resolver._soname_index = state._soname_index;
+	resolver._io = state._io;
+	struct stat st;
+	if (side.empty()) {
+		resolver._archive_path = state._archive_path;
+		resolver._layers = state._layers;
+		resolver._prefix = state._prefix;
+		resolver._cache_path = state._cache_path;
+	} else if (stat(side.c_str(), &st) == -1) {
+		error = side + ": " + strerror(errno);
+		return nullptr;
+	} else if (S_ISDIR(st.st_mode)) {
+		resolver._prefix = side;
+		resolver._cache_path = state._cache_path;
+	} else {
+		unsigned char head[8];
+		int fd = open(side.c_str(), O_RDONLY | O_CLOEXEC);
+		ssize_t got = fd == -1 ? -1 : read(fd, head, sizeof(head));
+		if (fd != -1) {
+			close(fd);
+		}
+		if (got > 0 && SnapshotGraph::is_snapshot(head, got)) {
+			SnapshotGraph *snapshot = new SnapshotGraph(strings);
+			if (!snapshot->load(side, error)) {
+				error = side + ": " + error;
+				delete snapshot;
+				return nullptr;
 			}
-			process_file(binary->_depends[i], state);
-		} else {
-			// the binaries won't get added into the list
-			// unless we go into process_file, but since we're
-			// skipping that, add a skeleton
-			Binary* child = new Binary();
-			child->_name = binary->_depends[i];
-			state._found_binaries[binary->_depends[i]] = child;
+			return snapshot;
 		}
+		resolver._archive_path = side;
+	}
+	if (!resolver.open(error)) {
+		return nullptr;
 	}
 
-err1:
-	elf_end(e);
-	close(fd);
-	return !failed;
+	vector<string> names;
+	for (auto& root : roots) {
+		string name = resolver._prefix + root;
+		state._done++;
+		if (!resolver.resolve(name)) {
+			state._failed++;
+		}
+		names.push_back(name);
+	}
+	LiveGraph *graph = new LiveGraph(strings);
+	build_graph(names, resolver, *graph);
+	return graph;
 }
 
-static void gather_flat_deps(set<string>& all_deps, Binary* binary, XplddState& state)
+static bool run_diff(vector<string>& roots, XplddState& state)
 {
-	for (auto iter = binary->_depends.begin(); iter != binary->_depends.end(); ++iter) {
-		all_deps.insert(*iter);
-		Binary* next = state._found_binaries[*iter];
-		if (next != nullptr) {
-			gather_flat_deps(all_deps, next, state);
+	// both sides intern into the same table, so edges compare by id
+	StringTable strings;
+	DepGraph *sides[2] = { nullptr, nullptr };
+	for (size_t i = 0; i < 2; i++) {
+		string side = i < state._diff.size() ? state._diff[i] : "";
+		string error;
+		sides[i] = load_side(side, roots, state, strings, error);
+		if (sides[i] == nullptr) {
+			cerr << error << "\n";
+			break;
 		}
 	}
+	bool ok = sides[0] != nullptr && sides[1] != nullptr;
+	if (ok) {
+		diff_graphs(*sides[0], *sides[1], strings, cout);
+	}
+	delete sides[0];
+	delete sides[1];
+	return ok;
 }
 
-static void print_flat_deps(Binary* binary, XplddState& state)
+static void print_json_string(string_view str)
 {
-	set<string> all_deps;
-	gather_flat_deps(all_deps, binary, state);
-	for (auto iter = all_deps.begin(); iter != all_deps.end(); ++iter) {
-		cout << "\t" << *iter << "\n";
+	cout << '"';
+	for (unsigned char c : str) {
+		if (c == '"' || c == '\\') {
+			cout << '\\' << c;
+		} else if (c < 0x20) {
+			char escape[7];
+			snprintf(escape, sizeof(escape), "\\u%04x", c);
+			cout << escape;
+		} else {
+			cout << c;
+		}
+	}
+	cout << '"';
+}
+
+static void print_json_list(const vector<string>& list)
+{
+	cout << '[';
+	for (size_t i = 0; i < list.size(); i++) {
+		if (i != 0) {
+			cout << ',';
+		}
+		print_json_string(list[i]);
+	}
+	cout << ']';
+}
+
+// One root's closure for --watch; resolved is false if the root itself
+// wasn't.
+class WatchedRoot {
+public:
+	std::string _name;
+	bool _resolved;
+	std::vector<std::string> _closure;
+};
+
+static void watch_dirs(DirWatch& watch, XplddState& state)
+{
+	vector<string> dirs;
+	state.search_dirs(dirs);
+	for (auto& dir : dirs) {
+		// directories in a search path often don't exist yet, so
+		// their parents are watched for them to turn up
+		watch.add(dir);
 	}
 }
 
-static void print_tree_deps(Binary* binary, XplddState& state, int depth)
+// Prints root's closure if it's new or changed since last time, as a JSON
+// line: "closure" with all of it the first time (or once the root resolves
+// again), "changed" with what was added and removed after that, and
+// "unresolved" if the root stops resolving.
+static void emit_closure(WatchedRoot& root, XplddState& state, bool first)
 {
-	if (depth > 0) {
-		for (int i = 0; i < depth; i++) {
-			cout << "\t";
+	bool resolved = state.find(root._name) != nullptr;
+	vector<string> closure;
+	state.closure(root._name, closure);
+	if (!resolved) {
+		if (first || root._resolved) {
+			cout << "{\"event\":\"unresolved\",\"root\":";
+			print_json_string(root._name);
+			cout << "}\n";
 		}
-		cout << binary->_name << "\n";
+	} else if (first || !root._resolved) {
+		cout << "{\"event\":\"closure\",\"root\":";
+		print_json_string(root._name);
+		cout << ",\"closure\":";
+		print_json_list(closure);
+		cout << "}\n";
+	} else if (closure != root._closure) {
+		// both sorted
+		vector<string> added, removed;
+		set_difference(closure.begin(), closure.end(),
+			root._closure.begin(), root._closure.end(), back_inserter(added));
+		set_difference(root._closure.begin(), root._closure.end(),
+			closure.begin(), closure.end(), back_inserter(removed));
+		cout << "{\"event\":\"changed\",\"root\":";
+		print_json_string(root._name);
+		cout << ",\"added\":";
+		print_json_list(added);
+		cout << ",\"removed\":";
+		print_json_list(removed);
+		cout << "}\n";
+	}
+	root._resolved = resolved;
+	root._closure = closure;
+}
+
+// Resolves the roots, then keeps their closures up to date for as long as
+// it runs: the directories resolution looked in are watched, and when files
+// in them change, only those are parsed again (each noted with a
+// "reparsed" line) before the closures affected are printed again. Only
+// returns if watching fails.
+static int watch_closures(vector<string>& roots, XplddState& state)
+{
+	DirWatch watch;
+	string error;
+	if (!watch.open(error)) {
+		cerr << error << "\n";
+		return 1;
 	}
-	for (auto iter = binary->_depends.begin(); iter != binary->_depends.end(); ++iter) {
-		Binary* next = state._found_binaries[*iter];
-		if (next != nullptr) {
-			print_tree_deps(next, state, depth + 1);
+	vector<WatchedRoot> watched;
+	for (auto& name : roots) {
+		state.resolve(name);
+		watched.push_back({ name, false, {} });
+	}
+	watch_dirs(watch, state);
+	for (auto& root : watched) {
+		emit_closure(root, state, true);
+	}
+	cout.flush();
+
+	vector<string> changed, reparsed;
+	bool overflow;
+	while (watch.wait(changed, overflow, error)) {
+		if (overflow) {
+			// no telling what was missed, so everything is suspect
+			for (auto& found : state._found_binaries) {
+				changed.push_back(found.first);
+			}
+		}
+		// a directory that's turned up is watched before it's read, so
+		// nothing put in it after that can be missed
+		watch_dirs(watch, state);
+		state.refresh(changed, reparsed);
+		for (auto& root : watched) {
+			// a root that didn't resolve is tried again once it (or a
+			// directory it's in) changes
+			if (state.find(root._name) != nullptr) {
+				continue;
+			}
+			for (auto& path : changed) {
+				if (vfs_within(root._name, path)) {
+					state.resolve(root._name);
+					break;
+				}
+			}
 		}
+		for (auto& path : reparsed) {
+			cout << "{\"event\":\"reparsed\",\"path\":";
+			print_json_string(path);
+			cout << "}\n";
+		}
+		watch_dirs(watch, state);
+		for (auto& root : watched) {
+			emit_closure(root, state, false);
+		}
+		cout.flush();
 	}
+	cerr << error << "\n";
+	return 1;
 }
 
+// past what a short option could be
+enum LongOption {
+	OPT_DIFF = 256,
+	OPT_LOAD_ORDER,
+	OPT_FINGERPRINT,
+	OPT_BUNDLE,
+	OPT_BUNDLE_LINKS,
+	OPT_SAVE,
+	OPT_CACHE,
+	OPT_TIMEOUT,
+	OPT_WATCH,
+	OPT_WHY,
+	OPT_ALL_PATHS,
+	OPT_SONAME_INDEX,
+};
+
 int main (int argc, char **argv)
 {
 	XplddState state;
+	static const struct option long_options[] = {
+		{ "diff", required_argument, nullptr, OPT_DIFF },
+		{ "load-order", no_argument, nullptr, OPT_LOAD_ORDER },
+		{ "fingerprint", no_argument, nullptr, OPT_FINGERPRINT },
+		{ "bundle", required_argument, nullptr, OPT_BUNDLE },
+		{ "bundle-symlinks", no_argument, nullptr, OPT_BUNDLE_LINKS },
+		{ "save", required_argument, nullptr, OPT_SAVE },
+		{ "cache", required_argument, nullptr, OPT_CACHE },
+		{ "timeout", required_argument, nullptr, OPT_TIMEOUT },
+		{ "watch", no_argument, nullptr, OPT_WATCH },
+		{ "why", required_argument, nullptr, OPT_WHY },
+		{ "all-paths", no_argument, nullptr, OPT_ALL_PATHS },
+		{ "soname-index", no_argument, nullptr, OPT_SONAME_INDEX },
+		{ nullptr, 0, nullptr, 0 },
+	};
 
 	// args
 	int ch;
-	while ((ch = getopt(argc, argv, "R:P:nt")) != -1) {
+	while ((ch = getopt_long(argc, argv, "A:I:R:P:nt", long_options, nullptr)) != -1) {
 		switch (ch) {
+		case 'A':
+			state._archive_path = optarg;
+			break;
+		case 'I':
+			state._io_name = optarg;
+			break;
 		case 'R':
 			state._orig_rpath.push_back(optarg);
 			break;
 		case 'P':
-			state._prefix = optarg;
+			state._layers.push_back(optarg);
 			break;
 		case 'n':
 			state._recurse = false;
@@ -255,40 +703,167 @@ int main (int argc, char **argv)
 		case 't':
 			state._tree = true;
 			break;
+		case OPT_LOAD_ORDER:
+			state._load_order = true;
+			break;
+		case OPT_FINGERPRINT:
+			state._fingerprint = true;
+			break;
+		case OPT_BUNDLE:
+			state._bundle_dir = optarg;
+			break;
+		case OPT_BUNDLE_LINKS:
+			state._bundle_links = true;
+			break;
+		case OPT_DIFF:
+			state._diff.push_back(optarg);
+			break;
+		case OPT_SAVE:
+			state._save_path = optarg;
+			break;
+		case OPT_CACHE:
+			state._cache_path = optarg;
+			break;
+		case OPT_TIMEOUT: {
+			// a whole number of milliseconds, and nothing after it
+			char *end;
+			errno = 0;
+			long ms = strtol(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || errno == ERANGE
+					|| ms <= 0 || ms > INT_MAX) {
+				usage(argv[0]);
+				return 1;
+			}
+			state._timeout_ms = ms;
+			break;
+		}
+		case OPT_WATCH:
+			state._watch = true;
+			break;
+		case OPT_WHY:
+			state._why = optarg;
+			break;
+		case OPT_ALL_PATHS:
+			state._why_all = true;
+			break;
+		case OPT_SONAME_INDEX:
+			state._soname_index = true;
+			break;
 		default:
 			usage(argv[0]);
 			return 1;
 		}
 	}
-	if (optind == argc) {
+	if (optind == argc || state._diff.size() > 2
+			|| (!state._diff.empty() && (!state._save_path.empty() || !state._bundle_dir.empty()))
+			|| (state._bundle_links && state._bundle_dir.empty())
+			|| (state._tree + state._load_order + state._fingerprint + !state._why.empty() > 1)
+			|| (state._why_all && state._why.empty())
+			|| (!state._why.empty() && (!state._diff.empty() || state._watch))
+			|| (!state._diff.empty() && state._fingerprint)
+			|| (state._watch && (state._tree || state._load_order || state._fingerprint
+				|| !state._diff.empty() || !state._bundle_dir.empty()
+				|| !state._save_path.empty() || !state._recurse))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// made up front, since a bad name is a usage error, and --diff shares
+	// it between both sides
+	if ((state._io = make_io_engine(state._io_name, state._timeout_ms)) == nullptr) {
+		if (state._timeout_ms != 0) {
+			cerr << "only the threads I/O engine can time out\n";
+		}
+		usage(argv[0]);
+		return 1;
+	}
+	state._owns_io = true;
+	if (state._layers.size() == 1) {
+		state._prefix = state._layers[0];
+	}
+	if (!state._archive_path.empty() && state._layers.size() > 1) {
+		cerr << "can't stack layers inside an archive\n";
+		usage(argv[0]);
+		return 1;
+	}
+	if (!state._cache_path.empty() && (!state._archive_path.empty() || state._layers.size() > 1)) {
+		cerr << "the parse cache only works with the host's files\n";
+		usage(argv[0]);
+		return 1;
+	}
+	if (state._watch && (!state._archive_path.empty() || state._layers.size() > 1)) {
+		cerr << "only the host's files can be watched\n";
 		usage(argv[0]);
 		return 1;
 	}
 
-	elf_version (EV_CURRENT);
-	for (int i = optind; i < argc; i++) {
+	vector<string> roots(argv + optind, argv + argc);
+	if (!state._diff.empty()) {
+		bool ok = run_diff(roots, state);
+		// both sides can be saved graphs, with nothing to resolve
+		if (!ok || (state._done > 0 && state._failed == state._done)) {
+			return 3;
+		}
+		return state._failed ? 2 : 0;
+	}
+
+	{
+		string error;
+		if (!state.open(error)) {
+			cerr << error << "\n";
+			return 1;
+		}
+	}
+	if (state._watch) {
+		return watch_closures(roots, state);
+	}
+	for (auto& name : roots) {
 		state._done++;
-		string name(argv[i]);
-		cout << name << ":\n";
-		if (!process_file(name, state)) {
+		if (!state._fingerprint) {
+			cout << name << ":\n";
+		}
+		if (!state.resolve(name)) {
 			// failure isn't fatal, but it means we had an issue
 			state._failed++;
 		}
-		Binary* binary = state._found_binaries[name];
+		Binary* binary = state.find(name);
 		if (binary == nullptr) {
-			cerr << "binary couldn't be resolved\n";
+			// archives are listed as they're scanned; find, since a
+			// root that couldn't be opened has no ident to make up
+			auto ident = state._idents.find(name);
+			if (ident == state._idents.end() || ident->second._kind != IDENT_ARCHIVE) {
+				cerr << "binary couldn't be resolved\n";
+			}
 			continue;
 		}
-		if (state._tree) {
-			print_tree_deps(binary, state, 0);
+		if (state._fingerprint) {
+			// printed once everything is resolved
+			continue;
+		} else if (state._tree) {
+			print_tree(binary, state);
+		} else if (state._load_order) {
+			print_load_order(binary, state);
+		} else if (!state._why.empty()) {
+			print_why(binary, state);
 		} else {
 			print_flat_deps(binary, state);
 		}
 	}
-
-	// cleanup
-	for (auto iter = state._found_binaries.begin(); iter != state._found_binaries.end(); ++iter) {
-		delete iter->second;
+	if (state._fingerprint) {
+		print_fingerprints(roots, state);
+	}
+	if (!state._bundle_dir.empty() && !bundle_closure(roots, state)) {
+		return 1;
+	}
+	if (!state._save_path.empty()) {
+		StringTable strings;
+		LiveGraph graph(strings);
+		string error;
+		build_graph(roots, state, graph);
+		if (!graph.save(state._save_path, error)) {
+			cerr << state._save_path << ": " << error << "\n";
+			return 1;
+		}
 	}
 
 	// if all failed vs. none